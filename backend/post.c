@@ -110,6 +110,36 @@ static int handle_mention(const char *user_name, post_id_t post_id, void *args)
 	return 0;
 }
 
+static void update_hot_topic(const backend_request_post_new_t *req,
+		const board_t *board, post_id_t post_id, fb_time_t stamp)
+{
+	if (hot_topic_excluded(board))
+		return;
+
+	topic_stat_t topic = {
+		.tid = req->thread_id ? req->thread_id : post_id,
+		.last = stamp,
+		.bid = board->id,
+	};
+	strlcpy(topic.bname, board->name, sizeof(topic.bname));
+
+	if (!req->thread_id) {
+		strlcpy(topic.utf8_title, req->title, sizeof(topic.utf8_title));
+		strlcpy(topic.owner, req->user_name, sizeof(topic.owner));
+	} else if (!hot_topic_tracked(topic.tid)) {
+		db_res_t *res = db_query("SELECT user_name, title FROM post.recent"
+				" WHERE id = %"DBIdPID, topic.tid);
+		if (res && db_res_rows(res) == 1) {
+			strlcpy(topic.owner, db_get_value(res, 0, 0),
+					sizeof(topic.owner));
+			strlcpy(topic.utf8_title, db_get_value(res, 0, 1),
+					sizeof(topic.utf8_title));
+		}
+		db_clear(res);
+	}
+	hot_topic_update(&topic, req->user_id);
+}
+
 BACKEND_DECLARE(post_new)
 {
 	backend_request_post_new_t req;
@@ -142,6 +172,8 @@ BACKEND_DECLARE(post_new)
 				post_scan_for_mentions(req.title, req.content, post_id,
 						handle_mention, &args);
 			}
+
+			update_hot_topic(&req, &board, post_id, stamp);
 		}
 		return true;
 	}
@@ -235,7 +267,7 @@ static int _backend_post_delete(const backend_request_post_delete_t *req)
 			" current_timestamp, %"DBIdUID", %s, %b AND (water OR %b), %b"
 			" FROM rows", req->user_id, req->user_name, decrease, req->junk,
 			req->bm_visible);
-	query_append(q, "RETURNING id, user_id, user_name, junk");
+	query_append(q, "RETURNING id, user_id, user_name, junk, thread_id");
 
 	db_res_t *res = query_exec(q);
 	int rows = 0;
@@ -248,7 +280,10 @@ static int _backend_post_delete(const backend_request_post_delete_t *req)
 				adjust_user_post_count(user_name, -1);
 			}
 
-			remove_cached_content(db_get_post_id(res, i, 0));
+			post_id_t post_id = db_get_post_id(res, i, 0);
+			remove_cached_content(post_id);
+			if (post_id == db_get_post_id(res, i, 4))
+				hot_topic_remove(post_id);
 		}
 		if (rows > 0)
 			post_record_invalidity_change(req->filter->bid, 1);
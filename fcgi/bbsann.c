@@ -22,7 +22,8 @@ static bool hasannperm(const char *title, const struct userec *user,
 static char *getbfroma(const char *path)
 {
 	FILE *fp;
-	static char buf1[256], buf2[256];
+	static FB_THREAD_LOCAL char buf1[256];
+	char buf2[256];
 	memset(buf1, '\0', sizeof(buf1));
 	memset(buf2, '\0', sizeof(buf2));
 	if (path == NULL || *path == '\0')
@@ -32,7 +33,7 @@ static char *getbfroma(const char *path)
 	if (fp == NULL)
 		return "";
 	while (true) {
-		if(fscanf(FCGI_ToFILE(fp), "%s %s", buf1, buf2) <= 0)
+		if(fscanf(fp, "%s %s", buf1, buf2) <= 0)
 			break;
 		if (*buf1 != '\0')
 			buf1[strlen(buf1) - 1] = '\0';
@@ -15,7 +15,7 @@ static int http_fatal2(int status, const char *prompt)
 			//% "<a href=javascript:history.go(-1)>快速返回</a></body></html>",
 			"<a href=javascript:history.go(-1)>\xbf\xec\xcb\xd9\xb7\xb5\xbb\xd8</a></body></html>",
 			prompt);
-	FCGI_Finish();
+	web_finish();
 	return 0;
 }
 
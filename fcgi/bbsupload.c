@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "libweb.h"
 #include "record.h"
 #include "fbbs/board.h"
@@ -22,14 +23,14 @@ static bool quota_exceeded(const char *board)
 		sprintf(cmd, "%s/.size", path);
 		if ((fp = fopen(cmd, "r")) == NULL)
 			return true;
-		ret = fscanf(FCGI_ToFILE(fp), "%d", &now);
+		ret = fscanf(fp, "%d", &now);
 		fclose(fp);
 		if (ret <= 0)
 			return true;
 
 		sprintf(cmd, "%s/.quota", path);
 		if((fp = fopen(cmd, "r")) != NULL) {
-			if (fscanf(FCGI_ToFILE(fp), "%d", &all) <= 0)
+			if (fscanf(fp, "%d", &all) <= 0)
 				all = 0;
 			fclose(fp);
 		}
@@ -43,8 +44,8 @@ static bool quota_exceeded(const char *board)
 static int addtodir(const char *board, const char *tmpfile) 
 {
 	char file[100], dir[100], url_filename[256];
-	static struct fileheader x;
-	
+	struct fileheader x;
+	memset(&x, 0, sizeof(x));
 	x.reid = 1;
 	strlcpy(x.owner, currentuser.userid, sizeof(x.owner));
 	strlcpy(x.filename, tmpfile, sizeof(x.filename));
@@ -77,40 +78,77 @@ static int addtodir(const char *board, const char *tmpfile)
 	return 0;
 }
 
-static bool check_upload(char *buf, size_t size, char **begin, char **end, char **fileext)
+enum {
+	UPLOAD_CHUNK = 8192, ///< 每次读取和写入的字节数
+	UPLOAD_BOUNDARY_MAX = 128, ///< 含前导"\r\n--"的分隔行长度上限
+	UPLOAD_EXT_MAX = 8,
+};
+
+/** multipart正文的读取状态 */
+typedef struct {
+	size_t remain; ///< 尚未读取的正文字节数
+	size_t len; ///< buf中的字节数
+	char buf[UPLOAD_CHUNK + UPLOAD_BOUNDARY_MAX];
+} upload_reader_t;
+
+/** 尽量填满缓冲区, 返回是否读到了新数据 */
+static bool upload_fill(upload_reader_t *r)
 {
-	if (fread(buf, 1, size, stdin) < size)
-		return false;
-	char *bufend = buf + size;
-	// find boundary
-	char *p = memchr(buf, '\r', size);
-	if (p == NULL)
+	size_t size = sizeof(r->buf) - r->len;
+	if (size > r->remain)
+		size = r->remain;
+	if (!size)
 		return false;
-	*p = '\0';
-	const char *boundary = buf;
-	// line containing 'filename="xxxx"'
-	char *fname = p + 2;  // "\r\n"
-	if (fname > bufend)
-		return false;
-	p = memchr(fname, '\r', bufend - fname);
-	if (p == NULL)
+	size_t bytes = web_read(r->buf + r->len, size);
+	r->len += bytes;
+	r->remain = bytes < size ? 0 : r->remain - bytes;
+	return bytes > 0;
+}
+
+static void upload_consume(upload_reader_t *r, size_t size)
+{
+	memmove(r->buf, r->buf + size, r->len - size);
+	r->len -= size;
+}
+
+/**
+ * 读取分隔行和第一个部分的头, 检查文件扩展名
+ * @param[in,out] r 读取状态, 返回时缓冲区从文件内容开始
+ * @param[out] delim 文件内容之后的分隔串("\r\n--boundary")
+ * @param[out] fileext 扩展名
+ * @return 成功true
+ */
+static bool upload_read_header(upload_reader_t *r, char *delim, char *fileext)
+{
+	upload_fill(r);
+	char *p = memmem(r->buf, r->len, "\r\n", 2);
+	if (!p || p == r->buf || p - r->buf + 2 >= UPLOAD_BOUNDARY_MAX)
 		return false;
+	size_t blen = p - r->buf;
+	memcpy(delim, "\r\n", 2);
+	memcpy(delim + 2, r->buf, blen);
+	delim[blen + 2] = '\0';
+	upload_consume(r, blen + 2);
+
+	// 部分的头须在缓冲区内读完
+	while (!(p = memmem(r->buf, r->len, "\r\n\r\n", 4))) {
+		if (r->len == sizeof(r->buf) || !upload_fill(r))
+			return false;
+	}
 	*p = '\0';
+	char *header = r->buf;
+	size_t hlen = p - r->buf + 4;
 
 	// parse filename
-	fname = strstr(fname, "filename=\"");
+	char *fname = strstr(header, "filename=\"");
 	if (fname == NULL)
 		return false;
-	p = strrchr(fname, '\\'); // windows path symbol
-	if (p != NULL) {
-		fname = p + 1;
-	} else {
-		// moz-browsers don't give out full path, just the very filename,
-		// so no parsing needed
-		fname += strlen("filename=\"");
-	}
+	fname += strlen("filename=\"");
 	if ((p = strchr(fname, '\"')) != NULL)
 		*p = '\0';
+	p = strrchr(fname, '\\'); // windows path symbol
+	if (p != NULL)
+		fname = p + 1;
 	// Check filename extension
 	// Only .jpg/.jpeg/.gif/.png/.pdf are allowed.
 	p = strrchr(fname, '.');
@@ -119,22 +157,65 @@ static bool check_upload(char *buf, size_t size, char **begin, char **end, char
 			&& strcasecmp(p, ".PDF"))) {
 		return false;
 	}
-	*fileext = p;
-	// skip 2 lines
-	p = memchr(p, '\r', bufend - p);
-	if (p == NULL || ++p == bufend)
-		return false;
-	p = memchr(p, '\r', bufend - p);
-	if (p == NULL || p + 2 >= bufend)
-		return false;
-	*begin = p + 2;
-	// [content]\r\n[boundary]\r\n
-	*end = bufend - 4 - strlen(boundary);
-	if (*end < *begin + 1)
-		return false;
+	strlcpy(fileext, p, UPLOAD_EXT_MAX);
+
+	upload_consume(r, hlen);
 	return true;
 }
 
+/**
+ * 将文件内容分块写入fd, 直到分隔串
+ * @param[in,out] r 读取状态
+ * @param[in] delim 分隔串
+ * @param[in] fd 文件描述符
+ * @param[in] max 文件长度上限
+ * @return 文件长度, 出错返回BBS_EINVAL等错误码(负数)
+ */
+static int upload_copy(upload_reader_t *r, const char *delim, int fd, int max)
+{
+	size_t dlen = strlen(delim), total = 0;
+	while (true) {
+		char *p = memmem(r->buf, r->len, delim, dlen);
+		size_t size = p ? p - r->buf
+				: (r->len >= dlen ? r->len - dlen + 1 : 0);
+		if (total + size > max)
+			return BBS_EFBIG;
+		if (size && file_write(fd, r->buf, size) != size)
+			return BBS_EINTNL;
+		total += size;
+		if (p)
+			return total ? total : BBS_EINVAL;
+		upload_consume(r, size);
+		if (!upload_fill(r))
+			return BBS_EINVAL;
+	}
+}
+
+/**
+ * 将上传的文件放到版面目录下, 以文件名不重复为止
+ * @param[in] tmp 临时文件
+ * @param[in] board 版面名
+ * @param[in] fileext 扩展名
+ * @param[out] fname 文件名
+ * @param[in] size 长度
+ * @return 成功true
+ */
+static bool upload_install(const char *tmp, const char *board,
+		const char *fileext, char *fname, size_t size)
+{
+	for (int i = 0; i < 10; ++i) {
+		char fpath[HOMELEN];
+		snprintf(fname, size, "%ld-%04d%s", (long) time(NULL),
+				(int)(10000.0 * rand() / RAND_MAX), fileext);
+		snprintf(fpath, sizeof(fpath), BBSHOME"/upload/%s/%s", board, fname);
+		if (link(tmp, fpath) == 0)
+			return true;
+		if (errno != EEXIST)
+			break;
+	}
+	return false;
+}
+
 int bbspreupload_main(void)
 {
 	if (!session_get_id())
@@ -171,38 +252,41 @@ int bbsupload_main(void)
 		return BBS_ENOBRD;
 
 	size_t size = strtoul(getsenv("CONTENT_LENGTH"), NULL, 10);
-	if (size > UPLOAD_MAX + UPLOAD_OVERHEAD)
-		return BBS_EINVAL;
+	int max = maxlen(board.name);
+	if (size > max + UPLOAD_OVERHEAD)
+		return BBS_EFBIG;
+	if (quota_exceeded(board.name))
+		return BBS_EATTQE;
 
-	char *buf = malloc(size);
-	if (buf == NULL) 
+	upload_reader_t *r = web_palloc(sizeof(*r));
+	if (!r)
 		return BBS_EINTNL;
-	char *begin = NULL, *end = NULL, *fileext = NULL;
-	if (!check_upload(buf, size, &begin, &end, &fileext)) {
-		free(buf);
+	r->remain = size;
+	r->len = 0;
+
+	char delim[UPLOAD_BOUNDARY_MAX + 1], fileext[UPLOAD_EXT_MAX];
+	if (!upload_read_header(r, delim, fileext))
 		return BBS_EINVAL;
-	}
-	if (end - begin > maxlen(board.name)) {
-		free(buf);
-		return BBS_EFBIG;
-	}
-	if (quota_exceeded(board.name)) {
-		free(buf);
-		return BBS_EATTQE;
-	}
-	// TODO: Possible collison..
-	char fname[HOMELEN], fpath[HOMELEN];
-	sprintf(fname, "%ld-%04d%s", time(NULL), 
-			(int)(10000.0 * rand() / RAND_MAX), fileext);
-	snprintf(fpath, sizeof(fpath), BBSHOME"/upload/%s/%s", board.name, fname);
-	FILE *fp = fopen(fpath, "w");
-	if (fp != NULL) {
-		fwrite(begin, 1, end - begin, fp);
-		fclose(fp);
-	} else {
-		free(buf);
+
+	// 先写入同一目录下的临时文件, 完整收到后再链接到最终的文件名
+	char tmp[HOMELEN];
+	snprintf(tmp, sizeof(tmp), BBSHOME"/upload/%s/.upload.XXXXXX",
+			board.name);
+	int fd = mkstemp(tmp);
+	if (fd < 0)
 		return BBS_EINTNL;
-	}
-	free(buf);
+	fchmod(fd, 0644);
+
+	int ret = upload_copy(r, delim, fd, max);
+	if (file_close(fd) < 0 && ret >= 0)
+		ret = BBS_EINTNL;
+
+	char fname[HOMELEN];
+	if (ret >= 0 && !upload_install(tmp, board.name, fileext, fname,
+				sizeof(fname)))
+		ret = BBS_EINTNL;
+	unlink(tmp);
+	if (ret < 0)
+		return ret;
 	return addtodir(board.name, fname);
 }
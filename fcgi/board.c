@@ -159,7 +159,31 @@ int api_board_all(void)
 	return WEB_OK;
 }
 
-static json_object_t *attach_group(json_array_t *a, db_res_t *res, int id)
+/**
+ * 批量判断结果集中各版面是否有未读文章
+ * @param res 结果集
+ * @param col 版面ID所在列
+ * @return 以行号为下标的数组, 由调用者释放
+ */
+static bool *boards_unread(db_res_t *res, int col)
+{
+	int rows = db_res_rows(res);
+	int *bids = malloc(sizeof(*bids) * rows);
+	bool *unread = malloc(sizeof(*unread) * rows);
+	if (!bids || !unread) {
+		free(bids);
+		free(unread);
+		return NULL;
+	}
+	for (int i = 0; i < rows; ++i)
+		bids[i] = db_get_integer(res, i, col);
+	brc_boards_unread(currentuser.userid, bids, rows, unread);
+	free(bids);
+	return unread;
+}
+
+static json_object_t *attach_group(json_array_t *a, db_res_t *res,
+		const bool *unread, int id)
 {
 	json_object_t *object = json_object_new();
 	json_array_append(a, object, JSON_OBJECT);
@@ -177,8 +201,11 @@ static json_object_t *attach_group(json_array_t *a, db_res_t *res, int id)
 			json_object_integer(o, "id", board_id);
 			const char *name = db_get_value(res, i, 1);
 			json_object_string(o, "name", name);
-			json_object_bool(o, "unread",
-					brc_board_unread(currentuser.userid, name, board_id));
+			int count = 0;
+			if (!unread || unread[i])
+				count = brc_unread_count(currentuser.userid, name, board_id);
+			json_object_bool(o, "unread", count);
+			json_object_integer(o, "unread_count", count);
 		}
 	}
 	return object;
@@ -190,7 +217,8 @@ static json_object_t *attach_group(json_array_t *a, db_res_t *res, int id)
 		name: OPTIONAL TEXT,
 		descr: OPTIONAL TEXT,
 		boards: [
-			{ id: INTEGER, name: TEXT, unread: OPTIONAL BOOL },
+			{ id: INTEGER, name: TEXT, unread: OPTIONAL BOOL,
+				unread_count: OPTIONAL INTEGER },
 			...
 		]
 	},
@@ -218,13 +246,15 @@ int api_board_fav(void)
 	db_res_t *folders = query_exec(q);
 
 	if (folders && boards) {
-		attach_group(array, boards, FAV_BOARD_ROOT_FOLDER);
+		bool *unread = boards_unread(boards, 0);
+		attach_group(array, boards, unread, FAV_BOARD_ROOT_FOLDER);
 		for (int i = db_res_rows(folders) - 1; i >= 0; --i) {
 			int id = db_get_integer(folders, i, 0);
-			json_object_t *o = attach_group(array, boards, id);
+			json_object_t *o = attach_group(array, boards, unread, id);
 			json_object_string(o, "name", db_get_value(folders, i, 1));
 			json_object_string(o, "descr", db_get_value(folders, i, 2));
 		}
+		free(unread);
 	}
 
 	db_clear(folders);
@@ -392,6 +422,7 @@ int web_all_boards(void)
 
 static void show_board(db_res_t *res)
 {
+	bool *unread_boards = boards_unread(res, 0);
 	for (int i = 0; i < db_res_rows(res); ++i) {
 		board_t board;
 		res_to_board(res, i, &board);
@@ -399,13 +430,19 @@ static void show_board(db_res_t *res)
 			continue;
 		if (!web_request_type(UTF8))
 			board_to_gbk(&board);
+		board_stat_t stat;
+		board_stat_get(board.id, &stat);
+		int unread = 0;
+		if (!unread_boards || unread_boards[i])
+			unread = brc_unread_count(currentuser.userid, board.name,
+					board.id);
 		printf("<brd dir='%d' title='%s' cate='%.6s' desc='%s' bm='%s' "
-				"read='%d' count='%d' />",
+				"read='%d' count='%d' unread='%d' />",
 				(board.flag & BOARD_FLAG_DIR) ? 1 : 0, board.name,
-				board.categ, board.descr, board.bms,
-				brc_board_unread(currentuser.userid, board.name, board.id),
-				post_get_board_count(board.id));
+				board.categ, board.descr, board.bms, unread > 0,
+				stat.posts, unread);
 	}
+	free(unread_boards);
 }
 
 extern const char *get_post_list_type_string(void);
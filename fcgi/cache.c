@@ -0,0 +1,259 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libweb.h"
+#include "fbbs/string.h"
+#include "fbbs/time.h"
+#include "fbbs/web.h"
+
+/**
+ * @defgroup web_cache 匿名页面缓存
+ *
+ * 热门页面的完整响应(包括响应头, 可能已压缩)存放在共享内存中, 以脚本名,
+ * 排序后的查询参数及是否接受gzip为键, 直接映射到槽位. 过期后由一个工作
+ * 进程(线程)重新生成, 其余请求在此期间使用旧的内容; 没有旧内容时短暂等待.
+ * 只缓存未登录用户的GET请求.
+ */
+/** @{ */
+
+enum {
+	WEB_CACHE_SHMKEY = 30130,
+	WEB_CACHE_SLOTS = 128,
+	WEB_CACHE_KEY_LEN = 256,
+	WEB_CACHE_DATA_LEN = 96 * 1024,
+	WEB_CACHE_LOCK_TIMEOUT = 10, ///< 重新生成最多占用的秒数
+	WEB_CACHE_WAIT = 50, ///< 等待其他进程生成的次数, 每次10毫秒
+	WEB_CACHE_RETRY = 8,
+	WEB_CACHE_PARAMS = 32,
+};
+
+typedef struct {
+	uint32_t seq; ///< 写入时为奇数
+	uint32_t hash; ///< 键的散列值
+	uint32_t filling; ///< 正在生成的键的散列值
+	fb_time_t lock; ///< 生成者的超时时刻, 0表示无人生成
+	fb_time_t expire; ///< 过期时刻
+	int size; ///< 数据长度
+	char key[WEB_CACHE_KEY_LEN];
+	char data[WEB_CACHE_DATA_LEN];
+} web_cache_entry_t;
+
+typedef struct {
+	web_cache_entry_t entries[WEB_CACHE_SLOTS];
+} web_cache_t;
+
+static web_cache_t *web_cache;
+
+/** 本线程正在生成的缓存项 */
+static FB_THREAD_LOCAL struct {
+	web_cache_entry_t *entry;
+	fb_time_t lock;
+	uint32_t hash;
+	int ttl;
+	char key[WEB_CACHE_KEY_LEN];
+} pending;
+
+/**
+ * 连接共享内存, 须在启动工作线程之前调用.
+ * @return 成功true
+ */
+bool web_cache_initialize(void)
+{
+	int created = 0;
+	web_cache = attach_shm2("WEBCACHE_SHMKEY", WEB_CACHE_SHMKEY,
+			sizeof(*web_cache), &created);
+	return web_cache;
+}
+
+static int compare_param(const void *l, const void *r)
+{
+	return strcmp(*(const char * const *) l, *(const char * const *) r);
+}
+
+/**
+ * 生成缓存键
+ * @param[out] key 缓存键
+ * @param[in] size 长度
+ * @return 成功true, 查询串过长等情况返回false
+ */
+static bool web_cache_key(char *key, size_t size)
+{
+	const char *script = web_getenv("SCRIPT_NAME");
+	const char *query = web_getenv("QUERY_STRING");
+	if (!script)
+		return false;
+	if (!query)
+		query = "";
+
+	char buf[WEB_CACHE_KEY_LEN];
+	if (strlcpy(buf, query, sizeof(buf)) >= sizeof(buf))
+		return false;
+
+	const char *params[WEB_CACHE_PARAMS];
+	int count = 0;
+	char *save = NULL;
+	for (char *p = strtok_r(buf, "&", &save); p;
+			p = strtok_r(NULL, "&", &save)) {
+		if (count >= ARRAY_SIZE(params))
+			return false;
+		params[count++] = p;
+	}
+	qsort(params, count, sizeof(*params), compare_param);
+
+	size_t len = snprintf(key, size, "%d%s?", web_gzip_accepted(), script);
+	for (int i = 0; i < count && len < size; ++i) {
+		len += snprintf(key + len, size - len, "%s%s", i ? "&" : "",
+				params[i]);
+	}
+	return len < size;
+}
+
+static uint32_t web_cache_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *) key; *p; ++p)
+		hash = (hash ^ *p) * 16777619u;
+	return hash ? hash : 1;
+}
+
+/**
+ * 复制缓存内容
+ * @param[in] e 缓存项
+ * @param[in] key 缓存键
+ * @param[in] hash 键的散列值
+ * @param[out] buf 复制到的缓冲区, 长度WEB_CACHE_DATA_LEN
+ * @param[out] expire 过期时刻
+ * @return 数据长度, 没有该键返回-1
+ */
+static int web_cache_copy(const web_cache_entry_t *e, const char *key,
+		uint32_t hash, char *buf, fb_time_t *expire)
+{
+	for (int i = 0; i < WEB_CACHE_RETRY; ++i) {
+		uint32_t seq = *(volatile uint32_t *) &e->seq;
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+
+		int size = -1;
+		if (e->hash == hash && strneq(e->key, key, sizeof(e->key))) {
+			size = e->size;
+			if (size < 0 || size > WEB_CACHE_DATA_LEN)
+				size = -1;
+			else
+				memcpy(buf, e->data, size);
+			*expire = e->expire;
+		}
+
+		__sync_synchronize();
+		if (*(volatile uint32_t *) &e->seq == seq)
+			return size;
+	}
+	return -1;
+}
+
+/**
+ * 查找缓存, 命中时直接送出响应.
+ * 未命中且由本线程生成时, 开始记录响应, 请求结束时由web_cache_store()存入.
+ * @param[in] ttl 缓存秒数
+ * @return 已送出响应返回true
+ */
+bool web_cache_lookup(int ttl)
+{
+	pending.entry = NULL;
+	if (!web_cache || !web_cache_key(pending.key, sizeof(pending.key)))
+		return false;
+
+	uint32_t hash = web_cache_hash(pending.key);
+	web_cache_entry_t *e = web_cache->entries + hash % WEB_CACHE_SLOTS;
+	char *buf = web_palloc(WEB_CACHE_DATA_LEN);
+	if (!buf)
+		return false;
+
+	for (int wait = 0; ; ++wait) {
+		fb_time_t now = fb_time(), expire = 0;
+		int size = web_cache_copy(e, pending.key, hash, buf, &expire);
+		if (size >= 0 && expire > now) {
+			web_write_raw(buf, size);
+			return true;
+		}
+
+		fb_time_t lock = *(volatile fb_time_t *) &e->lock;
+		if (lock <= now && __sync_bool_compare_and_swap(&e->lock, lock,
+					now + WEB_CACHE_LOCK_TIMEOUT)) {
+			e->filling = hash;
+			pending.entry = e;
+			pending.lock = now + WEB_CACHE_LOCK_TIMEOUT;
+			pending.hash = hash;
+			pending.ttl = ttl;
+			web_capture_begin(WEB_CACHE_DATA_LEN);
+			return false;
+		}
+
+		if (size >= 0) {
+			web_write_raw(buf, size);
+			return true;
+		}
+		if (e->filling != hash || wait >= WEB_CACHE_WAIT)
+			return false;
+		usleep(10000);
+	}
+}
+
+/**
+ * 响应是否可以缓存: 状态200且没有设置cookie
+ */
+static bool web_cache_cacheable(const char *data, size_t size)
+{
+	const char *end = NULL;
+	for (const char *p = data; p + 1 < data + size; ++p) {
+		if (p[0] == '\n' && p[1] == '\n') {
+			end = p;
+			break;
+		}
+	}
+	if (!end)
+		return false;
+
+	char header[1024];
+	if (end - data >= sizeof(header))
+		return false;
+	memcpy(header, data, end - data);
+	header[end - data] = '\0';
+
+	const char *status = strstr(header, "Status: ");
+	if (status && strtol(status + 8, NULL, 10) != WEB_STATUS_OK)
+		return false;
+	return !strstr(header, "Set-cookie:");
+}
+
+/**
+ * 存入本线程生成的响应并释放生成权
+ * @param[in] data 响应
+ * @param[in] size 长度, 0表示不存入
+ */
+void web_cache_store(const char *data, size_t size)
+{
+	web_cache_entry_t *e = pending.entry;
+	if (!e)
+		return;
+	pending.entry = NULL;
+
+	uint32_t seq = *(volatile uint32_t *) &e->seq;
+	if (size && size <= WEB_CACHE_DATA_LEN
+			&& web_cache_cacheable(data, size) && !(seq & 1)
+			&& __sync_bool_compare_and_swap(&e->seq, seq, seq + 1)) {
+		e->hash = pending.hash;
+		strlcpy(e->key, pending.key, sizeof(e->key));
+		memcpy(e->data, data, size);
+		e->size = size;
+		e->expire = fb_time() + pending.ttl;
+		__sync_add_and_fetch(&e->seq, 1);
+	}
+
+	e->filling = 0;
+	__sync_bool_compare_and_swap(&e->lock, pending.lock, 0);
+}
+/** @} */
@@ -1,6 +1,11 @@
 #include <inttypes.h>
+#include <string.h>
+#ifdef FB_DEBUG
+#include <assert.h>
+#endif
 #include "fbbs/list.h"
 #include "fbbs/json.h"
+#include "fbbs/util.h"
 #include "fbbs/web.h"
 
 struct json_value_t {
@@ -128,26 +133,29 @@ json_value_t *json_array_append(json_array_t *array, json_object_t *value,
 	return json_object_append(array, NULL, value, type);
 }
 
+static const web_escape_t json_escape = {
+	.subst = {
+		[0x01] = "\\u0001", [0x02] = "\\u0002", [0x03] = "\\u0003",
+		[0x04] = "\\u0004", [0x05] = "\\u0005", [0x06] = "\\u0006",
+		[0x07] = "\\u0007", [0x08] = "\\u0008", [0x09] = "\\u0009",
+		[0x0a] = "\\n", [0x0b] = "\\u000b", [0x0c] = "\\u000c",
+		[0x0d] = "\\u000d", [0x0e] = "\\u000e", [0x0f] = "\\u000f",
+		[0x10] = "\\u0010", [0x11] = "\\u0011", [0x12] = "\\u0012",
+		[0x13] = "\\u0013", [0x14] = "\\u0014", [0x15] = "\\u0015",
+		[0x16] = "\\u0016", [0x17] = "\\u0017", [0x18] = "\\u0018",
+		[0x19] = "\\u0019", [0x1a] = "\\u001a", [0x1b] = "\\u001b",
+		[0x1c] = "\\u001c", [0x1d] = "\\u001d", [0x1e] = "\\u001e",
+		[0x1f] = "\\u001f",
+		['"'] = "\\\"", ['\\'] = "\\\\",
+	},
+	.special = { '"', '\\', '"', '"' },
+};
+
 static void json_print_string(const char *s)
 {
-	unsigned char *p = (unsigned char *) s;
-	if (p) {
+	if (s) {
 		putchar('\"');
-		unsigned int c;
-		while ((c = *p)) {
-			if (c == '"') {
-				printf("\\\"");
-			} else if (c == '\\') {
-				printf("\\\\");
-			} else if (c == '\n') {
-				printf("\\n");
-			} else if (c <= 0x1f) {
-				printf("\\u00%02x", c);
-			} else {
-				putchar(c);
-			}
-			++p;
-		}
+		web_write_escaped(&json_escape, s, strlen(s));
 		putchar('\"');
 	} else {
 		printf("null");
@@ -198,3 +206,129 @@ void json_dump(const json_object_t *object, json_value_e type)
 	}
 	putchar(type == JSON_OBJECT ? '}' : ']');
 }
+
+/**
+ * @defgroup json_writer 流式输出
+ * 直接写入输出缓冲, 不在内存池中构造节点. 键为NULL表示数组成员或顶层值.
+ * 调试版本检查嵌套是否匹配.
+ */
+/** @{ */
+
+#ifdef FB_DEBUG
+# define JSON_WRITER_CHECK(cond)  assert(cond)
+#else
+# define JSON_WRITER_CHECK(cond)
+#endif
+
+enum {
+	JSON_WRITER_DEPTH = 31,
+};
+
+/** 每层占一位, 第0层为顶层 */
+static FB_THREAD_LOCAL struct {
+	int depth;
+	uint32_t comma; ///< 该层已有成员
+	uint32_t object; ///< 该层是对象而不是数组
+} writer;
+
+void json_writer_reset(void)
+{
+	writer.depth = 0;
+	writer.comma = writer.object = 0;
+}
+
+/**
+ * 输出是否是一个完整的值.
+ */
+bool json_writer_done(void)
+{
+	return !writer.depth && (writer.comma & 1);
+}
+
+static void json_write_key(const char *key)
+{
+	uint32_t bit = 1u << writer.depth;
+	JSON_WRITER_CHECK(writer.depth || !(writer.comma & bit));
+	JSON_WRITER_CHECK(!key == !(writer.object & bit));
+
+	if (writer.comma & bit)
+		putchar(',');
+	writer.comma |= bit;
+	if (key) {
+		json_print_string(key);
+		putchar(':');
+	}
+}
+
+static void json_write_begin(const char *key, bool object)
+{
+	json_write_key(key);
+	JSON_WRITER_CHECK(writer.depth < JSON_WRITER_DEPTH);
+
+	uint32_t bit = 1u << ++writer.depth;
+	writer.comma &= ~bit;
+	if (object)
+		writer.object |= bit;
+	else
+		writer.object &= ~bit;
+	putchar(object ? '{' : '[');
+}
+
+static void json_write_end(bool object)
+{
+	JSON_WRITER_CHECK(writer.depth > 0);
+	JSON_WRITER_CHECK(!(writer.object & (1u << writer.depth)) == !object);
+	--writer.depth;
+	putchar(object ? '}' : ']');
+}
+
+void json_write_object_begin(const char *key)
+{
+	json_write_begin(key, true);
+}
+
+void json_write_object_end(void)
+{
+	json_write_end(true);
+}
+
+void json_write_array_begin(const char *key)
+{
+	json_write_begin(key, false);
+}
+
+void json_write_array_end(void)
+{
+	json_write_end(false);
+}
+
+void json_write_null(const char *key)
+{
+	json_write_key(key);
+	printf("null");
+}
+
+void json_write_string(const char *key, const char *value)
+{
+	json_write_key(key);
+	json_print_string(value);
+}
+
+void json_write_integer(const char *key, int value)
+{
+	json_write_key(key);
+	printf("%d", value);
+}
+
+void json_write_bigint(const char *key, int64_t value)
+{
+	json_write_key(key);
+	printf("\"%"PRId64"\"", value);
+}
+
+void json_write_bool(const char *key, bool value)
+{
+	json_write_key(key);
+	printf(value ? "true" : "false");
+}
+/** @} */
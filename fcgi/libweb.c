@@ -17,8 +17,6 @@
 #include "fbbs/user.h"
 #include "fbbs/web.h"
 
-struct userec currentuser;
-
 /**
  * Get an environment variable.
  * The function searches environment list where FastCGI stores parameters
@@ -30,7 +28,7 @@ struct userec currentuser;
  */
 const char *getsenv(const char *s)
 {
-	char *t = getenv(s);
+	const char *t = web_getenv(s);
 	if (t!= NULL)
 		return t;
 	return "";
@@ -97,15 +95,15 @@ void xml_fputs2(const char *s, size_t size)
 				break;
 		}
 		if (subst != NULL) {
-			fwrite(last, sizeof(char), c - last, stdout);
+			web_write(last, c - last);
 			while (*subst != '\0')
-				fputc(*subst++, stdout);
+				web_putchar(*subst++);
 			last = ++c;
 		} else {
 			++c;
 		}
 	}
-	fwrite(last, sizeof(char), c - last, stdout);
+	web_write(last, c - last);
 }
 
 /**
@@ -203,7 +201,7 @@ int maxlen(const char *board)
 
 		FILE *fp = fopen(path, "r");
 		if (fp) {
-			if (fscanf(FCGI_ToFILE(fp), "%d", &max) <= 0)
+			if (fscanf(fp, "%d", &max) <= 0)
 				max = UPLOAD_MAX;
 			fclose(fp);
 		}
@@ -251,7 +249,7 @@ bool valid_mailname(const char *file)
 
 static char *get_permission(void)
 {
-	static char c[5];
+	static FB_THREAD_LOCAL char c[5];
 	c[0] = session_get_id() ? 'l' : ' ';
 	c[1] = HAS_PERM(PERM_TALK) ? 't' : ' ';
 	c[2] = HAS_PERM(PERM_CLOAK) ? '#': ' ';
@@ -293,11 +291,21 @@ void print_session(void)
 	db_res_t *res = query_exec(q);
 
 	if (res) {
-		for (int i = 0; i < db_res_rows(res); ++i) {
+		int rows = db_res_rows(res);
+		bool *unread = NULL;
+		int *bids = mobile ? malloc(sizeof(*bids) * rows) : NULL;
+		if (bids && (unread = malloc(sizeof(*unread) * rows))) {
+			for (int i = 0; i < rows; ++i)
+				bids[i] = db_get_integer(res, i, 0);
+			brc_boards_unread(currentuser.userid, bids, rows, unread);
+		}
+		free(bids);
+
+		for (int i = 0; i < rows; ++i) {
 			int bid = db_get_integer(res, i, 0);
 			const char *name = db_get_value(res, i, 1);
 			printf("<b bid='%d'", bid);
-			if (mobile && !brc_board_unread(currentuser.userid, name, bid))
+			if (unread && !unread[i])
 				printf(" r='1'");
 
 			if (*name & 0x80) {
@@ -308,6 +316,7 @@ void print_session(void)
 				printf(">%s</b>", name);
 			}
 		}
+		free(unread);
 	}
 	db_clear(res);
 
@@ -8,7 +8,6 @@
 #ifdef HAVE_CRYPT_H
 #include <crypt.h>
 #endif
-#include <fcgi_stdio.h>  //Should be included last.
 #include "fbbs/web.h"
 
 #define CHARSET		"gb18030"
@@ -39,8 +38,8 @@ const char *get_referer(void);
 
 void refreshto(int second, const char *url);
 
-extern struct userec currentuser;
-extern char fromhost[];
+extern FB_THREAD_LOCAL struct userec currentuser;
+extern FB_THREAD_LOCAL char fromhost[];
 
 void xml_fputs(const char *s);
 void xml_fputs2(const char *s, size_t size);
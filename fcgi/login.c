@@ -12,6 +12,10 @@
 
 #define LOGIN_HOMEPAGE  "top10"
 
+extern bool session_sign_cookie(const char *key, session_id_t sid, user_id_t user_id, fb_time_t expire, const char *user_name, char *cookie);
+extern bool session_derive_token(const char *key, char *token, size_t size);
+extern void session_cookie_key(const char *cookie, char *key, size_t size);
+
 enum {
 	WEB_ACTIVE_LOGIN_QUOTA = 4,
 	COOKIE_PERSISTENT_PERIOD = 2 * 7 * 24 * 60 * 60,
@@ -67,7 +71,8 @@ static void generate_session_key(char *key, size_t ksize,
 	digest_to_hex(digest, buf, sizeof(buf));
 
 	strlcpy(key, buf, ksize);
-	strlcpy(token, buf + SESSION_KEY_LEN, tsize);
+	if (!session_derive_token(key, token, tsize))
+		strlcpy(token, buf + SESSION_KEY_LEN, tsize);
 }
 
 static void grant_permission(struct userec *user)
@@ -174,6 +179,7 @@ int do_web_login(const char *uname, const char *pw, bool api)
 typedef struct {
 	char key[SESSION_KEY_LEN + 1];
 	char token[SESSION_TOKEN_LEN + 1];
+	char cookie[WEB_SESSION_COOKIE_LEN]; ///< 签名的会话键, 未签名时同key
 	fb_time_t expire_time;
 } session_data_t;
 
@@ -192,8 +198,13 @@ static int _web_login(bool persistent, bool redirect, session_data_t *s)
 		session_web_cache_set(session_get_user_id(), s->key, s->token,
 				session_get_id(), true);
 	}
+	// 非持久的cookie随浏览器关闭失效, 签名同样限定在持久期限内
+	session_sign_cookie(s->key, session_get_id(), session_get_user_id(),
+			s->expire_time ? s->expire_time
+				: fb_time() + COOKIE_PERSISTENT_PERIOD,
+			currentuser.userid, s->cookie);
 	if (redirect) {
-		return login_redirect(s->key,
+		return login_redirect(s->cookie,
 				persistent ? COOKIE_PERSISTENT_PERIOD : 0);
 	}
 	return WEB_OK;
@@ -272,7 +283,7 @@ int api_login(void)
 			web_set_response(object, JSON_OBJECT);
 
 			json_object_string(object, "user_name", currentuser.userid);
-			json_object_string(object, "session_key", s.key);
+			json_object_string(object, "session_key", s.cookie);
 			json_object_string(object, "token", s.token);
 			json_object_bigint(object, "expire_time", s.expire_time);
 
@@ -295,8 +306,9 @@ int web_logout(void)
 		expire_cookie(WEB_COOKIE_USER);
 
 		session_destroy(id);
-		session_web_cache_remove(session_get_user_id(),
-				web_get_param(WEB_COOKIE_KEY));
+		char key[SESSION_KEY_LEN + 1];
+		session_cookie_key(web_get_param(WEB_COOKIE_KEY), key, sizeof(key));
+		session_web_cache_remove(session_get_user_id(), key);
 	}
 	redirect_homepage();
 	return 0;
@@ -169,7 +169,7 @@ int bbsmailcon_main(void)
 
 	printf("<mail f='%s' n='%s'>", file, web_get_param("n"));
 	xml_printfile(buf);
-	fputs("</mail>\n", stdout);
+	web_put("</mail>\n");
 
 	print_session();
 	printf("</bbsmailcon>");
@@ -1,10 +1,14 @@
+#include <pthread.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "libweb.h"
 #include "fbbs/backend.h"
 #include "fbbs/brc.h"
+#include "fbbs/cfg.h"
 #include "fbbs/helper.h"
+#include "fbbs/mdbi.h"
+#include "fbbs/post.h"
 #include "fbbs/session.h"
 #include "fbbs/string.h"
 #include "fbbs/user.h"
@@ -15,6 +19,9 @@ extern int bbssec_main(void);
 extern int web_all_boards(void);
 extern int web_sector(void);
 extern int bbsdoc_main(void);
+extern bool bbsdoc_validate(void);
+extern bool bbscon_validate(void);
+extern bool api_board_validate(void);
 extern int bbscon_main(void);
 extern int bbspst_main(void);
 extern int bbssnd_main(void);
@@ -83,9 +90,11 @@ typedef struct {
 	const char *name;    ///< name of the cgi.
 	int (*func)(void);   ///< handler function.
 	session_status_e status; ///< user status. @see session_status_descr
+	bool (*validate)(void); ///< sets validators of anonymous GET, optional
+	int cache_ttl; ///< seconds to share output of anonymous GET, optional
 } web_handler_t;
 
-char fromhost[IP_LEN];
+FB_THREAD_LOCAL char fromhost[IP_LEN];
 
 const static web_handler_t handlers[] = {
 	{ "0an", bbs0an_main, ST_DIGEST },
@@ -93,8 +102,8 @@ const static web_handler_t handlers[] = {
 	{ "all", web_all_boards, ST_READBRD },
 	{ "anc", bbsanc_main, ST_DIGEST },
 	{ "bfind", bbsbfind_main, ST_READING },
-	{ "boa", web_sector, ST_READNEW },
-	{ "board", api_board, ST_READING },
+	{ "boa", web_sector, ST_READNEW, NULL, 5 },
+	{ "board", api_board, ST_READING, api_board_validate },
 	{ "board-all", api_board_all, ST_READBRD },
 	{ "board-fav", api_board_fav, ST_READNEW },
 	{ "brdadd", web_brdadd, ST_READING },
@@ -102,10 +111,10 @@ const static web_handler_t handlers[] = {
 	{ "buyprop", web_buy_prop, ST_PROP },
 	{ "ccc", bbsccc_main, ST_POSTING },
 	{ "clear", api_clear, ST_READING },
-	{ "con", bbscon_main, ST_READING },
+	{ "con", bbscon_main, ST_READING, bbscon_validate },
 	{ "del", bbsdel_main, ST_READING },
 	{ "delmail", bbsdelmail_main, ST_RMAIL },
-	{ "doc", bbsdoc_main, ST_READING },
+	{ "doc", bbsdoc_main, ST_READING, bbsdoc_validate },
 	{ "edit", bbsedit_main, ST_EDIT },
 	{ "exist", fcgi_exist, ST_QUERY },
 	{ "fadd", bbsfadd_main, ST_GMENU },
@@ -115,8 +124,8 @@ const static web_handler_t handlers[] = {
 	{ "fdel", bbsfdel_main, ST_GMENU },
 	{ "fdoc", web_forum, ST_READING },
 	{ "fwd", bbsfwd_main, ST_SMAIL },
-	{ "gcon", bbsgcon_main, ST_READING },
-	{ "gdoc", bbsgdoc_main, ST_READING },
+	{ "gcon", bbsgcon_main, ST_READING, bbscon_validate },
+	{ "gdoc", bbsgdoc_main, ST_READING, bbsdoc_validate },
 	{ "idle", bbsidle_main, ST_IDLE },
 	{ "info", bbsinfo_main, ST_GMENU },
 	{ "login", api_login, ST_LOGIN},
@@ -137,18 +146,18 @@ const static web_handler_t handlers[] = {
 	{ "pwd", bbspwd_main, ST_GMENU },
 	{ "qry", bbsqry_main, ST_QUERY },
 	{ "reg", fcgi_reg, ST_NEW },
-	{ "rss", bbsrss_main, ST_READING },
-	{ "sec", bbssec_main, ST_READBRD },
-	{ "sector", api_sector, ST_READBRD },
+	{ "rss", bbsrss_main, ST_READING, NULL, 10 },
+	{ "sec", bbssec_main, ST_READBRD, NULL, 10 },
+	{ "sector", api_sector, ST_READBRD, NULL, 10 },
 	{ "sel", web_sel, ST_SELECT },
 	{ "sig", bbssig_main, ST_EDITUFILE },
 	{ "sigopt", web_sigopt, ST_GMENU },
 	{ "snd", bbssnd_main, ST_POSTING },
 	{ "sndmail", bbssndmail_main, ST_SMAIL },
 	{ "tcon", bbstcon_main, ST_READING },
-	{ "tdoc" ,bbstdoc_main, ST_READING },
-	{ "top10", web_top10, ST_READBRD },
-	{ "trend", api_trend, ST_READBRD },
+	{ "tdoc" ,bbstdoc_main, ST_READING, bbsdoc_validate },
+	{ "top10", web_top10, ST_READBRD, NULL, 30 },
+	{ "trend", api_trend, ST_READBRD, NULL, 30 },
 	{ "upload", bbsupload_main, ST_UPLOAD },
 	{ "user", api_user, ST_QUERY },
 };
@@ -165,11 +174,11 @@ static int compare_handler(const void *l, const void *r)
  */
 static const web_handler_t *_get_handler(void)
 {
-	char *surl = getenv("SCRIPT_NAME");
+	const char *surl = web_getenv("SCRIPT_NAME");
 	if (!surl)
 		return NULL;
 
-	char *name = strrchr(surl, '/');
+	const char *name = strrchr(surl, '/');
 	if (!name)
 		name = surl;
 	else
@@ -210,10 +219,6 @@ static int initialize(void)
 	if (!brdshm)
 		return -1;
 
-	const char *socket_path = getenv("FBBS_SOCKET_PATH");
-	if (!socket_path || backend_proxy_connect(socket_path, true) < 0)
-		return -1;
-
 	return 0;
 }
 
@@ -237,6 +242,26 @@ static void get_client_ip(void)
 #endif
 }
 
+static bool anonymous_get(void)
+{
+	return web_request_method(GET) && !(*web_get_param(WEB_COOKIE_USER)
+			&& *web_get_param(WEB_COOKIE_KEY));
+}
+
+/**
+ * Check validators of an anonymous GET request before any session or
+ * database work.
+ * @return true if the client copy is still fresh.
+ */
+static bool not_modified(const web_handler_t *h)
+{
+	if (!h->validate || !anonymous_get())
+		return false;
+
+	memset(&currentuser, 0, sizeof(currentuser));
+	return h->validate() && web_not_modified();
+}
+
 static bool require_login(const web_handler_t *h)
 {
 #ifdef FDQUAN
@@ -266,26 +291,82 @@ static void exit_handler(int sig)
 extern bool session_validate(void);
 
 /**
- * The main entrance of bbswebd.
- * @return 0 on success, 1 on initialization error.
+ * Cache rarely changed Redis lookups in process if configured.
  */
-int main(void)
+static void initialize_mdb_cache(void)
 {
-	fb_signal(SIGTERM, exit_handler);
-	fb_signal(SIGUSR1, exit_handler);
+	int ttl = config_get_integer("mdb_cache_ttl", 0);
+	if (ttl > 0) {
+		mdb_cache_enable(USER_ID_HASH_KEY, ttl);
+		mdb_cache_enable(LAST_POST_KEY, ttl);
+		mdb_cache_enable(POST_BOARD_COUNT_KEY, ttl);
+
+		static int registered = 0;
+		if (__sync_bool_compare_and_swap(&registered, 0, 1))
+			atexit(mdb_cache_report);
+	}
+}
 
-	if (initialize() < 0)
-		return EXIT_FAILURE;
-	initialize_environment(INIT_CONV | INIT_DB | INIT_MDB);
+/**
+ * Open connections owned by the calling thread.
+ * Shared memory caches are attached once and shared by all threads.
+ * @return 0 on success, -1 on error.
+ */
+static int initialize_thread(void)
+{
+	const char *socket_path = getenv("FBBS_SOCKET_PATH");
+	if (!socket_path || backend_proxy_connect(socket_path, true) < 0)
+		return -1;
 
-	while (FCGI_Accept() >= 0) {
-		if (!web_ctx_init())
-			return EXIT_FAILURE;
+	initialize_mdb();
+	initialize_convert_env();
+	initialize_db();
+	initialize_mdb_cache();
+	return 0;
+}
+
+static pthread_mutex_t accept_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Accept and handle requests until the listening socket is closed.
+ */
+static void serve(void)
+{
+	FCGX_Request request;
+	if (FCGX_InitRequest(&request, 0, 0) != 0)
+		exit(EXIT_FAILURE);
+
+	while (true) {
+		pthread_mutex_lock(&accept_lock);
+		int rc = FCGX_Accept_r(&request);
+		pthread_mutex_unlock(&accept_lock);
+		if (rc < 0)
+			break;
+
+		if (!web_ctx_init(&request))
+			exit(EXIT_FAILURE);
+		db_request_begin();
 
 		const web_handler_t *h = _get_handler();
+		if (h && not_modified(h)) {
+			web_respond_not_modified();
+			web_ctx_destroy();
+			continue;
+		}
+		if (h && h->cache_ttl && anonymous_get()
+				&& web_cache_lookup(h->cache_ttl)) {
+			web_finish();
+			web_ctx_destroy();
+			continue;
+		}
+
 		int code = BBS_ENOURL;
 		if (h) {
 			get_client_ip();
+
+			// Session updates are written in one round trip, together
+			// with the last lookup of session_validate() if possible.
+			mdb_pipeline_begin();
 			session_validate();
 			brc_reset();
 
@@ -296,6 +377,7 @@ int main(void)
 				if (h->status != ST_READING)
 					session_set_board(0);
 			}
+			mdb_clear(mdb_pipeline_exec());
 
 			code = execute(h);
 		}
@@ -307,5 +389,44 @@ int main(void)
 
 		web_ctx_destroy();
 	}
+	FCGX_Finish_r(&request);
+}
+
+static void *worker(void *arg)
+{
+	if (initialize_thread() < 0)
+		exit(EXIT_FAILURE);
+	serve();
+	return NULL;
+}
+
+/**
+ * The main entrance of bbswebd.
+ * @return 0 on success, 1 on initialization error.
+ */
+int main(void)
+{
+	fb_signal(SIGTERM, exit_handler);
+	fb_signal(SIGUSR1, exit_handler);
+
+	if (initialize() < 0)
+		return EXIT_FAILURE;
+	initialize_environment(0);
+	if (web_initialize() < 0 || FCGX_Init() != 0)
+		return EXIT_FAILURE;
+	web_cache_initialize();
+
+	// Each thread owns its database connections and per-request state.
+	int threads = config_get_integer("web_threads", 1);
+	for (int i = 1; i < threads; ++i) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, worker, NULL) != 0)
+			return EXIT_FAILURE;
+		pthread_detach(tid);
+	}
+
+	if (initialize_thread() < 0)
+		return EXIT_FAILURE;
+	serve();
 	return 0;
 }
@@ -88,34 +88,23 @@ static const char *_memstr(const void *m, const char *s, size_t size)
 	return NULL;
 }
 
+/** 丢弃制表符以外的控制字符, 空格转为不换行空格 */
+static const web_escape_t xml_escape = {
+	.subst = {
+		['<'] = "&lt;", ['>'] = "&gt;", ['&'] = "&amp;", [' '] = "&#160;",
+		[0x01] = "", [0x02] = "", [0x03] = "", [0x04] = "", [0x05] = "",
+		[0x06] = "", [0x07] = "", [0x08] = "", [0x0a] = "", [0x0b] = "",
+		[0x0c] = "", [0x0d] = "", [0x0e] = "", [0x0f] = "", [0x10] = "",
+		[0x11] = "", [0x12] = "", [0x13] = "", [0x14] = "", [0x15] = "",
+		[0x16] = "", [0x17] = "", [0x18] = "", [0x19] = "", [0x1a] = "",
+		[0x1b] = "", [0x1c] = "", [0x1d] = "", [0x1e] = "", [0x1f] = "",
+	},
+	.special = { '<', '>', '&', ' ' },
+};
+
 static void _xml_escape_internal(const char *begin, const char *end)
 {
-	for (const char *s = begin; s != end; ++s) {
-		switch (*s) {
-			case '<':
-				fputs("&lt;", stdout);
-				break;
-			case '>':
-				fputs("&gt;", stdout);
-				break;
-			case '&':
-				fputs("&amp;", stdout);
-				break;
-			case ' ':
-				fputs("&#160;", stdout);
-				break;
-			case '\x1': case '\x2': case '\x3': case '\x4': case '\x5':
-			case '\x6': case '\x7': case '\x8': case '\xb': case '\xc':
-			case '\xe': case '\xf': case '\x10': case '\x11': case '\x12':
-			case '\x13': case '\x14': case '\x15': case '\x16': case '\x17':
-			case '\x18': case '\x19': case '\x1a': case '\x1b': case '\x1c':
-			case '\x1d': case '\x1e': case '\x1f': case '\r': case '\n':
-				break;
-			default:
-				fputc(*s, stdout);
-				break;
-		}
-	}
+	web_write_escaped(&xml_escape, begin, end - begin);
 }
 
 static int xml_escape_helper(const char *s, size_t len, void *arg)
@@ -276,7 +265,7 @@ static const char *_print_url(const char *begin, const char *end, int option)
 {
 	const char *e = _get_url(begin, end);
 	if (e < begin + 11) {
-		fwrite((char *)begin, e - begin, 1, stdout);
+		web_write(begin, e - begin);
 		return e;
 	}
 	printf("<a ");
@@ -347,9 +336,9 @@ static void _print_body(const char *begin, const char *end, int option)
 				in_quote = !in_quote;
 			}
 		}
-		fputs("<p>", stdout);
+		web_put("<p>");
 		if (e == s + 1 || (e == s + 2 && *s == '\r')) {
-			fputs("<br/>", stdout);
+			web_put("<br/>");
 		} else {
 			int opt = option;
 			if (!in_quote)
@@ -358,7 +347,7 @@ static void _print_body(const char *begin, const char *end, int option)
 				opt &= ~PARSE_NOSIGIMG;
 			_print_paragraph(s, e, opt);
 		}
-		fputs("</p>", stdout);
+		web_put("</p>");
 	}
 	printf("</pa>");
 }
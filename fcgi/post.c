@@ -192,6 +192,20 @@ static int xml_print_post_wrapper(const char *str, size_t size)
 	return xml_print_post(str, size, PARSE_NOSIG);
 }
 
+extern bool set_board_validator(const board_t *bp, post_id_t pid);
+
+/**
+ * 匿名请求文章页面的验证器
+ * 上一篇/下一篇等相对跳转不做验证.
+ */
+bool bbscon_validate(void)
+{
+	board_t board;
+	post_id_t pid = strtol(web_get_param("f"), NULL, 10);
+	return pid > 0 && !*web_get_param("a") && get_board_by_param(&board)
+			&& set_board_validator(&board, pid);
+}
+
 int bbscon(const char *link)
 {
 	board_t board;
@@ -806,7 +820,7 @@ static int do_bbspst(bool isedit)
 			convert_u2g(pi.utf8_title, gbk_title);
 		string_remove_ansi_control_code(title, title);
 		if (web_request_type(MOBILE) && !strneq2(title, "Re: "))
-			fputs("Re: ", stdout);
+			web_put("Re: ");
 		xml_fputs(title);
 
 		printf("</t><po f='%lu'>", pid);
@@ -845,7 +859,7 @@ static int do_bbspst(bool isedit)
 
 		free(utf8_content);
 
-		fputs("</po>", stdout);
+		web_put("</po>");
 	}
 	printf("</bbspst>");
 	return 0;
@@ -1031,19 +1045,6 @@ static int api_post_get(void)
 	if (count > API_POST_DEFAULT_COUNT || count <= 0)
 		count = API_POST_DEFAULT_COUNT;
 
-	json_object_t *object = json_object_new();
-	web_set_response(object, JSON_OBJECT);
-
-	json_object_t *o = json_object_new();
-	json_object_integer(o, "id", board.id);
-	json_object_string(o, "name", board.name);
-	if (board.flag & BOARD_FLAG_ANONY)
-		json_object_bool(o, "anonymous", true);
-	json_object_append(object, "board", o, JSON_OBJECT);
-
-	json_array_t *posts = json_array_new();
-	json_object_append(object, "posts", posts, JSON_ARRAY);
-
 	query_t *q = query_new(0);
 	query_select(q, POST_TABLE_FIELDS);
 	query_from(q, "post.recent");
@@ -1053,6 +1054,7 @@ static int api_post_get(void)
 		query_and(q, "id > %"DBIdPID, since_id);
 	query_orderby(q, "id", true);
 	query_limit(q, count);
+	query_readonly(q);
 
 	db_res_t *res = query_exec(q);
 	count = res ? db_res_rows(res) : 0;
@@ -1061,27 +1063,40 @@ static int api_post_get(void)
 	if (logged)
 		brc_init(currentuser.userid, board.name);
 
+	web_stream_begin();
+	json_write_object_begin(NULL);
+
+	json_write_object_begin("board");
+	json_write_integer("id", board.id);
+	json_write_string("name", board.name);
+	if (board.flag & BOARD_FLAG_ANONY)
+		json_write_bool("anonymous", true);
+	json_write_object_end();
+
+	json_write_array_begin("posts");
 	for (int i = 0; i < count; ++i) {
 		post_record_t pr;
 		post_record_from_query(res, i, &pr, false);
 		char *content = post_content_get(pr.id, false);
 		if (content) {
-			json_object_t *post = json_object_new();
-			json_object_string(post, "content", content);
+			json_write_object_begin(NULL);
+			json_write_string("content", content);
 			if (logged) {
 				post_mark_as_read(pr.id, pr.user_id_replied,
 						pr.utf8_title, content);
 			}
 			free(content);
-			json_object_bigint(post, "id", pr.id);
-			json_object_bigint(post, "reply_id", pr.reply_id);
-			json_object_bigint(post, "thread_id", pr.thread_id);
-			json_object_string(post, "user_name", pr.user_name);
-			json_object_integer(post, "flags", pr.flag);
-			json_object_string(post, "title", pr.utf8_title);
-			json_array_append(posts, post, JSON_OBJECT);
+			json_write_bigint("id", pr.id);
+			json_write_bigint("reply_id", pr.reply_id);
+			json_write_bigint("thread_id", pr.thread_id);
+			json_write_string("user_name", pr.user_name);
+			json_write_integer("flags", pr.flag);
+			json_write_string("title", pr.utf8_title);
+			json_write_object_end();
 		}
 	}
+	json_write_array_end();
+	json_write_object_end();
 	db_clear(res);
 
 	if (logged)
@@ -1160,9 +1175,10 @@ static int api_post_new(void)
 	snprintf(buf, sizeof(buf), "posted '%s' on %s", utf8_title, board.name);
 	report(buf, currentuser.userid);
 
-	json_object_t *o = json_object_new();
-	json_object_bigint(o, "id", post_id);
-	web_set_response(o, JSON_OBJECT);
+	web_stream_begin();
+	json_write_object_begin(NULL);
+	json_write_bigint("id", post_id);
+	json_write_object_end();
 	return WEB_OK;
 }
 
@@ -7,15 +7,169 @@
 
 extern int do_web_login(const char *uname, const char *pw, bool api);
 
+/**
+ * @defgroup web_signed_session 签名会话
+ *
+ * 配置了web_session_secret时, 会话cookie形如"键.会话ID.用户ID.过期时刻.签名",
+ * 签名是以密钥对前四项及用户名计算的HMAC-SHA1. 校验签名并确认会话仍在共享
+ * 内存会话表中即可, 无需访问redis. 会话结束或失效时从表中移除, 相当于吊销;
+ * 不在表中的会话仍按键走redis, 以便重新激活. 旧格式的cookie也走redis.
+ */
+/** @{ */
+
+enum {
+	SESSION_MAC_HEX_LEN = 40,
+};
+
+static void hex_encode(const unsigned char *digest, size_t size, char *buf)
+{
+	const char *str = "0123456789abcdef";
+	for (size_t i = 0; i < size; ++i) {
+		buf[i * 2] = str[digest[i] >> 4];
+		buf[i * 2 + 1] = str[digest[i] & 0x0f];
+	}
+	buf[size * 2] = '\0';
+}
+
+static bool session_mac(const char *key, session_id_t sid, user_id_t user_id,
+		fb_time_t expire, const char *user_name, char *mac)
+{
+	char msg[WEB_SESSION_COOKIE_LEN + IDLEN + 2];
+	int len = snprintf(msg, sizeof(msg), "%s.%"PRIdSID".%"PRIdUID".%"PRIdFBT
+			".%s", key, sid, user_id, expire, user_name);
+	if (len <= 0 || len >= sizeof(msg))
+		return false;
+	const unsigned char *digest = web_calc_hmac(msg, len);
+	if (!digest)
+		return false;
+	hex_encode(digest, SESSION_MAC_HEX_LEN / 2, mac);
+	return true;
+}
+
+/**
+ * 生成签名的会话cookie
+ * @param[in] key 会话键
+ * @param[in] sid 会话ID
+ * @param[in] user_id 用户ID
+ * @param[in] expire 签名过期时刻
+ * @param[in] user_name 用户名
+ * @param[out] cookie 缓冲区, 长度WEB_SESSION_COOKIE_LEN
+ * @return 成功true, 未配置密钥时返回false, cookie中为会话键
+ */
+bool session_sign_cookie(const char *key, session_id_t sid, user_id_t user_id,
+		fb_time_t expire, const char *user_name, char *cookie)
+{
+	char mac[SESSION_MAC_HEX_LEN + 1];
+	if (!session_mac(key, sid, user_id, expire, user_name, mac)) {
+		strlcpy(cookie, key, WEB_SESSION_COOKIE_LEN);
+		return false;
+	}
+	snprintf(cookie, WEB_SESSION_COOKIE_LEN, "%s.%"PRIdSID".%"PRIdUID
+			".%"PRIdFBT".%s", key, sid, user_id, expire, mac);
+	return true;
+}
+
+/**
+ * 由会话键导出API令牌, 以便不查询redis即可校验
+ * @param[in] key 会话键
+ * @param[out] token 令牌
+ * @param[in] size 令牌缓冲区长度, 不超过SESSION_MAC_HEX_LEN + 1
+ * @return 成功true, 未配置密钥时返回false
+ */
+bool session_derive_token(const char *key, char *token, size_t size)
+{
+	char msg[SESSION_KEY_LEN + 8];
+	int len = snprintf(msg, sizeof(msg), "token.%s", key);
+	const unsigned char *digest = web_calc_hmac(msg, len);
+	if (!digest || size > SESSION_MAC_HEX_LEN + 1)
+		return false;
+	char buf[SESSION_MAC_HEX_LEN + 1];
+	hex_encode(digest, SESSION_MAC_HEX_LEN / 2, buf);
+	strlcpy(token, buf, size);
+	return true;
+}
+
+/**
+ * 取出cookie中的会话键
+ * @param[in] cookie cookie值, 签名或旧格式
+ * @param[out] key 会话键
+ * @param[in] size 长度
+ */
+void session_cookie_key(const char *cookie, char *key, size_t size)
+{
+	size_t len = strcspn(cookie, ".");
+	if (len >= size)
+		len = size - 1;
+	memcpy(key, cookie, len);
+	key[len] = '\0';
+}
+
+/** 常数时间比较签名或令牌, 以免泄露匹配的长度 */
+static bool session_secret_equal(const char *given, const char *expected,
+		size_t len)
+{
+	if (strlen(given) != len)
+		return false;
+	int diff = 0;
+	for (size_t i = 0; i < len; ++i)
+		diff |= given[i] ^ expected[i];
+	return !diff;
+}
+
+static bool session_check_signed(const char *user_name, const char *cookie,
+		const char *token)
+{
+	char key[SESSION_KEY_LEN + 1];
+	size_t len = strcspn(cookie, ".");
+	if (!cookie[len] || len >= sizeof(key))
+		return false;
+	session_cookie_key(cookie, key, sizeof(key));
+
+	char *end;
+	session_id_t sid = strtoll(cookie + len + 1, &end, 10);
+	if (*end != '.')
+		return false;
+	user_id_t user_id = strtol(end + 1, &end, 10);
+	if (*end != '.')
+		return false;
+	fb_time_t expire = strtol(end + 1, &end, 10);
+	if (*end != '.' || sid <= 0 || user_id <= 0 || expire <= fb_time())
+		return false;
+
+	char mac[SESSION_MAC_HEX_LEN + 1];
+	if (!session_mac(key, sid, user_id, expire, user_name, mac)
+			|| !session_secret_equal(end + 1, mac, SESSION_MAC_HEX_LEN))
+		return false;
+
+	if (token) {
+		char expected[SESSION_TOKEN_LEN + 1];
+		if (!session_derive_token(key, expected, sizeof(expected))
+				|| !session_secret_equal(token, expected, strlen(expected)))
+			return false;
+	}
+
+	if (!session_table_active(sid, user_id))
+		return false;
+
+	session_set_id(sid);
+	session_set_user_id(user_id);
+	session_set_idle_cached();
+	return true;
+}
+/** @} */
+
 static bool activate_session(session_id_t session_id, const char *user_name,
 		const char *session_key, user_id_t user_id)
 {
 	bool ok = false;
 	db_res_t *res = db_query("UPDATE sessions SET active = TRUE, stamp = %t"
-			" WHERE id = %"DBIdSID" RETURNING token", fb_time(), session_id);
+			" WHERE id = %"DBIdSID" RETURNING token, ip_addr, visible",
+			fb_time(), session_id);
 	if (res && db_res_rows(res) == 1) {
 		if (!do_web_login(user_name, NULL, false)) {
 			const char *token = db_get_value(res, 0, 0);
+			session_table_insert(session_id, user_id, user_name, 0,
+					db_get_value(res, 0, 1), true, db_get_bool(res, 0, 2));
 			session_web_cache_set(user_id, session_key, token, session_id,
 					true);
 			ok = true;
@@ -71,7 +225,11 @@ bool session_validate(void)
 		token = web_get_param("token");
 	}
 
-	bool ok = session_check_web_cache(user_name, key, token);
+	char plain_key[SESSION_KEY_LEN + 1];
+	session_cookie_key(key, plain_key, sizeof(plain_key));
+
+	bool ok = session_check_signed(user_name, key, token)
+			|| session_check_web_cache(user_name, plain_key, token);
 	if (ok)
 		getuserec(user_name, &currentuser);
 
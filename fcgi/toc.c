@@ -175,6 +175,49 @@ bool get_board_by_param(board_t *bp)
 	return false;
 }
 
+/**
+ * 设置版面页面的验证器
+ * 由版面元数据版本和文章记录缓存的版本组成.
+ * @param[in] bp 版面
+ * @param[in] pid 文章ID, 非0时同时包含文章内容的版本
+ * @return 可以验证返回true
+ */
+bool set_board_validator(const board_t *bp, post_id_t pid)
+{
+	if (bp->flag & BOARD_FLAG_DIR)
+		return false;
+
+	fb_time_t modified, content_modified = 0;
+	uint64_t version = post_record_version(bp->id, &modified);
+	if (!version)
+		return false;
+
+	char etag[64];
+	if (pid) {
+		uint64_t content = post_content_version(pid, &content_modified);
+		if (!content)
+			return false;
+		if (content_modified > modified)
+			modified = content_modified;
+		snprintf(etag, sizeof(etag), "p%"PRIdPID"-%"PRIx32"-%"PRIx64"-%"PRIx64,
+				pid, board_cache_generation(), version, content);
+	} else {
+		snprintf(etag, sizeof(etag), "b%d-%"PRIx32"-%"PRIx64,
+				bp->id, board_cache_generation(), version);
+	}
+	web_set_validator(etag, modified);
+	return true;
+}
+
+/**
+ * 匿名请求版面文章列表的验证器
+ */
+bool bbsdoc_validate(void)
+{
+	board_t board;
+	return get_board_by_param(&board) && set_board_validator(&board, 0);
+}
+
 static int bbsdoc(post_list_type_e type)
 {
 	board_t board;
@@ -504,23 +547,23 @@ int web_forum(void)
 	return 0;
 }
 
-static void post_record_to_json(const post_record_t *pr, json_array_t *array)
+static void post_record_to_json(const post_record_t *pr)
 {
-	json_object_t *o = json_object_new();
-	json_object_bigint(o, "id", pr->id);
-	json_object_string(o, "title", pr->utf8_title);
-	json_object_string(o, "user_name", pr->user_name);
+	json_write_object_begin(NULL);
+	json_write_bigint("id", pr->id);
+	json_write_string("title", pr->utf8_title);
+	json_write_string("user_name", pr->user_name);
 	if (pr->flag & POST_FLAG_STICKY)
-		json_object_bool(o, "sticky", true);
+		json_write_bool("sticky", true);
 	if (brc_unread(post_stamp(pr->id)))
-		json_object_bool(o, "unread", true);
-	json_array_append(array, o, JSON_OBJECT);
+		json_write_bool("unread", true);
+	json_write_object_end();
 }
 
 static record_callback_e sticky_callback(void *ptr, void *args,
 		int offset)
 {
-	post_record_to_json(ptr, args);
+	post_record_to_json(ptr);
 	return RECORD_CALLBACK_CONTINUE;
 }
 
@@ -531,7 +574,6 @@ enum {
 };
 
 typedef struct {
-	json_array_t *array;
 	post_id_t since_id;
 	post_id_t max_id;
 	int count;
@@ -548,13 +590,21 @@ static record_callback_e board_toc_callback(void *ptr, void *args, int offset)
 		return RECORD_CALLBACK_CONTINUE;
 
 	if (pr->id == pr->thread_id) {
-		post_record_to_json(pr, a->array);
+		post_record_to_json(pr);
 		if (--a->count <= 0)
 			return RECORD_CALLBACK_BREAK;
 	}
 	return RECORD_CALLBACK_CONTINUE;
 }
 
+bool api_board_validate(void)
+{
+	board_t board;
+	int board_id = web_get_param_long("id");
+	return board_id > 0 && get_board_by_bid(board_id, &board) > 0
+			&& has_read_perm(&board) && set_board_validator(&board, 0);
+}
+
 /**
  * {
  *    board: { id: I, name: T, categ: T, descr: T, bms: T },
@@ -580,26 +630,26 @@ int api_board(void)
 	session_set_board(board.id);
 	brc_init(currentuser.userid, board.name);
 
-	json_object_t *object = json_object_new();
-	web_set_response(object, JSON_OBJECT);
+	web_stream_begin();
+	json_write_object_begin(NULL);
 
 	if (meta) {
-		json_object_t *b = json_object_new();
-		json_object_integer(b, "id", board.id);
-		json_object_string(b, "name", board.name);
-		json_object_string(b, "categ", board.categ);
-		json_object_string(b, "descr", board.descr);
-		json_object_string(b, "bms", board.bms);
+		json_write_object_begin("board");
+		json_write_integer("id", board.id);
+		json_write_string("name", board.name);
+		json_write_string("categ", board.categ);
+		json_write_string("descr", board.descr);
+		json_write_string("bms", board.bms);
 		if (board.flag & BOARD_FLAG_ANONY)
-			json_object_bool(b, "anonymous", true);
-		json_object_append(object, "board", b, JSON_OBJECT);
+			json_write_bool("anonymous", true);
+		json_write_object_end();
 	}
 
-	json_array_t *posts = json_array_new();
+	json_write_array_begin("posts");
 	if (sticky) {
 		record_t record;
 		if (post_record_open_sticky(board.id, &record) >= 0) {
-			record_foreach(&record, NULL, 0, sticky_callback, posts);
+			record_foreach(&record, NULL, 0, sticky_callback, NULL);
 			record_close(&record);
 		}
 	}
@@ -617,14 +667,14 @@ int api_board(void)
 		args.count = BOARD_TOC_COUNT_MIN;
 	if (args.count > BOARD_TOC_COUNT_MAX)
 		args.count = BOARD_TOC_COUNT_MAX;
-	args.array = posts;
 
 	record_t record;
 	if (post_record_open(board.id, &record) >= 0) {
 		record_reverse_foreach(&record, board_toc_callback, &args);
 		record_close(&record);
 	}
-	json_object_append(object, "posts", posts, JSON_ARRAY);
+	json_write_array_end();
+	json_write_object_end();
 	return WEB_OK;
 }
 
@@ -632,6 +682,7 @@ int api_board(void)
 
 enum {
 	MAXRSS = 10, ///< max. number of posts output
+	TOP_TOPICS = 10, ///< max. number of hot topics output
 };
 
 typedef struct {
@@ -701,26 +752,26 @@ int bbsrss_main(void)
 
 int api_trend(void)
 {
-	json_object_t *object = json_object_new();
-	web_set_response(object, JSON_OBJECT);
-	json_array_t *array = json_array_new();
-	json_object_append(object, "posts", array, JSON_ARRAY);
-
-	FILE *fp = fopen("etc/posts/day_f.data", "r");
-	if (fp) {
-		topic_stat_t topic;
-		while (fread(&topic, sizeof(topic), 1, fp) == 1) {
-			json_object_t *o = json_object_new();
-			json_object_string(o, "user_name", topic.owner);
-			json_object_string(o, "board_name", topic.bname);
-			json_object_integer(o, "board_id", topic.bid);
-			json_object_integer(o, "count", topic.count);
-			json_object_bigint(o, "thread_id", topic.tid);
-			json_object_string(o, "title", topic.utf8_title);
-			json_array_append(array, o, JSON_OBJECT);
-		}
+	web_stream_begin();
+	json_write_object_begin(NULL);
+	json_write_array_begin("posts");
+
+	topic_stat_t topics[TOP_TOPICS];
+	int count = hot_topic_get(topics, ARRAY_SIZE(topics));
+	for (int i = 0; i < count; ++i) {
+		const topic_stat_t *topic = topics + i;
+		json_write_object_begin(NULL);
+		json_write_string("user_name", topic->owner);
+		json_write_string("board_name", topic->bname);
+		json_write_integer("board_id", topic->bid);
+		json_write_integer("count", topic->count);
+		json_write_bigint("thread_id", topic->tid);
+		json_write_string("title", topic->utf8_title);
+		json_write_object_end();
 	}
-	fclose(fp);
+
+	json_write_array_end();
+	json_write_object_end();
 	return WEB_OK;
 }
 
@@ -730,22 +781,20 @@ int web_top10(void)
 	printf("<bbstop10>");
 	print_session();
 
-	FILE *fp = fopen("etc/posts/day_f.data", "r");
-	if (fp) {
-		topic_stat_t topic;
-		while (fread(&topic, sizeof(topic), 1, fp) == 1) {
-			printf("<top board='%s' owner='%s' count='%u' gid='%"PRIdPID"'>",
-					topic.bname, topic.owner, topic.count, topic.tid);
-			if (web_request_type(UTF8)) {
-				xml_fputs(topic.utf8_title);
-			} else {
-				GBK_BUFFER(title, POST_TITLE_CCHARS);
-				convert_u2g(topic.utf8_title, gbk_title);
-				xml_fputs(gbk_title);
-			}
-			printf("</top>\n");
+	topic_stat_t topics[TOP_TOPICS];
+	int count = hot_topic_get(topics, ARRAY_SIZE(topics));
+	for (int i = 0; i < count; ++i) {
+		const topic_stat_t *topic = topics + i;
+		printf("<top board='%s' owner='%s' count='%u' gid='%"PRIdPID"'>",
+				topic->bname, topic->owner, topic->count, topic->tid);
+		if (web_request_type(UTF8)) {
+			xml_fputs(topic->utf8_title);
+		} else {
+			GBK_BUFFER(title, POST_TITLE_CCHARS);
+			convert_u2g(topic->utf8_title, gbk_title);
+			xml_fputs(gbk_title);
 		}
-		fclose(fp);
+		printf("</top>\n");
 	}
 	printf("</bbstop10>");
 	return 0;
@@ -1,12 +1,19 @@
 #include <ctype.h>
 #include <gcrypt.h>
+#include <stdarg.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
 #include "libweb.h"
+#include "fbbs/cfg.h"
 #include "fbbs/pool.h"
 #include "fbbs/string.h"
 #include "fbbs/web.h"
 #include "fbbs/json.h"
+#include "fbbs/log.h"
 
 typedef struct {
 	const char *from;
@@ -25,12 +32,326 @@ struct web_ctx_t {
 	pool_t *p;
 	web_request_t req;
 	gcry_md_hd_t sha1;
+	gcry_md_hd_t hmac; ///< 以会话密钥初始化的HMAC-SHA1, 未配置密钥时不用
 	bool inited;
 	bool remove_cookies;
+	bool streamed; ///< 响应已经开始流式输出
+	char etag[64]; ///< 验证器, 空串表示没有
+	char last_modified[32]; ///< HTTP格式的最后修改时间
 	web_response_t resp;
+	FCGX_Request *fcgi; ///< 正在处理的请求
+	bool gzip_accepted; ///< 客户端接受gzip编码
+	bool out_started; ///< 已决定是否压缩, 响应头已经送出
+	bool gzip; ///< 正文经过压缩
+	bool zinited; ///< zs已初始化
+	z_stream zs; ///< 本线程的压缩流, 各请求间复用
+	char *capture; ///< 送出数据的副本, 供页面缓存使用
+	size_t capture_len; ///< 副本长度
+	size_t capture_limit; ///< 副本长度上限, 超出时放弃
+	size_t outlen; ///< 输出缓冲中的字节数
+	char out[WEB_OUTPUT_BUFFER]; ///< 输出缓冲
 };
 
-static struct web_ctx_t ctx = { .inited = false };
+static FB_THREAD_LOCAL struct web_ctx_t ctx = { .inited = false };
+
+/** 正文不小于此值时压缩, 0表示不压缩. 启动时读取, 各线程共享 */
+static int gzip_threshold;
+
+/** 签名会话用的密钥, NULL表示不签名. 启动时读取, 各线程共享 */
+static const char *session_secret;
+
+static void web_put_fcgi(const void *buf, size_t size)
+{
+	if (size && ctx.fcgi && ctx.fcgi->out)
+		FCGX_PutStr(buf, size, ctx.fcgi->out);
+
+	if (ctx.capture) {
+		if (ctx.capture_len + size <= ctx.capture_limit)
+			memcpy(ctx.capture + ctx.capture_len, buf, size);
+		ctx.capture_len += size;
+	}
+}
+
+/**
+ * 开始记录送出的全部数据(包括响应头)
+ * @param[in] limit 最大长度
+ */
+void web_capture_begin(size_t limit)
+{
+	ctx.capture = pool_alloc(ctx.p, limit);
+	ctx.capture_len = 0;
+	ctx.capture_limit = limit;
+}
+
+/**
+ * 原样送出一个完整的响应, 不再压缩.
+ * @param[in] buf 数据
+ * @param[in] size 长度
+ */
+void web_write_raw(const void *buf, size_t size)
+{
+	ctx.outlen = 0;
+	ctx.out_started = true;
+	ctx.gzip = false;
+	web_put_fcgi(buf, size);
+}
+
+bool web_gzip_accepted(void)
+{
+	return ctx.gzip_accepted;
+}
+
+/**
+ * 压缩一段正文并送出.
+ * @param[in] buf 数据
+ * @param[in] size 长度
+ * @param[in] flush Z_NO_FLUSH或者Z_FINISH
+ */
+static void web_deflate(const void *buf, size_t size, int flush)
+{
+	char zbuf[WEB_OUTPUT_BUFFER];
+	ctx.zs.next_in = (Bytef *) buf;
+	ctx.zs.avail_in = size;
+	do {
+		ctx.zs.next_out = (Bytef *) zbuf;
+		ctx.zs.avail_out = sizeof(zbuf);
+		if (deflate(&ctx.zs, flush) == Z_STREAM_ERROR)
+			return;
+		web_put_fcgi(zbuf, sizeof(zbuf) - ctx.zs.avail_out);
+	} while (ctx.zs.avail_out == 0);
+}
+
+static void web_emit(const void *buf, size_t size)
+{
+	if (ctx.gzip)
+		web_deflate(buf, size, Z_NO_FLUSH);
+	else
+		web_put_fcgi(buf, size);
+}
+
+/**
+ * 第一次送出缓冲时决定是否压缩正文.
+ * 只压缩文本类型, 且整个响应都在缓冲中时要求正文达到阈值.
+ * @param[in] final 响应是否已经结束
+ */
+static void web_output_begin(bool final)
+{
+	ctx.out_started = true;
+	ctx.gzip = false;
+	if (!ctx.gzip_accepted)
+		return;
+
+	const char *header_end = NULL;
+	for (const char *p = ctx.out; p + 1 < ctx.out + ctx.outlen; ++p) {
+		if (p[0] == '\n' && p[1] == '\n') {
+			header_end = p + 1;
+			break;
+		}
+	}
+	if (!header_end)
+		return;
+
+	size_t header = header_end - ctx.out;
+	if (final && ctx.outlen - header - 1 < (size_t) gzip_threshold)
+		return;
+
+	ctx.out[header] = '\0';
+	bool text = (strstr(ctx.out, "Content-type: text/")
+				|| strstr(ctx.out, "Content-type: application/json"))
+			&& !strstr(ctx.out, "Content-Encoding:");
+	ctx.out[header] = '\n';
+	if (!text)
+		return;
+
+	if (!ctx.zinited) {
+		if (deflateInit2(&ctx.zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+					15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return;
+		ctx.zinited = true;
+	} else if (deflateReset(&ctx.zs) != Z_OK) {
+		return;
+	}
+
+	web_put_fcgi(ctx.out, header);
+	static const char encoding[] =
+			"Content-Encoding: gzip\nVary: Accept-Encoding\n\n";
+	web_put_fcgi(encoding, sizeof(encoding) - 1);
+	ctx.gzip = true;
+
+	size_t skip = header + 1;
+	memmove(ctx.out, ctx.out + skip, ctx.outlen - skip);
+	ctx.outlen -= skip;
+}
+
+static void web_output_flush(bool final)
+{
+	if (!ctx.out_started)
+		web_output_begin(final);
+	web_emit(ctx.out, ctx.outlen);
+	ctx.outlen = 0;
+	if (final && ctx.gzip) {
+		web_deflate(NULL, 0, Z_FINISH);
+		ctx.gzip = false;
+	}
+}
+
+/**
+ * 将输出缓冲写给FastCGI.
+ */
+void web_flush(void)
+{
+	web_output_flush(false);
+}
+
+size_t web_write(const void *buf, size_t size)
+{
+	if (ctx.outlen + size > sizeof(ctx.out)) {
+		web_flush();
+		if (size > sizeof(ctx.out) / 2) {
+			web_emit(buf, size);
+			return size;
+		}
+	}
+	memcpy(ctx.out + ctx.outlen, buf, size);
+	ctx.outlen += size;
+	return size;
+}
+
+int web_printf(const char *fmt, ...)
+{
+	va_list ap;
+	size_t left = sizeof(ctx.out) - ctx.outlen;
+	va_start(ap, fmt);
+	int ret = vsnprintf(ctx.out + ctx.outlen, left, fmt, ap);
+	va_end(ap);
+	if (ret < 0 || (size_t) ret < left) {
+		if (ret > 0)
+			ctx.outlen += ret;
+		return ret;
+	}
+
+	web_flush();
+	va_start(ap, fmt);
+	if ((size_t) ret < sizeof(ctx.out)) {
+		ctx.outlen = vsnprintf(ctx.out, sizeof(ctx.out), fmt, ap);
+	} else {
+		char *buf = pool_alloc(ctx.p, ret + 1);
+		if (buf) {
+			vsnprintf(buf, ret + 1, fmt, ap);
+			web_emit(buf, ret);
+		}
+	}
+	va_end(ap);
+	return ret;
+}
+
+/**
+ * 输出字符串, 不附加换行.
+ */
+int web_put(const char *s)
+{
+	return web_write(s, strlen(s));
+}
+
+int web_puts(const char *s)
+{
+	web_put(s);
+	return web_putchar('\n');
+}
+
+int web_putchar(int c)
+{
+	if (ctx.outlen == sizeof(ctx.out))
+		web_flush();
+	ctx.out[ctx.outlen++] = c;
+	return (unsigned char) c;
+}
+
+size_t web_read(void *buf, size_t size)
+{
+	int ret = FCGX_GetStr(buf, size, ctx.fcgi->in);
+	return ret > 0 ? ret : 0;
+}
+
+/**
+ * 查找下一个需要转义的字符.
+ * SSE2下每次比较16字节: 控制字符及special中的字符都视为候选, 再由表确认.
+ * @param[in] e 转义表
+ * @param[in] s 字符串
+ * @param[in] size 长度
+ * @return 该字符的偏移, 没有则返回size
+ */
+static size_t web_escape_scan(const web_escape_t *e, const char *s, size_t size)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+	const __m128i c0 = _mm_set1_epi8(e->special[0]);
+	const __m128i c1 = _mm_set1_epi8(e->special[1]);
+	const __m128i c2 = _mm_set1_epi8(e->special[2]);
+	const __m128i c3 = _mm_set1_epi8(e->special[3]);
+	while (i + 16 <= size) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c0));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c1));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c2));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c3));
+		int mask = _mm_movemask_epi8(m);
+		while (mask) {
+			size_t j = i + __builtin_ctz(mask);
+			if (e->subst[(unsigned char) s[j]])
+				return j;
+			mask &= mask - 1;
+		}
+		i += 16;
+	}
+#endif
+	for (; i < size; ++i) {
+		if (e->subst[(unsigned char) s[i]])
+			return i;
+	}
+	return size;
+}
+
+/**
+ * 按转义表输出字符串.
+ * 不需转义的连续片段整段复制到输出缓冲.
+ * @param[in] e 转义表
+ * @param[in] s 字符串
+ * @param[in] size 长度
+ */
+void web_write_escaped(const web_escape_t *e, const char *s, size_t size)
+{
+	const char *end = s + size;
+	while (s < end) {
+		size_t n = web_escape_scan(e, s, end - s);
+		web_write(s, n);
+		s += n;
+		if (s == end)
+			break;
+		web_put(e->subst[(unsigned char) *s++]);
+	}
+}
+
+/**
+ * 获取当前请求的FastCGI参数.
+ * @param[in] key 键值
+ * @return 找到返回其内容, 否则NULL
+ */
+const char *web_getenv(const char *key)
+{
+	return FCGX_GetParam(key, ctx.fcgi->envp);
+}
+
+/**
+ * 结束当前请求的输出, 连接交还给FastCGI库.
+ */
+void web_finish(void)
+{
+	web_output_flush(true);
+	FCGX_Finish_r(ctx.fcgi);
+}
 
 /**
  * 获取HTTP请求的环境变量.
@@ -39,7 +360,7 @@ static struct web_ctx_t ctx = { .inited = false };
  */
 static const char *_get_server_env(const char *key)
 {
-	const char *s = getenv(key);
+	const char *s = web_getenv(key);
 	return s ? s : "";
 }
 
@@ -225,7 +546,7 @@ static void get_global_options(void)
 			ctx.req.flag |= pairs[i].flag;
 	}
 
-	const char *name = getenv("SCRIPT_NAME");
+	const char *name = web_getenv("SCRIPT_NAME");
 	if (name) {
 		if (ends_with(name, ".xml"))
 			ctx.req.flag |= WEB_REQUEST_XML | WEB_REQUEST_API;
@@ -235,7 +556,7 @@ static void get_global_options(void)
 	if (ctx.req.flag & WEB_REQUEST_API)
 		ctx.req.flag |= WEB_REQUEST_UTF8;
 
-	const char *xhr_header = getenv("HTTP_X_REQUESTED_WITH");
+	const char *xhr_header = web_getenv("HTTP_X_REQUESTED_WITH");
 	if (xhr_header && streq(xhr_header, "XMLHttpRequest"))
 		ctx.req.flag |= WEB_REQUEST_XHR;
 }
@@ -298,7 +619,7 @@ int web_parse_post_data(void)
 	char *buf = pool_alloc(ctx.p, size + 1);
 	if (!buf)
 		return -1;
-	if (fread(buf, size, 1, stdin) != 1)
+	if (web_read(buf, size) != size)
 		return -1;
 
 	buf[size] = '\0';
@@ -306,7 +627,31 @@ int web_parse_post_data(void)
 	return 0;
 }
 
-static int initialize_gcrypt(void)
+/**
+ * 检查Accept-Encoding是否包含gzip, 不接受q=0
+ */
+static bool accept_gzip(void)
+{
+	const char *s = web_getenv("HTTP_ACCEPT_ENCODING");
+	if (!s)
+		return false;
+	const char *p = strstr(s, "gzip");
+	if (!p)
+		return false;
+	p += 4;
+	while (*p == ' ')
+		++p;
+	if (*p != ';')
+		return true;
+	p = strchr(p, '=');
+	return !p || strtod(p + 1, NULL) > 0;
+}
+
+/**
+ * 初始化libgcrypt并读取输出设置, 须在启动工作线程之前调用.
+ * @return 成功0, 否则-1
+ */
+int web_initialize(void)
 {
 	if (!gcry_check_version(GCRYPT_VERSION))
 		return -1;
@@ -317,35 +662,118 @@ static int initialize_gcrypt(void)
 	if (gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0) != 0)
 		return -1;
 
-	if (gcry_md_open(&ctx.sha1, GCRY_MD_SHA1, 0) != 0)
-		return -1;
+	gzip_threshold = config_get_integer("web_gzip_threshold", 0);
 
+	session_secret = config_get("web_session_secret");
+	if (session_secret && strlen(session_secret) < WEB_SESSION_SECRET_MIN) {
+		log_internal_err("web_session_secret too short, ignored");
+		session_secret = NULL;
+	}
 	return 0;
 }
 
 /**
  * 初始化web环境
+ * @param[in] request 本线程接受的FastCGI请求
  * @return 成功true, 否则false
  */
-bool web_ctx_init(void)
+bool web_ctx_init(FCGX_Request *request)
 {
 	if (!ctx.inited) {
-		if (initialize_gcrypt() == 0)
-			ctx.inited = true;
-		else
+		if (gcry_md_open(&ctx.sha1, GCRY_MD_SHA1, 0) != 0)
 			return false;
+		if (session_secret && (gcry_md_open(&ctx.hmac, GCRY_MD_SHA1,
+						GCRY_MD_FLAG_HMAC) != 0
+					|| gcry_md_setkey(ctx.hmac, session_secret,
+						strlen(session_secret)) != 0))
+			return false;
+		ctx.inited = true;
 	}
 
+	ctx.fcgi = request;
+	ctx.outlen = 0;
+	ctx.out_started = ctx.gzip = false;
+	ctx.capture = NULL;
+	ctx.gzip_accepted = gzip_threshold > 0 && accept_gzip();
 	ctx.remove_cookies = false;
+	ctx.streamed = false;
+	ctx.etag[0] = ctx.last_modified[0] = '\0';
 	ctx.p = pool_create(0);
 	return parse_web_request();
 }
 
 void web_ctx_destroy(void)
 {
+	web_output_flush(true);
+	if (ctx.capture) {
+		web_cache_store(ctx.capture, ctx.capture_len <= ctx.capture_limit
+				? ctx.capture_len : 0);
+	}
 	pool_destroy(ctx.p);
 }
 
+/**
+ * 设置响应的验证器
+ * 之后输出的响应头中带有ETag和Last-Modified, 供条件请求使用.
+ * @param[in] etag 实体标签, 不含引号
+ * @param[in] modified 最后修改时间, 0表示未知
+ */
+void web_set_validator(const char *etag, fb_time_t modified)
+{
+	strlcpy(ctx.etag, etag, sizeof(ctx.etag));
+	ctx.last_modified[0] = '\0';
+	if (modified) {
+		time_t t = modified;
+		struct tm tm;
+		if (gmtime_r(&t, &tm)) {
+			strftime(ctx.last_modified, sizeof(ctx.last_modified),
+					"%a, %d %b %Y %H:%M:%S GMT", &tm);
+		}
+	}
+}
+
+/**
+ * 客户端缓存是否仍然有效
+ * If-None-Match优先. If-Modified-Since只做字符串比较, 客户端和代理
+ * 通常原样送回上次的Last-Modified.
+ * @return 有效返回true
+ */
+bool web_not_modified(void)
+{
+	if (!*ctx.etag)
+		return false;
+
+	const char *match = web_getenv("HTTP_IF_NONE_MATCH");
+	if (match) {
+		char tag[sizeof(ctx.etag) + 2];
+		snprintf(tag, sizeof(tag), "\"%s\"", ctx.etag);
+		return strstr(match, tag) || streq(match, "*");
+	}
+
+	const char *since = web_getenv("HTTP_IF_MODIFIED_SINCE");
+	return since && *ctx.last_modified && streq(since, ctx.last_modified);
+}
+
+static void print_validator(void)
+{
+	if (*ctx.etag) {
+		printf("Cache-Control: no-cache\nETag: W/\"%s\"\n", ctx.etag);
+		if (*ctx.last_modified)
+			printf("Last-Modified: %s\n", ctx.last_modified);
+	}
+}
+
+/**
+ * 回应304 Not Modified并结束请求.
+ */
+void web_respond_not_modified(void)
+{
+	printf("Status: %d\n", WEB_STATUS_NOT_MODIFIED);
+	print_validator();
+	putchar('\n');
+	web_finish();
+}
+
 /**
  * Print HTML response header.
  */
@@ -364,10 +792,11 @@ void xml_header(const char *xslfile)
 {
 	const char *charset = web_request_type(UTF8) ? "utf-8" : CHARSET;
 	const char *xsl = xslfile ? xslfile : "bbs";
-	printf("Content-type: text/xml; charset=%s\n\n"
-			"<?xml version=\"1.0\" encoding=\"%s\"?>\n"
+	printf("Content-type: text/xml; charset=%s\n", charset);
+	print_validator();
+	printf("\n<?xml version=\"1.0\" encoding=\"%s\"?>\n"
 			"<?xml-stylesheet type=\"text/xsl\" href=\"../xsl/%s.xsl?v20150923\"?>\n",
-			charset, charset, xsl);
+			charset, xsl);
 }
 
 void xml_print(const char *s)
@@ -395,14 +824,14 @@ void xml_print(const char *s)
 				break;
 		}
 		if (subst) {
-			fwrite(last, 1, c - last, stdout);
-			fputs(subst, stdout);
+			web_write(last, c - last);
+			web_put(subst);
 			last = ++c;
 		} else {
 			++c;
 		}
 	}
-	fwrite(last, 1, c - last, stdout);
+	web_write(last, c - last);
 }
 
 const unsigned char *web_calc_digest(const void *s, size_t size)
@@ -413,6 +842,22 @@ const unsigned char *web_calc_digest(const void *s, size_t size)
 	return gcry_md_read(ctx.sha1, 0);
 }
 
+/**
+ * 以配置的会话密钥计算HMAC-SHA1
+ * @param[in] s 数据
+ * @param[in] size 长度
+ * @return 20字节的摘要, 未配置密钥时返回NULL
+ */
+const unsigned char *web_calc_hmac(const void *s, size_t size)
+{
+	if (!session_secret)
+		return NULL;
+	gcry_md_reset(ctx.hmac);
+	gcry_md_write(ctx.hmac, s, size);
+	gcry_md_final(ctx.hmac);
+	return gcry_md_read(ctx.hmac, 0);
+}
+
 void *web_palloc(size_t size)
 {
 	return pool_alloc(ctx.p, size);
@@ -471,20 +916,45 @@ static web_status_code_e error_msg(web_error_code_e code)
 	return status;
 }
 
-void web_respond(web_error_code_e code)
+static void json_header(web_status_code_e status)
 {
-	web_status_code_e status = WEB_STATUS_OK;
-	if (code != WEB_OK)
-		status = error_msg(code);
-
 	printf("Content-type: application/json; charset=utf-8\n"
 			"Status: %d\n", (int) status);
+	if (status == WEB_STATUS_OK)
+		print_validator();
 	if (ctx.remove_cookies) {
 		remove_cookie(WEB_COOKIE_USER);
 		remove_cookie(WEB_COOKIE_KEY);
 	}
 	putchar('\n');
+}
+
+/**
+ * 开始流式输出JSON响应.
+ * 输出响应头, 之后用json_write_*()写入正文, 处理函数返回WEB_OK.
+ * 开始之后不能再返回错误.
+ */
+void web_stream_begin(void)
+{
+	json_header(WEB_STATUS_OK);
+	json_writer_reset();
+	ctx.streamed = true;
+}
+
+void web_respond(web_error_code_e code)
+{
+	if (ctx.streamed) {
+		if (!json_writer_done())
+			log_internal_err("incomplete json response");
+		web_finish();
+		return;
+	}
+
+	web_status_code_e status = WEB_STATUS_OK;
+	if (code != WEB_OK)
+		status = error_msg(code);
 
+	json_header(status);
 	json_dump(ctx.resp.object, ctx.resp.type);
-	FCGI_Finish();
+	web_finish();
 }
@@ -71,6 +71,7 @@
 #define RNDPASSLEN             10        /* 暗码认证的暗码长度 (适宜范围 4~10)*/
 
 #define PASSFILE     ".PASSWDS"    /* Name of file User records stored in */
+#define UCACHE_SNAPSHOT ".UCACHE"  /* Snapshot of the user cache */
 
 #define BOARDS      ".BOARDS"      /* File containing list of boards */
 #define DOT_DIR     ".DIR"         /* Name of Directory file info */
@@ -141,6 +142,7 @@ enum {
 };
 
 #include "struct.h"
+#include "fbbs/util.h"
 
 enum {
 	DONOTHING   = 0,  /* Read menu command return states */
@@ -157,14 +159,14 @@ enum {
 
 extern int digestmode; /*To control Digestmode*/
 
-extern struct userec currentuser;/*  user structure is loaded from passwd */
+extern FB_THREAD_LOCAL struct userec currentuser;/*  user structure is loaded from passwd */
 /*  file at logon, and remains for the   */
 /*  entire session */
 
 extern int usernum; /* Index into passwds file user record */
 extern int utmpent; /* Index into this users utmp file entry */
 
-extern struct userec lookupuser; /* Used when searching for other user info */
+extern FB_THREAD_LOCAL struct userec lookupuser; /* Used when searching for other user info */
 
 extern const char *currboard; /* name of currently selected board */
 extern char currBM[]; /* BM of currently selected board */
@@ -227,6 +229,13 @@ enum {
 
 void *attach_shm(const char *shmstr, int defaultkey, int shmsize);
 void *attach_shm2(const char *shmstr, int defaultkey, int shmsize, int *iscreate);
+
+typedef struct {
+	void *ptr;
+	int state;
+} shm_once_t;
+
+void *attach_shm_once(shm_once_t *once, const char *shmstr, int defaultkey, int shmsize, int *iscreate);
 int remove_shm(const char *shmstr, int defaultkey, int shmsize);
 
 #endif /* of _BBS_H_ */
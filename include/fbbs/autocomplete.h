@@ -5,7 +5,17 @@
 
 typedef struct ac_list ac_list;
 
+/**
+ * Find names starting with a prefix, case-insensitively.
+ * @param[in] prefix the prefix.
+ * @param[in,out] names array of matching names, grown by realloc().
+ * @param[in,out] size capacity of the array.
+ * @return number of matching names.
+ */
+typedef int (*ac_lookup_t)(const char *prefix, const char ***names, int *size);
+
 extern ac_list *ac_list_new(void);
+extern ac_list *ac_list_new_lookup(ac_lookup_t lookup);
 extern void ac_list_add(ac_list *acl, const char *name);
 extern void ac_list_free(ac_list *acl);
 extern void autocomplete(ac_list *acl, const char *prompt, char *buf, size_t size);
@@ -37,18 +37,25 @@ enum {
 	AC_LIST_DIR_ONLY,
 };
 
-typedef struct {
-	int id;
-	int parent;
-	int sector;
-	uint_t flag;
-	uint_t perm;
-	char name[BOARD_NAME_LEN + 1];
-	char bms[BOARD_BM_LEN + 1];
-	char descr[BOARD_DESCR_CCHARS * 4 + 1];
-	char categ[BOARD_CATEG_CCHARS * 4 + 1];
+typedef struct { // @dbrow
+	int id; // @column id
+	int parent; // @column parent
+	int sector; // @column sector
+	uint_t flag; // @column flag
+	uint_t perm; // @column perm
+	char name[BOARD_NAME_LEN + 1]; // @column name
+	char bms[BOARD_BM_LEN + 1]; // @column bms
+	char descr[BOARD_DESCR_CCHARS * 4 + 1]; // @column descr
+	char categ[BOARD_CATEG_CCHARS * 4 + 1]; // @column categ
 } board_t;
 
+/** 版面列表所需的统计信息 */
+typedef struct {
+	int online; ///< 在线会话数
+	int posts; ///< 文章数
+	fb_time_t last_post; ///< 最新发文时间
+} board_stat_t;
+
 #define BOARD_BASE_FIELDS \
 	"b.id, b.name, b.descr, b.parent, b.flag, b.perm, b.bms, b.categ, b.sector "
 #define BOARD_BASE_TABLES \
@@ -58,6 +65,10 @@ typedef struct {
 
 extern int get_board(const char *name, board_t *bp);
 extern int get_board_by_bid(int bid, board_t *bp);
+extern void board_cache_invalidate(void);
+extern uint32_t board_cache_generation(void);
+extern void board_stat_get(int bid, board_stat_t *stat);
+extern void board_stat_set_last_post(int bid, fb_time_t stamp);
 extern void res_to_board(db_res_t *res, int row, board_t *bp);
 extern void board_to_gbk(board_t *bp);
 extern bool is_bm(const struct userec *up, const board_t *bp);
@@ -9,6 +9,7 @@ typedef uint32_t brc_item_t;
 extern void brc_sync(const char *user_name);
 extern int brc_init(const char *user_name, const char *board_name);
 extern void brc_reset(void);
+extern int brc_convert(const char *user_name);
 
 extern bool brc_mark_as_read(brc_item_t item);
 extern bool brc_unread(brc_item_t item);
@@ -18,5 +19,7 @@ extern void brc_clear_all();
 
 extern void brc_zapbuf(int *zbuf);
 extern bool brc_board_unread(const char *user_name, const char *board_name, int board_id);
+extern int brc_unread_count(const char *user_name, const char *board_name, int board_id);
+extern int brc_boards_unread(const char *user_name, const int *bids, int count, bool *unread);
 
 #endif // FB_BRC_H
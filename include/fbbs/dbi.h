@@ -2,6 +2,7 @@
 #define FB_DBI_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <libpq-fe.h>
@@ -17,9 +18,17 @@ typedef enum db_exec_status_t {
 	DBRES_TUPLES_OK = PGRES_TUPLES_OK,
 } db_exec_status_t;
 
+enum {
+	DB_REPLICA_DEFAULT_MAX_LAG = 1024 * 1024, ///< bytes of WAL
+};
+
 extern db_timestamp time_to_ts(fb_time_t t);
 
 extern bool db_connect(const char *host, const char *port, const char *db, const char *user, const char *pwd);
+extern int db_add_replica(const char *host, const char *port, const char *db, const char *user, const char *pwd);
+extern void db_set_replica_max_lag(int64_t bytes);
+extern void db_request_begin(void);
+extern void db_pin_primary(void);
 extern void db_finish(void);
 extern const char *db_errmsg(void);
 
@@ -41,6 +50,25 @@ extern float db_get_float(const db_res_t *res, int row, int col);
 #define db_get_length(res, row, col)  PQgetlength(res, row, col)
 #define db_field_name(res, col)  PQfname(res, col)
 
+typedef enum {
+	DB_COLUMN_INTEGER, ///< integer of any width
+	DB_COLUMN_BOOL,
+	DB_COLUMN_TIME,
+	DB_COLUMN_STRING, ///< NUL-terminated, truncated to size
+	DB_COLUMN_FLAG, ///< boolean column setting a bit in an int field
+} db_column_e;
+
+/** Maps a result column to a struct field, see util/serialization_codegen */
+typedef struct {
+	const char *name;
+	db_column_e type;
+	uint16_t offset;
+	uint16_t size;
+	int flag;
+} db_column_t;
+
+extern int db_decode_rows(const db_res_t *res, int row, int count, const db_column_t *columns, int ncolumns, void *buf, size_t stride);
+
 extern db_res_t *db_cmd(const char *cmd, ...);
 extern db_res_t *db_query(const char *cmd, ...);
 
@@ -68,4 +96,5 @@ extern void query_orderby(query_t *q, const char *field, bool asc);
 extern void query_limit(query_t *q, int limit);
 extern db_res_t *query_exec(query_t *q);
 extern db_res_t *query_cmd(query_t *q);
+extern void query_readonly(query_t *q);
 #endif // FB_DBI_H
@@ -15,6 +15,9 @@ extern void edit_followed_note(user_id_t follower, user_id_t followed, const cha
 
 extern bool am_followed_by(const char *uname);
 
+extern int follow_graph_following(user_id_t uid, user_id_t **list);
+extern int follow_graph_followers(user_id_t uid, user_id_t **list);
+
 typedef db_res_t following_list_t;
 
 extern following_list_t *following_list_load(user_id_t uid);
@@ -37,4 +37,16 @@ extern json_value_t *json_array_bool(json_array_t *array, bool value);
 extern json_value_t *json_array_append(json_array_t *array, json_object_t *value, json_value_e type);
 
 extern void json_dump(const json_object_t *object, json_value_e type);
+
+extern void json_writer_reset(void);
+extern bool json_writer_done(void);
+extern void json_write_object_begin(const char *key);
+extern void json_write_object_end(void);
+extern void json_write_array_begin(const char *key);
+extern void json_write_array_end(void);
+extern void json_write_null(const char *key);
+extern void json_write_string(const char *key, const char *value);
+extern void json_write_integer(const char *key, int value);
+extern void json_write_bigint(const char *key, int64_t value);
+extern void json_write_bool(const char *key, bool value);
 #endif // FB_JSON_H
@@ -20,6 +20,12 @@ extern mdb_res_t *mdb_res_at(const mdb_res_t *res, int index);
 extern mdb_res_t *mdb_recv(void);
 extern void mdb_clear(mdb_res_t *res);
 
+extern void mdb_pipeline_begin(void);
+extern mdb_res_t *mdb_pipeline_exec(void);
+
+extern int mdb_cache_enable(const char *key, int ttl);
+extern void mdb_cache_report(void);
+
 extern mdb_int_t mdb_integer(mdb_int_t invalid, const char *cmd, const char *fmt, ...);
 extern char *mdb_string_and_size(mdb_res_t *res, size_t *size);
 extern char *mdb_string(mdb_res_t *res);
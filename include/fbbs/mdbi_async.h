@@ -0,0 +1,20 @@
+#ifndef FB_MDBI_ASYNC_H
+#define FB_MDBI_ASYNC_H
+
+#include <ev.h>
+#include "fbbs/mdbi.h"
+
+/**
+ * Called with the reply, or NULL on error, timeout or disconnection.
+ * The reply is freed after the callback returns.
+ */
+typedef void (*mdb_async_callback_t)(mdb_res_t *res, void *arg);
+
+extern int mdb_async_connect(struct ev_loop *loop, const char *host, int port);
+extern int mdb_async_connect_unix(struct ev_loop *loop, const char *path);
+extern void mdb_async_disconnect(void);
+extern bool mdb_async_connected(void);
+
+extern int mdb_async_cmd(mdb_async_callback_t callback, void *arg, int timeout, const char *cmd, const char *fmt, ...);
+
+#endif // FB_MDBI_ASYNC_H
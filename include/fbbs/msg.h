@@ -9,5 +9,7 @@ extern int logout_msg(const char *msg);
 extern int login_msg(void);
 extern void msg_reply(int ch);
 extern void msg_handler(int signum);
+extern bool msg_ring_open(void);
+extern void msg_ring_close(void);
 
 #endif // FB_MSG_H
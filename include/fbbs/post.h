@@ -27,6 +27,8 @@ typedef int64_t post_id_t;
 #define parcel_read_post_id(parcel)  parcel_read_varint64(parcel)
 
 #define POST_BOARD_COUNT_KEY "post:board_count"
+/** 版面最新一篇文章的时间 @mdb_hash */
+#define LAST_POST_KEY  "last_post"
 
 typedef enum {
 	POST_FLAG_DIGEST = 1,
@@ -79,19 +81,19 @@ enum {
 
 typedef struct post_list_position_t post_list_position_t;
 
-typedef struct {
-	post_id_t id;
-	post_id_t reply_id;
-	post_id_t thread_id;
+typedef struct { // @dbrow
+	post_id_t id; // @column post_id
+	post_id_t reply_id; // @column reply_id
+	post_id_t thread_id; // @column thread_id
 	fb_time_t delete_stamp;
-	int flag;
-	user_id_t user_id;
+	int flag; // @column is_read:POST_FLAG_READ
+	user_id_t user_id; // @column user_id
 	user_id_t user_id_replied;
-	int board_id;
-	char user_name[IDLEN + 1];
+	int board_id; // @column board_id
+	char user_name[IDLEN + 1]; // @column user_name
 	char eraser_name[IDLEN + 1];
-	char board_name[BOARD_NAME_LEN];
-	UTF8_BUFFER(title, POST_TITLE_CCHARS);
+	char board_name[BOARD_NAME_LEN]; // @column board_name
+	UTF8_BUFFER(title, POST_TITLE_CCHARS); // @column title
 } post_info_t;
 
 typedef struct {
@@ -141,17 +143,17 @@ typedef enum {
 	POST_JUNK = 0,
 } post_trash_e;
 
-typedef struct {
-	post_id_t id;
-	post_id_t reply_id;
-	post_id_t thread_id;
-	user_id_t user_id;
-	user_id_t user_id_replied;
-	int board_id;
-	int flag;
-	char user_name[IDLEN + 1];
+typedef struct { // @dbrow
+	post_id_t id; // @column id
+	post_id_t reply_id; // @column reply_id
+	post_id_t thread_id; // @column thread_id
+	user_id_t user_id; // @column user_id
+	user_id_t user_id_replied; // @column user_id_replied
+	int board_id; // @column board_id
+	int flag; // @column digest:POST_FLAG_DIGEST marked:POST_FLAG_MARKED locked:POST_FLAG_LOCKED imported:POST_FLAG_IMPORT water:POST_FLAG_WATER
+	char user_name[IDLEN + 1]; // @column user_name
 	char board_name[BOARD_NAME_LEN + 1];
-	UTF8_BUFFER(title, POST_TITLE_CCHARS);
+	UTF8_BUFFER(title, POST_TITLE_CCHARS); // @column title
 } post_record_t;
 
 typedef struct {
@@ -173,8 +175,17 @@ typedef struct {
 	char bname[BOARD_NAME_LEN + 1];
 } topic_stat_t;
 
+extern bool hot_topic_excluded(const board_t *board);
+extern bool hot_topic_tracked(post_id_t tid);
+extern void hot_topic_update(const topic_stat_t *topic, user_id_t author);
+extern void hot_topic_remove(post_id_t tid);
+extern void hot_topic_board_changed(const board_t *board);
+extern int hot_topic_get(topic_stat_t *topics, int max);
+
 extern int post_record_cmp(const void *p1, const void *p2);
 extern int post_record_open(int board_id, record_t *record);
+extern int post_record_open_cached(int board_id, record_t *record);
+extern uint64_t post_record_version(int board_id, fb_time_t *modified);
 extern int post_record_open_sticky(int board_id, record_t *record);
 extern int post_record_open_trash(int board_id, post_trash_e trash, record_t *record);
 
@@ -188,6 +199,7 @@ extern char *post_convert_to_utf8(const char *file);
 
 extern bool set_last_post_time(int bid, fb_time_t stamp);
 extern fb_time_t get_last_post_time(int bid);
+extern int get_last_post_times(const int *bids, int count, fb_time_t *stamps);
 
 extern int post_mark_raw(fb_time_t stamp, int flag);
 extern int post_mark(const post_info_t *p);
@@ -285,6 +297,7 @@ extern int post_sticky_count(int board_id);
 extern char *post_content_cache_filename(post_id_t post_id, char *file, size_t size);
 extern char *post_content_deleted_filename(post_id_t post_id, char *file, size_t size);
 extern char *post_content_get(post_id_t post_id, bool read_deleted);
+extern uint64_t post_content_version(post_id_t post_id, fb_time_t *modified);
 extern bool post_content_set(post_id_t post_id, const char *str);
 
 extern char *post_reply_table_name(user_id_t user_id, char *name, size_t size);
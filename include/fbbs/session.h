@@ -28,6 +28,9 @@ enum {
 
 	SESSION_WEB_CACHE_ENTRY_LEN = SESSION_KEY_LEN + 32,
 	SESSION_WEB_CACHE_VALUE_LEN = SESSION_TOKEN_LEN + 80,
+
+	SESSION_USER_NAME_LEN = 16,
+	SESSION_IP_ADDR_LEN = 40,
 };
 
 typedef enum {
@@ -125,6 +128,7 @@ extern void session_set_idle_cached(void);
 extern int session_set_board(int bid);
 extern int session_get_board(session_id_t sid);
 extern int session_count_online_board(int bid);
+extern int session_count_online_boards(int *counts, int size);
 extern int set_user_status(int status);
 extern session_status_e get_user_status(session_id_t sid);
 
@@ -143,6 +147,25 @@ extern session_basic_info_t *get_my_sessions(void);
 #define session_basic_info_web(r, i)  db_get_bool(r, i, 3)
 #define session_basic_info_clear(r)  db_clear(r)
 
+/** 在线会话信息, 即共享内存会话表中一个槽位的快照 */
+typedef struct {
+	session_id_t id; ///< 会话ID, 0表示空槽位
+	user_id_t user_id;
+	int pid;
+	int board;
+	fb_time_t idle;
+	int status;
+	int flag; ///< SESSION_FLAG_WEB | SESSION_FLAG_INVISIBLE
+	char user_name[SESSION_USER_NAME_LEN];
+	char ip_addr[SESSION_IP_ADDR_LEN];
+} session_info_t;
+
+extern bool session_table_insert(session_id_t sid, user_id_t user_id, const char *user_name, int pid, const char *ip_addr, bool is_web, bool visible);
+extern bool session_table_active(session_id_t sid, user_id_t user_id);
+extern int session_table_sync(void);
+extern int session_list(session_info_t **list, user_id_t user_id);
+extern int session_count_online_users(const user_id_t *uids, int count, bool visible_only);
+
 extern int session_count_online(void);
 extern int session_get_online_record(void);
 extern void session_set_online_record(int online);
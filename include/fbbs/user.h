@@ -13,6 +13,9 @@ typedef int32_t user_id_t;
 #define parcel_write_user_id(parcel, id)  parcel_write_varint(parcel, id)
 #define parcel_read_user_id(parcel)  parcel_read_varint(parcel)
 
+/** 以用户名查用户ID @mdb_hash */
+#define USER_ID_HASH_KEY  "user_id"
+
 #define has_permission(p, x)  ((x) ? p & (x) : 1)
 
 enum {
@@ -34,6 +34,9 @@
 
 #define ARRAY_SIZE(x)  (sizeof(x) / sizeof(x[0]))
 
+/** Per-thread storage for state that used to be process-wide. */
+#define FB_THREAD_LOCAL  __thread
+
 #define FB_ULONG_MAX  UINT64_MAX
 #define FB_UINT_MAX   UINT32_MAX
 #define FB_USHORT_MAX UINT16_MAX
@@ -1,9 +1,11 @@
 #ifndef FB_WEB_H
 #define FB_WEB_H
 
-#include <fcgi_stdio.h>
+#include <stdio.h>
+#include <fcgiapp.h>
 
 #include "fbbs/json.h"
+#include "fbbs/time.h"
 
 #define WEB_COOKIE_KEY  "utmpkey"
 #define WEB_COOKIE_USER  "utmpuser"
@@ -11,6 +13,9 @@
 enum {
 	WEB_PARAM_MAX = 32,
 	MAX_CONTENT_LENGTH = 1 * 1024 * 1024,
+	WEB_OUTPUT_BUFFER = 16 * 1024,
+	WEB_SESSION_SECRET_MIN = 16,
+	WEB_SESSION_COOKIE_LEN = 128,
 
 	PARSE_NOSIG = 0x1,
 	PARSE_NOQUOTEIMG = 0x2,
@@ -37,6 +42,7 @@ typedef enum {
 typedef enum {
 	WEB_STATUS_OK = 200,
 	WEB_STATUS_FOUND = 302,
+	WEB_STATUS_NOT_MODIFIED = 304,
 	WEB_STATUS_BAD_REQUEST = 400,
 	WEB_STATUS_UNAUTHORIZED = 401,
 	WEB_STATUS_FORBIDDEN = 403,
@@ -66,9 +72,43 @@ typedef struct {
 	char *val;
 } web_param_pair_t;
 
-extern bool web_ctx_init(void);
+extern int web_initialize(void);
+extern bool web_ctx_init(FCGX_Request *request);
 extern void web_ctx_destroy(void);
 
+/**
+ * 转义表
+ * subst中为NULL的字符原样输出, 空串表示丢弃. 控制字符和special中的字符
+ * 供快速扫描使用, 其余需要转义的字符不能超出这个范围.
+ */
+typedef struct {
+	const char *subst[256];
+	char special[4];
+} web_escape_t;
+
+extern int web_printf(const char *fmt, ...);
+extern int web_puts(const char *s);
+extern int web_put(const char *s);
+extern int web_putchar(int c);
+extern size_t web_write(const void *buf, size_t size);
+extern void web_write_escaped(const web_escape_t *e, const char *s, size_t size);
+extern void web_flush(void);
+extern void web_capture_begin(size_t limit);
+extern void web_write_raw(const void *buf, size_t size);
+extern bool web_gzip_accepted(void);
+
+extern bool web_cache_initialize(void);
+extern bool web_cache_lookup(int ttl);
+extern void web_cache_store(const char *data, size_t size);
+extern size_t web_read(void *buf, size_t size);
+extern const char *web_getenv(const char *key);
+extern void web_finish(void);
+
+/** 标准输出都写到当前线程正在处理的请求 */
+#define printf  web_printf
+#define puts  web_puts
+#define putchar  web_putchar
+
 extern const char *web_get_param(const char *name);
 extern const web_param_pair_t *web_get_param_pair(int idx);
 extern long web_get_param_long(const char *key);
@@ -86,10 +126,15 @@ extern void xml_print(const char *s);
 extern int xml_print_post(const char *str, size_t size, int option);
 
 extern const unsigned char *web_calc_digest(const void *s, size_t size);
+extern const unsigned char *web_calc_hmac(const void *s, size_t size);
 
 extern void *web_palloc(size_t size);
 extern char *web_pstrdup(const char *s);
 
+extern void web_set_validator(const char *etag, fb_time_t modified);
+extern bool web_not_modified(void);
+extern void web_respond_not_modified(void);
+extern void web_stream_begin(void);
 extern void web_set_response(json_object_t *object, json_value_e type);
 extern void web_remove_cookies(void);
 extern void web_respond(web_error_code_e code);
@@ -14,20 +14,22 @@ int resolve_boards(void);
 //ucache.c (bcache.c)
 extern struct UCACHE *uidshm;
 extern struct UTMPFILE *utmpshm;
-extern struct userec lookupuser;
+extern FB_THREAD_LOCAL struct userec lookupuser;
 int cmpuids(const void *uid, const void *up);
 int dosearchuser(const char *userid, struct userec *user, int *unum);
-int uhashkey(const char *userid, int *a1, int *a2);
 int del_uidshm(int num, char *userid);
 int ucache_lock();
 void ucache_unlock(int fd);
 int load_ucache(void);
 int substitut_record(char *filename, const void *rptr, size_t size, int id);
 int flush_ucache(void);
+int ucache_snapshot_save(const char *file);
+int ucache_snapshot_verify(const char *file, fb_time_t *stamp);
 int resolve_ucache(void);
 void setuserid(int num, const char *userid);
 int getuserid(char *userid, int uid, size_t len);
 int searchuser(const char *userid);
+int ucache_prefix_search(const char *prefix, const char ***names, int *size);
 int getuserec(const char *userid, struct userec *u);
 int getuser(const char *userid);
 int getuserbyuid(struct userec *u, int uid);
@@ -90,12 +90,11 @@ struct UCACHE { //用户的缓冲
 	char userid[MAXUSERS ][IDLEN + 1 ];
 	int number;	// last occupied slot in 'userid' array.
 	time_t uptime;
-	/* add by stiger */
-	int next[MAXUSERS];
-	int prev[MAXUSERS];
-	int hash[26][26][256];
+	uint64_t index[MAXUSERS * 2]; ///< 用户名索引, 见lib/ucache.c
+	int sorted_seq; ///< 'sorted'正在修改时为奇数
+	int sorted_count;
+	int sorted[MAXUSERS]; ///< 按用户名(不区分大小写)排序的位置, 用于补全
 	struct userec passwd[MAXUSERS]; //内存映射的数目太多了一点?
-	/* add end */
 	int status[MAXUSERS];
 };
 
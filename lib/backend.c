@@ -15,7 +15,7 @@ enum {
 	BACKEND_BUSY_RETRIES = 3,
 };
 
-static int backend_proxy_fd = -1;
+static FB_THREAD_LOCAL int backend_proxy_fd = -1;
 
 static bool backend_sighup = false;
 
@@ -38,8 +38,16 @@ int backend_proxy_connect(const char *socket_path, bool client)
 	memset(&proxy, 0, sizeof(proxy));
 	local.sun_family = AF_UNIX;
 	proxy.sun_family = AF_UNIX;
-	snprintf(local.sun_path, sizeof(local.sun_path),
-			"%s/%s.%d", socket_path, client ? "client" : "server", getpid());
+	// Each thread of a process connects on its own, suffixed by a sequence.
+	static int connections = 0;
+	int seq = __sync_fetch_and_add(&connections, 1);
+	if (seq) {
+		snprintf(local.sun_path, sizeof(local.sun_path), "%s/%s.%d.%d",
+				socket_path, client ? "client" : "server", getpid(), seq);
+	} else {
+		snprintf(local.sun_path, sizeof(local.sun_path), "%s/%s.%d",
+				socket_path, client ? "client" : "server", getpid());
+	}
 	snprintf(proxy.sun_path, sizeof(proxy.sun_path), "%s/proxy", socket_path);
 
 	(void) unlink(local.sun_path);
@@ -49,7 +57,8 @@ int backend_proxy_connect(const char *socket_path, bool client)
 		return -1;
 	}
 
-	atexit(backend_proxy_disconnect);
+	if (!seq)
+		atexit(backend_proxy_disconnect);
 
 	backend_proxy_fd = fd;
 	return fd;
@@ -1,9 +1,15 @@
+#include <sched.h>
+#include <signal.h>
 #include "bbs.h"
 #include "fbbs/board.h"
 #include "fbbs/convert.h"
 #include "fbbs/helper.h"
+#include "fbbs/log.h"
 #include "fbbs/mdbi.h"
+#include "fbbs/post.h"
+#include "fbbs/session.h"
 #include "fbbs/string.h"
+#include "s11n/db_board.h"
 
 static board_t curr_board = { .id = 0 };
 board_t *currbp = &curr_board;
@@ -50,20 +56,327 @@ bool is_board_dir(const board_t *bp)
 
 void res_to_board(db_res_t *res, int row, board_t *bp)
 {
-	bp->id = db_get_integer(res, row, 0);
-	bp->parent = db_get_integer(res, row, 3);
-	bp->flag = (uint_t) db_get_integer(res, row, 4);
-	bp->perm = (uint_t) db_get_integer(res, row, 5);
-	strlcpy(bp->name, db_get_value(res, row, 1), sizeof(bp->name));
-	strlcpy(bp->bms, db_get_value(res, row, 6), sizeof(bp->bms));
-	strlcpy(bp->descr, db_get_value(res, row, 2), sizeof(bp->descr));
-	strlcpy(bp->categ, db_get_value(res, row, 7), sizeof(bp->categ));
-	bp->sector = db_get_integer(res, row, 8);
+	db_decode_board(res, row, 1, bp, sizeof(*bp));
+}
+
+enum {
+	BOARD_CACHE_SHMKEY = 30110,
+	BOARD_CACHE_TTL = 600, ///< reload at least this often (seconds)
+	BOARD_CACHE_RETRY = 8,
+};
+
+/**
+ * 共享内存中的版面元数据缓存
+ *
+ * boards按id有序, by_name为按版名(不区分大小写)排序的下标.
+ * 修改boards表后调用board_cache_invalidate()递增generation,
+ * 读者发现loaded_generation落后或缓存过期时由一个进程重新载入.
+ * 载入期间seq为奇数, 读者在seq不变时拷贝记录, 否则回退到数据库.
+ */
+typedef struct {
+	uint32_t generation;
+	uint32_t loaded_generation;
+	uint32_t seq;
+	pid_t lock;
+	fb_time_t stamp;
+	int count;
+	int16_t by_name[MAXBOARD];
+	board_t boards[MAXBOARD];
+} board_cache_t;
+
+static board_cache_t *board_cache_get(void)
+{
+	static shm_once_t once;
+	int created;
+	return attach_shm_once(&once, "BRDMETA_SHMKEY", BOARD_CACHE_SHMKEY,
+			sizeof(board_cache_t), &created);
+}
+
+static const board_t *board_cache_sort_base;
+
+static int board_cache_name_cmp(const void *a, const void *b)
+{
+	const board_t *base = board_cache_sort_base;
+	return strcasecmp(base[*(const int16_t *) a].name,
+			base[*(const int16_t *) b].name);
+}
+
+/** 尝试获取以进程号标记的共享内存锁, 持有者已退出时接管 */
+static bool board_shm_trylock(pid_t *lock)
+{
+	pid_t pid = getpid();
+	pid_t holder = __sync_val_compare_and_swap(lock, 0, pid);
+	if (!holder)
+		return true;
+	if (kill(holder, 0) < 0 && errno == ESRCH)
+		return __sync_bool_compare_and_swap(lock, holder, pid);
+	return false;
+}
+
+static bool board_cache_reload(board_cache_t *c, uint32_t generation)
+{
+	if (!board_shm_trylock(&c->lock))
+		return false;
+
+	db_res_t *res = db_query(BOARD_SELECT_QUERY_BASE "ORDER BY b.id");
+	int rows = res ? db_res_rows(res) : 0;
+	bool ok = res && rows <= MAXBOARD;
+	if (ok) {
+		__sync_add_and_fetch(&c->seq, 1);
+		db_decode_board(res, 0, rows, c->boards, sizeof(*c->boards));
+		for (int i = 0; i < rows; ++i)
+			c->by_name[i] = i;
+		board_cache_sort_base = c->boards;
+		qsort(c->by_name, rows, sizeof(*c->by_name), board_cache_name_cmp);
+		c->count = rows;
+		c->loaded_generation = generation;
+		c->stamp = fb_time();
+		__sync_add_and_fetch(&c->seq, 1);
+	} else if (res) {
+		log_internal_err("board cache: too many boards");
+	}
+	db_clear(res);
+
+	__sync_lock_release(&c->lock);
+	return ok;
+}
+
+static board_cache_t *board_cache_fresh(void)
+{
+	board_cache_t *c = board_cache_get();
+	if (!c)
+		return NULL;
+
+	uint32_t generation = *(volatile uint32_t *) &c->generation;
+	if (*(volatile uint32_t *) &c->loaded_generation == generation
+			&& *(volatile fb_time_t *) &c->stamp + BOARD_CACHE_TTL > fb_time())
+		return c;
+	return board_cache_reload(c, generation) ? c : NULL;
+}
+
+static int board_cache_search(const board_cache_t *c, int count,
+		int bid, const char *name)
+{
+	int lo = 0, hi = count - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2, idx = mid, cmp;
+		if (name) {
+			idx = c->by_name[mid];
+			if (idx < 0 || idx >= count)
+				return -1;
+			cmp = strcasecmp(c->boards[idx].name, name);
+		} else {
+			cmp = c->boards[mid].id < bid ? -1 : c->boards[mid].id > bid;
+		}
+		if (!cmp)
+			return idx;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+/**
+ * 从缓存中查找版面
+ * @param[in] bid 版面ID, name非空时忽略
+ * @param[in] name 版面名称
+ * @param[out] bp 找到时为版面记录, 否则id为0
+ * @return 缓存可用返回true, 否则false
+ */
+static bool board_cache_lookup(int bid, const char *name, board_t *bp)
+{
+	board_cache_t *c = board_cache_fresh();
+	if (!c)
+		return false;
+
+	for (int i = 0; i < BOARD_CACHE_RETRY; ++i) {
+		uint32_t seq = *(volatile uint32_t *) &c->seq;
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+
+		int count = c->count;
+		if (count < 0 || count > MAXBOARD)
+			count = 0;
+		int idx = board_cache_search(c, count, bid, name);
+		if (idx >= 0)
+			memcpy(bp, c->boards + idx, sizeof(*bp));
+		else
+			bp->id = 0;
+
+		__sync_synchronize();
+		if (*(volatile uint32_t *) &c->seq == seq)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * 版面元数据的版本, 每次修改后递增
+ * @return 版本, 缓存不可用时返回0
+ */
+uint32_t board_cache_generation(void)
+{
+	board_cache_t *c = board_cache_get();
+	return c ? *(volatile uint32_t *) &c->generation : 0;
+}
+
+/** 通知各进程版面元数据已修改 */
+void board_cache_invalidate(void)
+{
+	board_cache_t *c = board_cache_get();
+	if (c)
+		__sync_add_and_fetch(&c->generation, 1);
+}
+
+enum {
+	BOARD_STAT_SHMKEY = 30120,
+	BOARD_STAT_IDS = MAXBOARD * 4, ///< 编号更大的版面不进入快照
+	BOARD_STAT_TTL = 10,
+};
+
+/**
+ * 共享内存中的版面统计快照
+ *
+ * 以版面ID为下标保存在线人数, 文章数和最新发文时间, 供版面列表一次读取.
+ * 快照过期后由一个进程从会话表和redis重新生成, 期间seq为奇数.
+ * 发文时直接更新最新发文时间, 以免未读标记滞后.
+ */
+typedef struct {
+	pid_t lock;
+	uint32_t seq;
+	fb_time_t stamp;
+	board_stat_t stats[BOARD_STAT_IDS];
+} board_stat_cache_t;
+
+static board_stat_cache_t *board_stat_cache_get(void)
+{
+	static shm_once_t once;
+	int created;
+	return attach_shm_once(&once, "BRDSTAT_SHMKEY", BOARD_STAT_SHMKEY,
+			sizeof(board_stat_cache_t), &created);
+}
+
+/** 将redis散列中以版面ID为键的整数值读入stats */
+static bool board_stat_load_hash(const char *key, board_stat_t *stats,
+		bool last_post)
+{
+	mdb_res_t *res = mdb_res("HGETALL", "%s", key);
+	if (!res)
+		return false;
+	for (int i = 0; ; i += 2) {
+		const char *field = mdb_string(mdb_res_at(res, i));
+		const char *value = mdb_string(mdb_res_at(res, i + 1));
+		if (!field || !value)
+			break;
+		int bid = strtol(field, NULL, 10);
+		if (bid <= 0 || bid >= BOARD_STAT_IDS)
+			continue;
+		if (last_post)
+			stats[bid].last_post = strtoll(value, NULL, 10);
+		else
+			stats[bid].posts = strtol(value, NULL, 10);
+	}
+	mdb_clear(res);
+	return true;
+}
+
+static bool board_stat_refresh(board_stat_cache_t *c)
+{
+	if (!board_shm_trylock(&c->lock))
+		return false;
+
+	board_stat_t *stats = calloc(BOARD_STAT_IDS, sizeof(*stats));
+	int *online = calloc(BOARD_STAT_IDS, sizeof(*online));
+	bool ok = stats && online
+			&& session_count_online_boards(online, BOARD_STAT_IDS) == 0
+			&& board_stat_load_hash(POST_BOARD_COUNT_KEY, stats, false)
+			&& board_stat_load_hash(LAST_POST_KEY, stats, true);
+	if (ok) {
+		__sync_add_and_fetch(&c->seq, 1);
+		for (int i = 0; i < BOARD_STAT_IDS; ++i) {
+			board_stat_t *st = c->stats + i;
+			st->online = online[i];
+			st->posts = stats[i].posts;
+			// 不覆盖读取redis之后才记录的发文时间
+			if (stats[i].last_post > st->last_post)
+				st->last_post = stats[i].last_post;
+		}
+		c->stamp = fb_time();
+		__sync_add_and_fetch(&c->seq, 1);
+	}
+	free(stats);
+	free(online);
+
+	__sync_lock_release(&c->lock);
+	return ok;
+}
+
+static board_stat_cache_t *board_stat_fresh(void)
+{
+	board_stat_cache_t *c = board_stat_cache_get();
+	if (!c)
+		return NULL;
+	if (*(volatile fb_time_t *) &c->stamp + BOARD_STAT_TTL > fb_time())
+		return c;
+	if (board_stat_refresh(c))
+		return c;
+	// 他人正在刷新时沿用旧快照
+	return *(volatile fb_time_t *) &c->stamp ? c : NULL;
+}
+
+/**
+ * 获取版面统计信息
+ * 优先读取共享内存快照, 快照不可用时直接查询.
+ * @param[in] bid 版面ID
+ * @param[out] stat 统计信息
+ */
+void board_stat_get(int bid, board_stat_t *stat)
+{
+	board_stat_cache_t *c = NULL;
+	if (bid > 0 && bid < BOARD_STAT_IDS)
+		c = board_stat_fresh();
+	if (c) {
+		const board_stat_t *st = c->stats + bid;
+		for (int i = 0; i < BOARD_CACHE_RETRY; ++i) {
+			uint32_t seq = *(volatile uint32_t *) &c->seq;
+			if (seq & 1) {
+				sched_yield();
+				continue;
+			}
+			__sync_synchronize();
+			memcpy(stat, st, sizeof(*stat));
+			__sync_synchronize();
+			if (*(volatile uint32_t *) &c->seq == seq)
+				return;
+		}
+	}
+
+	stat->online = session_count_online_board(bid);
+	stat->posts = post_get_board_count(bid);
+	stat->last_post = get_last_post_time(bid);
+}
+
+/** 发文后更新快照中的最新发文时间 */
+void board_stat_set_last_post(int bid, fb_time_t stamp)
+{
+	board_stat_cache_t *c = NULL;
+	if (bid > 0 && bid < BOARD_STAT_IDS)
+		c = board_stat_cache_get();
+	if (c)
+		*(volatile fb_time_t *) &c->stats[bid].last_post = stamp;
 }
 
 int get_board(const char *name, board_t *bp)
 {
 	bp->id = 0;
+	if (board_cache_lookup(0, name, bp))
+		return bp->id;
+
 	db_res_t *res = db_query(
 			BOARD_SELECT_QUERY_BASE "WHERE lower(b.name) = lower(%s)", name);
 	if (res && db_res_rows(res) > 0)
@@ -75,6 +388,9 @@ int get_board(const char *name, board_t *bp)
 int get_board_by_bid(int bid, board_t *bp)
 {
 	bp->id = 0;
+	if (board_cache_lookup(bid, NULL, bp))
+		return bp->id;
+
 	db_res_t *res = db_query(
 			BOARD_SELECT_QUERY_BASE "WHERE b.id = %d", bid);
 	if (res && db_res_rows(res) > 0)
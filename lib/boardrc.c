@@ -6,196 +6,360 @@
 #include "fbbs/fileio.h"
 #include "fbbs/helper.h"
 #include "fbbs/post.h"
+#include "fbbs/record.h"
 #include "fbbs/string.h"
 
 /** @defgroup readmark 已读标记 */
 /** @{ */
 
 enum {
-	BRC_BUFSIZE = 50000,  ///< 所有已读记录的缓存区长度
-	BRC_MAXNUM = 60,  ///< 单个版面的最大已读记录条数
-	BRC_STRLEN = 20,  ///< 已读记录索引名长度
-	/** 单个版面已读记录的最大长度 */
-	BRC_ITEMSIZE = BRC_STRLEN + 1 + BRC_MAXNUM * sizeof(brc_item_t),
+	BRC_MAXRANGES = 63,  ///< 单个版面的最大已读区间数
+	BRC_LIST_MAXNUM = 60,  ///< 旧格式中单个版面的最大已读记录条数
+	BRC_STRLEN = 20,  ///< 旧格式中已读记录索引名长度
+	BRC_LEGACY_BUFSIZE = 50000,  ///< 旧格式文件的最大长度
+	BRC_STORE_BOARDS = MAXBOARD * 4,  ///< 存储文件可容纳的版面ID上限
+	BRC_STORE_VERSION = 2,  ///< 每版面保存已读区间
+	BRC_COUNT_BUFSIZE = 64,  ///< 统计未读数时每次读取的文章数
 };
 
+#define BRC_STORE_FILE ".brc"
+#define BRC_STORE_MAGIC "FBBRC"
+#define BRC_LEGACY_FILE ".boardrc"
+
 typedef uint_t brc_size_t;
 
-/** 所有已读记录的缓存 */
+/** 已读区间[lo, hi] */
 typedef struct {
-	brc_size_t size; ///< 缓存已用长度
-	bool dirty;  ///< 是否修改过
-	bool initialized;  ///< 是否已经初始化
-	char ptr[BRC_BUFSIZE];  ///< 缓存区
-} brc_buf_t;
+	brc_item_t lo;
+	brc_item_t hi;
+} brc_range_t;
+
+/** 存储文件中一个版面的已读记录, 以版面ID为下标 */
+typedef struct {
+	brc_size_t size;  ///< 已读区间个数
+	uint32_t reserved;
+	brc_range_t ranges[BRC_MAXRANGES];  ///< 降序排列, 互不相交也不相邻
+} brc_record_t;
+
+/** 存储文件头, 占据0号记录的位置 */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t boards;
+} brc_header_t;
+
+/**
+ * 用户的已读记录存储
+ *
+ * 每个用户一个二进制文件, 按版面ID定长存放记录, 创建时扩展为稀疏文件.
+ * 文件以MAP_SHARED方式映射, 同一用户的多个进程共享, 修改某个版面只会
+ * 弄脏它所在的页面, 不再整体重写文件.
+ */
+static FB_THREAD_LOCAL struct {
+	char user_name[IDLEN + 1];
+	brc_record_t *map;
+} brc_store;
 
-/** 一个版面的已读记录 */
+/**
+ * 当前版面的已读记录
+ *
+ * 已读项目以区间集合表示, 因此不再受条数限制. 区间数超出上限时合并最早的
+ * 两个区间, 即把其间的少量项目视为已读.
+ */
 typedef struct {
-	brc_size_t size;  ///< 已读记录条数
+	int bid;  ///< 版面ID
+	brc_size_t size;  ///< 已读区间个数
 	bool dirty;  ///< 是否修改过
-	char name[BRC_STRLEN];  ///< 索引名(版面名)
-	brc_item_t items[BRC_MAXNUM];  ///< 存储已读记录的数组
+	char name[BOARD_NAME_LEN + 1];  ///< 版面名
+	brc_range_t ranges[BRC_MAXRANGES + 1];  ///< 已读区间, 降序排列
 } brc_t;
 
-/** 所有已读记录的缓存 */
-static brc_buf_t brc_buf;
-
 /** 当前的版面已读记录变量 */
-static brc_t brc;
+static FB_THREAD_LOCAL brc_t brc;
 
 /**
- * 读取已读记录缓存中的一段记录.
- * @param[in] ptr 指向已读记录缓存其中一段的指针
- * @param[out] brcp 版面已读记录指针
- * @return 指向下一段记录的指针
+ * 将区间[lo, hi]并入已读区间集合
+ * @param[in,out] b 版面已读记录
+ * @param[in] lo 区间下界
+ * @param[in] hi 区间上界
  */
-static char *brc_get_record(char *ptr, brc_t *brcp)
+static void brc_add_range(brc_t *b, brc_item_t lo, brc_item_t hi)
 {
-	strlcpy(brcp->name, ptr, sizeof(brcp->name));
-	ptr += BRC_STRLEN;
+	brc_range_t *r = b->ranges;
+	int n = b->size, i = 0;
+	while (i < n && r[i].lo > (uint64_t) hi + 1)
+		++i;
+	int j = i;
+	while (j < n && (uint64_t) r[j].hi + 1 >= lo) {
+		if (r[j].hi > hi)
+			hi = r[j].hi;
+		if (r[j].lo < lo)
+			lo = r[j].lo;
+		++j;
+	}
 
-	brc_size_t size = *ptr++;
-	if (size > BRC_MAXNUM)
-		size = BRC_MAXNUM;
-	brcp->size = size;
+	// r[i, j)与新区间重叠或相邻, 合并为一个
+	if (j == i) {
+		memmove(r + i + 1, r + i, (n - i) * sizeof(*r));
+		++n;
+	} else if (j > i + 1) {
+		memmove(r + i + 1, r + j, (n - j) * sizeof(*r));
+		n -= j - i - 1;
+	}
+	r[i].lo = lo;
+	r[i].hi = hi;
 
-	memcpy(brcp->items, ptr, size * sizeof(*brcp->items));
-	return ptr + size * sizeof(*brcp->items);
+	if (n > BRC_MAXRANGES) {
+		r[n - 2].lo = r[n - 1].lo;
+		--n;
+	}
+	b->size = n;
+	b->dirty = true;
 }
 
 /**
- * 将一段记录写入已读记录缓存
- * @param[out] ptr 指向已读记录缓存的指针
- * @param[in] brcp 版面已读记录指针
- * @return 写入后的末端指针
+ * 查找可能包含指定项目的已读区间
+ * @return 第一个下界不大于item的区间下标, 没有则为区间个数
  */
-static char *brc_put_record(char *ptr, const brc_t *brcp)
+static int brc_find(const brc_t *b, brc_item_t item)
 {
-	if (brcp->size) {
-		brc_size_t size = brcp->size;
-		if (size > BRC_MAXNUM)
-			size = BRC_MAXNUM;
-
-		strlcpy(ptr, brcp->name, BRC_STRLEN);
-		ptr += BRC_STRLEN;
-		*ptr++ = size;
-		memcpy(ptr, brcp->items, size * sizeof(*brcp->items));
-		ptr += size * sizeof(*brcp->items);
+	int lo = 0, hi = b->size;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (b->ranges[mid].lo <= item)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
-	return ptr;
+	return lo;
 }
 
-static void brc_load(const char *uname, brc_buf_t *buf)
+static bool brc_contains(const brc_t *b, brc_item_t item)
 {
-	char file[HOMELEN];
-	sethomefile(file, uname, ".boardrc");
-	int fd = open(file, O_RDONLY);
-	if (fd != -1) {
-		buf->size = file_read(fd, buf->ptr, sizeof(buf->ptr));
-		close(fd);
-	} else {
-		buf->size = 0;
-	}
-	buf->initialized = true;
-	buf->dirty = false;
+	int i = brc_find(b, item);
+	return i < b->size && item <= b->ranges[i].hi;
 }
 
-static void brc_save(const char *uname, const brc_buf_t *buf)
+/**
+ * 将降序排列的已读列表转换为已读区间
+ * 按照旧的语义, 早于列表中最后一项的项目均视为已读.
+ */
+static void brc_list_to_record(const brc_item_t *items, brc_size_t count,
+		brc_record_t *r)
+{
+	brc_t b = { .size = 0 };
+	if (count > BRC_LIST_MAXNUM)
+		count = BRC_LIST_MAXNUM;
+	for (int i = 0; i < count; ++i)
+		brc_add_range(&b, items[i], items[i]);
+	if (count)
+		brc_add_range(&b, 0, items[count - 1]);
+
+	memcpy(r->ranges, b.ranges, b.size * sizeof(*b.ranges));
+	r->size = b.size;
+}
+
+/**
+ * 导入旧格式的已读记录
+ * 旧格式依次存放各版面的记录: 版面名(BRC_STRLEN字节), 条数(1字节), 各条记录.
+ * @param[in] user_name 用户名
+ * @param[out] map 存储文件映射
+ * @return 导入的版面数
+ */
+static int brc_import_legacy(const char *user_name, brc_record_t *map)
 {
 	char file[HOMELEN];
-	sethomefile(file, uname, ".boardrc");
-	int fd = open(file, O_WRONLY | O_CREAT, 0644);
-	if (fd != -1) {
-		ftruncate(fd, 0);
-		file_write(fd, buf->ptr, buf->size);
-		close(fd);
+	sethomefile(file, user_name, BRC_LEGACY_FILE);
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	char *buf = malloc(BRC_LEGACY_BUFSIZE);
+	int size = buf ? file_read(fd, buf, BRC_LEGACY_BUFSIZE) : 0;
+	close(fd);
+
+	int imported = 0;
+	const char *ptr = buf, *end = buf + (size > 0 ? size : 0);
+	while (ptr + BRC_STRLEN + 1 <= end && *ptr >= ' ' && *ptr <= '~') {
+		char name[BRC_STRLEN];
+		strlcpy(name, ptr, sizeof(name));
+		ptr += BRC_STRLEN;
+
+		brc_size_t count = (unsigned char) *ptr++;
+		if (count > BRC_LIST_MAXNUM)
+			count = BRC_LIST_MAXNUM;
+		if (ptr + count * sizeof(brc_item_t) > end)
+			break;
+
+		board_t board;
+		if (get_board(name, &board) && board.id > 0
+				&& board.id < BRC_STORE_BOARDS) {
+			brc_item_t items[BRC_LIST_MAXNUM];
+			memcpy(items, ptr, count * sizeof(*items));
+			brc_list_to_record(items, count, map + board.id);
+			++imported;
+		}
+		ptr += count * sizeof(brc_item_t);
 	}
+	free(buf);
+	return imported;
 }
 
-static bool brc_valid_board_name(const char *s)
+/** 关闭已读记录存储, 当前版面的已读记录随之失效 */
+static void brc_store_close(void)
 {
-	return s && *s >= ' ' && *s <= '~';
+	if (brc_store.map)
+		munmap(brc_store.map, BRC_STORE_BOARDS * sizeof(*brc_store.map));
+	memset(&brc_store, 0, sizeof(brc_store));
+	memset(&brc, 0, sizeof(brc));
 }
 
 /**
- * 将当前版面的已读记录与指定的所有已读记录合并
- * @param buf 所有版面的已读记录
+ * 映射用户的已读记录存储
+ * 文件不存在时创建并导入旧格式记录.
+ * @param[in] user_name 用户名
+ * @param[out] imported 如非NULL, 返回导入的版面数
+ * @return 存储文件映射, 失败时返回NULL
  */
-static void brc_merge(brc_buf_t *buf)
+static brc_record_t *brc_store_open(const char *user_name, int *imported)
 {
-	char *ptr = brc_buf.ptr;
-	if (brc.size) {
-		ptr = brc_put_record(ptr, &brc);
+	if (imported)
+		*imported = 0;
+	if (brc_store.map && streq(brc_store.user_name, user_name))
+		return brc_store.map;
+	brc_store_close();
+
+	char file[HOMELEN];
+	sethomefile(file, user_name, BRC_STORE_FILE);
+	int fd = open(file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return NULL;
+	// 防止多个进程同时创建或转换
+	flock(fd, LOCK_EX);
+
+	brc_header_t header;
+	bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+			&& strneq(header.magic, BRC_STORE_MAGIC, sizeof(header.magic));
+	if (valid && header.version != BRC_STORE_VERSION) {
+		close(fd);
+		return NULL;
 	}
 
-	if (buf->size > sizeof(buf->ptr) - BRC_ITEMSIZE)
-		buf->size = sizeof(buf->ptr) - BRC_ITEMSIZE * 2 + 1;
+	size_t size = BRC_STORE_BOARDS * sizeof(brc_record_t);
+	struct stat st;
+	void *ptr = MAP_FAILED;
+	if (fstat(fd, &st) == 0
+			&& (st.st_size >= size || ftruncate(fd, size) == 0)) {
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
 
-	char *tmp = buf->ptr, *end = buf->ptr + buf->size;
-	while (tmp < end && brc_valid_board_name(tmp)) {
-		brc_t tmp_brc;
-		tmp = brc_get_record(tmp, &tmp_brc);
-		if (!strneq(tmp_brc.name, brc.name, sizeof(tmp_brc.name))) {
-			ptr = brc_put_record(ptr, &tmp_brc);
-		}
+	if (ptr != MAP_FAILED && !valid) {
+		int count = brc_import_legacy(user_name, ptr);
+		if (imported)
+			*imported = count;
+
+		brc_header_t *h = ptr;
+		h->version = BRC_STORE_VERSION;
+		h->boards = BRC_STORE_BOARDS;
+		strlcpy(h->magic, BRC_STORE_MAGIC, sizeof(h->magic));
+	}
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	strlcpy(brc_store.user_name, user_name, sizeof(brc_store.user_name));
+	brc_store.map = ptr;
+	return ptr;
+}
+
+/** 将当前版面的已读记录写回存储 */
+static void brc_writeback(void)
+{
+	if (!brc.dirty)
+		return;
+	if (brc_store.map && brc.bid > 0 && brc.bid < BRC_STORE_BOARDS) {
+		brc_record_t *r = brc_store.map + brc.bid;
+		memcpy(r->ranges, brc.ranges, brc.size * sizeof(*brc.ranges));
+		r->size = brc.size;
 	}
-	brc_buf.size = (brc_size_t) (ptr - brc_buf.ptr);
 	brc.dirty = false;
-	brc_buf.dirty = true;
 }
 
 /**
- * 将已读记录缓存同步到磁盘
+ * 将已读记录同步到磁盘
  * @param user_name 用户名
  */
 void brc_sync(const char *user_name)
 {
-	if (!brc.dirty && !brc_buf.dirty)
-		return;
-	if (brc.dirty) {
-		brc_buf_t buf;
-		memcpy(&buf, &brc_buf, sizeof(buf));
-		brc_merge(&buf);
+	brc_writeback();
+}
+
+/**
+ * 读入指定用户在指定版面的已读记录.
+ * @param[in] user_name 用户名
+ * @param[in] bid 版面ID
+ * @param[in] board_name 版面名
+ * @return 如果该版之前没有记录, 返回0; 否则返回当前该版已有的区间个数.
+ */
+static int brc_open(const char *user_name, int bid, const char *board_name)
+{
+	if (bid == brc.bid && brc_store.map
+			&& streq(brc_store.user_name, user_name))
+		return brc.size;
+
+	brc_writeback();
+
+	const brc_record_t *r = NULL;
+	if (bid > 0 && bid < BRC_STORE_BOARDS) {
+		brc_record_t *map = brc_store_open(user_name, NULL);
+		if (map)
+			r = map + bid;
 	}
-	brc_save(user_name, &brc_buf);
+
+	brc.bid = bid;
+	strlcpy(brc.name, board_name, sizeof(brc.name));
+	brc.size = r ? r->size : 0;
+	if (brc.size > BRC_MAXRANGES)
+		brc.size = BRC_MAXRANGES;
+	if (brc.size)
+		memcpy(brc.ranges, r->ranges, brc.size * sizeof(*brc.ranges));
+	return brc.size;
 }
 
 /**
  * 读入指定用户在指定版面的已读记录.
  * @param[in] user_name 用户名
  * @param[in] board_name 版面名
- * @return 如果该版之前没有记录, 返回0; 否则返回当前该版已有的记录条数.
+ * @return 如果该版之前没有记录, 返回0; 否则返回当前该版已有的区间个数.
  */
 int brc_init(const char *user_name, const char *board_name)
 {
-	if (!user_name || !brc_valid_board_name(board_name))
+	if (!user_name || !board_name)
 		return 0;
 
-	if (strneq(brc.name, board_name, sizeof(brc.name)))
+	if (brc.bid && strneq(brc.name, board_name, sizeof(brc.name))
+			&& brc_store.map && streq(brc_store.user_name, user_name))
 		return brc.size;
 
-	if (brc.dirty) {
-		brc_buf_t buf;
-		memcpy(&buf, &brc_buf, sizeof(buf));
-		brc_merge(&buf);
-	}
-
-	if (!brc_buf.initialized)
-		brc_load(user_name, &brc_buf);
-
-	char *ptr = brc_buf.ptr, *end = brc_buf.ptr + brc_buf.size;
-	while (ptr < end && brc_valid_board_name(ptr)) {
-		ptr = brc_get_record(ptr, &brc);
-		if (strneq(brc.name, board_name, sizeof(brc.name))) {
-			return brc.size;
-		}
-	}
+	board_t board;
+	if (!get_board(board_name, &board))
+		return 0;
+	return brc_open(user_name, board.id, board.name);
+}
 
-	strlcpy(brc.name, board_name, sizeof(brc.name));
-	brc.items[0] = 1;
-	brc.size = 1;
-	brc.dirty = true;
-	return 0;
+/**
+ * 将用户的旧格式已读记录转换为新格式
+ * @param user_name 用户名
+ * @return 导入的版面数, 已经转换过时返回0, 出错返回-1
+ */
+int brc_convert(const char *user_name)
+{
+	brc_store_close();
+	int imported;
+	if (!brc_store_open(user_name, &imported))
+		return -1;
+	brc_store_close();
+	return imported;
 }
 
 /**
@@ -203,8 +367,7 @@ int brc_init(const char *user_name, const char *board_name)
  */
 void brc_reset(void)
 {
-	memset(&brc_buf, 0, sizeof(brc_buf));
-	memset(&brc, 0, sizeof(brc));
+	brc_store_close();
 }
 
 /**
@@ -214,30 +377,10 @@ void brc_reset(void)
  */
 bool brc_mark_as_read(brc_item_t item)
 {
-	if (!brc.size) {
-		brc.items[brc.size++] = item;
-		brc.dirty = true;
-		return true;
-	}
-
-	for (int i = 0; i < brc.size; ++i) {
-		if (item == brc.items[i]) {
-			return false;
-		} else if (item > brc.items[i]) {
-			if (brc.size < BRC_MAXNUM)
-				brc.size++;
-			memmove(brc.items + i + 1, brc.items + i,
-					(brc.size - i - 1) * sizeof(*brc.items));
-			brc.items[i] = item;
-			brc.dirty = true;
-			return true;
-		}
-	}
-	if (brc.size < BRC_MAXNUM) {
-		brc.items[brc.size++] = item;
-		brc.dirty = true;
-	}
-	return false;
+	if (brc_contains(&brc, item))
+		return false;
+	brc_add_range(&brc, item, item);
+	return true;
 }
 
 /**
@@ -247,16 +390,7 @@ bool brc_mark_as_read(brc_item_t item)
  */
 bool brc_unread(brc_item_t item)
 {
-	if (!brc.size)
-		return true;
-
-	for (int i = 0; i < brc.size; ++i) {
-		if (item > brc.items[i])
-			return true;
-		else if (item == brc.items[i])
-			return false;
-	}
-	return false;
+	return !brc_contains(&brc, item);
 }
 
 /**
@@ -266,7 +400,7 @@ bool brc_unread(brc_item_t item)
 brc_item_t brc_last_read(void)
 {
 	if (brc.size)
-		return brc.items[0];
+		return brc.ranges[0].hi;
 	return 0;
 }
 
@@ -276,8 +410,7 @@ brc_item_t brc_last_read(void)
  */
 void brc_clear(brc_item_t item)
 {
-	for (int i = item - BRC_MAXNUM + 1; i <= item; ++i)
-		brc_mark_as_read(i);
+	brc_add_range(&brc, 0, item);
 }
 
 /**
@@ -291,7 +424,118 @@ void brc_clear_all(void)
 void brc_zapbuf(int *zbuf)
 {
 	if (*zbuf > 0 && brc.size)
-		*zbuf = brc.items[0];
+		*zbuf = brc.ranges[0].hi;
+}
+
+/**
+ * 批量判断版面是否有未读项目
+ * 用户的已读记录只映射一次, 各版面的最新发文时间由一条HMGET取得,
+ * 不改变当前版面.
+ * @param[in] user_name 用户名
+ * @param[in] bids 版面ID数组
+ * @param[in] count 版面数
+ * @param[out] unread 各版面是否有未读项目
+ * @return 成功返回0, 出错返回-1, 此时各版面均视为未读
+ */
+int brc_boards_unread(const char *user_name, const int *bids, int count,
+		bool *unread)
+{
+	for (int i = 0; i < count; ++i)
+		unread[i] = true;
+	if (!user_name || count <= 0)
+		return count < 0 ? -1 : 0;
+
+	fb_time_t *stamps = malloc(sizeof(*stamps) * count);
+	if (!stamps)
+		return -1;
+	brc_writeback();
+	const brc_record_t *map = brc_store_open(user_name, NULL);
+	if (!map || get_last_post_times(bids, count, stamps) < 0) {
+		free(stamps);
+		return -1;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		int bid = bids[i];
+		if (bid <= 0 || bid >= BRC_STORE_BOARDS)
+			continue;
+		const brc_record_t *r = map + bid;
+		brc_t b = { .size = r->size };
+		if (b.size > BRC_MAXRANGES)
+			b.size = BRC_MAXRANGES;
+		if (b.size) {
+			memcpy(b.ranges, r->ranges, b.size * sizeof(*b.ranges));
+			unread[i] = stamps[i] && !brc_contains(&b, stamps[i]);
+		}
+	}
+	free(stamps);
+	return 0;
+}
+
+/**
+ * 在版面文章记录中查找第一篇晚于指定时间的文章
+ * @return 文章在记录中的偏移量
+ */
+static int brc_search_after(record_t *record, int count, brc_item_t stamp)
+{
+	int lo = 0, hi = count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		post_record_t pr;
+		if (record_read_after(record, &pr, 1, mid) != 1)
+			return 0;
+		if (post_stamp(pr.id) <= stamp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * 统计版面上的未读文章数
+ *
+ * 将已读区间与按ID升序排列的版面文章记录求交. 最早的已读区间覆盖的文章
+ * 以二分查找跳过. 只读取记录, 不修改已读区间.
+ * @param user_name 用户名
+ * @param board_name 版面名
+ * @param board_id 版面编号
+ * @return 未读文章数
+ */
+int brc_unread_count(const char *user_name, const char *board_name,
+		int board_id)
+{
+	record_t record;
+	if (!user_name || post_record_open_cached(board_id, &record) < 0)
+		return 0;
+
+	int count = record_count(&record);
+	if (!brc_open(user_name, board_id, board_name)) {
+		record_close(&record);
+		return count;
+	}
+
+	int begin = 0, k = brc.size - 1;
+	if (brc.ranges[k].lo == 0)
+		begin = brc_search_after(&record, count, brc.ranges[k].hi);
+
+	int unread = 0;
+	post_record_t buf[BRC_COUNT_BUFSIZE];
+	for (int offset = begin; offset < count; ) {
+		int n = record_read_after(&record, buf, BRC_COUNT_BUFSIZE, offset);
+		if (n <= 0)
+			break;
+		for (int i = 0; i < n; ++i) {
+			brc_item_t stamp = post_stamp(buf[i].id);
+			while (k >= 0 && brc.ranges[k].hi < stamp)
+				--k;
+			if (k < 0 || brc.ranges[k].lo > stamp)
+				++unread;
+		}
+		offset += n;
+	}
+	record_close(&record);
+	return unread;
 }
 
 /**
@@ -304,8 +548,11 @@ void brc_zapbuf(int *zbuf)
 bool brc_board_unread(const char *user_name, const char *board_name,
 		int board_id)
 {
-	return !brc_init(user_name, board_name)
-			|| brc_unread(get_last_post_time(board_id));
+	if (!user_name || !brc_open(user_name, board_id, board_name))
+		return true;
+	board_stat_t stat;
+	board_stat_get(board_id, &stat);
+	return stat.last_post && brc_unread(stat.last_post);
 }
 
 /** @} */
@@ -4,6 +4,7 @@
 #include "mmap.h"
 #include "fbbs/convert.h"
 #include "fbbs/string.h"
+#include "fbbs/util.h"
 
 #ifdef LINUX
 # define fb_iconv(cd, i, ib, o, ob)  iconv(cd, (char **)i, ib, o, ob)
@@ -11,8 +12,8 @@
 # define fb_iconv(cd, i, ib, o, ob) iconv(cd, i, ib, o, ob)
 #endif
 
-static iconv_t _u2g = (iconv_t) -1;
-static iconv_t _g2u = (iconv_t) -1;
+static FB_THREAD_LOCAL iconv_t _u2g = (iconv_t) -1;
+static FB_THREAD_LOCAL iconv_t _g2u = (iconv_t) -1;
 
 /**
  * 打开编码转换描述符
@@ -1,9 +1,278 @@
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include "bbs.h"
 #include "fbbs/friend.h"
 #include "fbbs/dbi.h"
+#include "fbbs/log.h"
 #include "fbbs/session.h"
 #include "fbbs/string.h"
 #include "fbbs/user.h"
 
+enum {
+	FOLLOW_GRAPH_SHMKEY = 30090,
+	FOLLOW_GRAPH_NODES = MAXUSERS * 2,
+	FOLLOW_GRAPH_EDGES = MAXUSERS * 16,
+	FOLLOW_GRAPH_RETRY = 64,
+};
+
+/**
+ * 共享内存中的关注关系图
+ *
+ * 以CSR格式保存: 用户u关注的人为fwd[fwd_index[u], fwd_index[u+1]),
+ * 关注u的人为rev[rev_index[u], rev_index[u+1]), 各邻接表均有序.
+ * 关注和取消关注时原地插入或删除一条边. 写者持锁并在修改期间把seq置为奇数,
+ * 读者在seq不变时拷贝邻接表, 无需加锁. 锁以进程号标记, 持有者中途退出时
+ * 由下一个写者接管并重新载入.
+ * 容量不足时图被标记为不可用, 调用者回退到数据库.
+ */
+typedef struct {
+	pid_t lock;
+	unsigned int seq;
+	int loaded;
+	int edges;
+	int32_t fwd_index[FOLLOW_GRAPH_NODES + 1];
+	int32_t rev_index[FOLLOW_GRAPH_NODES + 1];
+	user_id_t fwd[FOLLOW_GRAPH_EDGES];
+	user_id_t rev[FOLLOW_GRAPH_EDGES];
+} follow_graph_t;
+
+/**
+ * 获取写锁并把seq置为奇数
+ * @return 前一持有者中途退出, 图可能不完整时返回false
+ */
+static bool follow_graph_lock(follow_graph_t *g)
+{
+	pid_t pid = getpid();
+	while (true) {
+		pid_t holder = __sync_val_compare_and_swap(&g->lock, 0, pid);
+		if (!holder)
+			break;
+		if (holder != pid && kill(holder, 0) < 0 && errno == ESRCH
+				&& __sync_bool_compare_and_swap(&g->lock, holder, pid)) {
+			log_internal_err("follow graph: lock holder %d died", holder);
+			if (g->seq & 1)
+				__sync_add_and_fetch(&g->seq, 1);
+			__sync_add_and_fetch(&g->seq, 1);
+			return false;
+		}
+		sched_yield();
+	}
+	__sync_add_and_fetch(&g->seq, 1);
+	return true;
+}
+
+static void follow_graph_unlock(follow_graph_t *g)
+{
+	__sync_add_and_fetch(&g->seq, 1);
+	__sync_lock_release(&g->lock);
+}
+
+/** 从数据库重建关注关系图, 须持有写锁 */
+static void follow_graph_fill(follow_graph_t *g)
+{
+	g->loaded = false;
+	g->edges = 0;
+	memset(g->fwd_index, 0, sizeof(g->fwd_index));
+	memset(g->rev_index, 0, sizeof(g->rev_index));
+
+	db_res_t *res = db_query("SELECT follower, user_id FROM follows"
+			" ORDER BY follower, user_id");
+	if (!res)
+		return;
+
+	int rows = db_res_rows(res);
+	bool ok = rows <= FOLLOW_GRAPH_EDGES;
+	for (int i = 0; ok && i < rows; ++i) {
+		user_id_t follower = db_get_user_id(res, i, 0);
+		user_id_t followed = db_get_user_id(res, i, 1);
+		if (follower <= 0 || follower >= FOLLOW_GRAPH_NODES
+				|| followed <= 0 || followed >= FOLLOW_GRAPH_NODES) {
+			ok = false;
+			break;
+		}
+		g->fwd[i] = followed;
+		++g->fwd_index[follower + 1];
+		++g->rev_index[followed + 1];
+	}
+
+	if (ok) {
+		for (int i = 0; i < FOLLOW_GRAPH_NODES; ++i) {
+			g->fwd_index[i + 1] += g->fwd_index[i];
+			g->rev_index[i + 1] += g->rev_index[i];
+		}
+		// 按关注者顺序分发, 反向邻接表自然有序
+		int32_t *pos = malloc(sizeof(*pos) * FOLLOW_GRAPH_NODES);
+		if (pos) {
+			memcpy(pos, g->rev_index, sizeof(*pos) * FOLLOW_GRAPH_NODES);
+			for (int i = 0; i < rows; ++i)
+				g->rev[pos[g->fwd[i]]++] = db_get_user_id(res, i, 0);
+			free(pos);
+			g->edges = rows;
+			g->loaded = true;
+		}
+	} else {
+		log_internal_err("follow graph too large, %d edges", rows);
+	}
+	db_clear(res);
+}
+
+static void follow_graph_load(follow_graph_t *g)
+{
+	follow_graph_lock(g);
+	follow_graph_fill(g);
+	follow_graph_unlock(g);
+}
+
+static follow_graph_t *follow_graph_get(void)
+{
+	static shm_once_t once;
+	int created;
+	follow_graph_t *g = attach_shm_once(&once, "FOLLOW_SHMKEY",
+			FOLLOW_GRAPH_SHMKEY, sizeof(*g), &created);
+	if (g && created)
+		follow_graph_load(g);
+	return g;
+}
+
+static int32_t adjacency_search(const user_id_t *edges, int32_t begin,
+		int32_t end, user_id_t uid)
+{
+	while (begin < end) {
+		int32_t mid = begin + (end - begin) / 2;
+		if (edges[mid] < uid)
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	return begin;
+}
+
+static bool adjacency_insert(follow_graph_t *g, int32_t *index,
+		user_id_t *edges, user_id_t from, user_id_t to)
+{
+	int32_t pos = adjacency_search(edges, index[from], index[from + 1], to);
+	if (pos < index[from + 1] && edges[pos] == to)
+		return false;
+	memmove(edges + pos + 1, edges + pos,
+			sizeof(*edges) * (g->edges - pos));
+	edges[pos] = to;
+	for (int i = from + 1; i <= FOLLOW_GRAPH_NODES; ++i)
+		++index[i];
+	return true;
+}
+
+static bool adjacency_remove(follow_graph_t *g, int32_t *index,
+		user_id_t *edges, user_id_t from, user_id_t to)
+{
+	int32_t pos = adjacency_search(edges, index[from], index[from + 1], to);
+	if (pos >= index[from + 1] || edges[pos] != to)
+		return false;
+	memmove(edges + pos, edges + pos + 1,
+			sizeof(*edges) * (g->edges - pos - 1));
+	for (int i = from + 1; i <= FOLLOW_GRAPH_NODES; ++i)
+		--index[i];
+	return true;
+}
+
+static void follow_graph_update(user_id_t follower, user_id_t followed,
+		bool add)
+{
+	follow_graph_t *g = follow_graph_get();
+	if (!g || !g->loaded)
+		return;
+
+	if (!follow_graph_lock(g)) {
+		// 数据库已更新, 重新载入即包含本次修改
+		follow_graph_fill(g);
+	} else if (!g->loaded) {
+		// 等待锁期间图已被停用
+	} else if (follower <= 0 || follower >= FOLLOW_GRAPH_NODES
+			|| followed <= 0 || followed >= FOLLOW_GRAPH_NODES
+			|| (add && g->edges >= FOLLOW_GRAPH_EDGES)) {
+		g->loaded = false;
+		log_internal_err("follow graph full, disabled");
+	} else if (add) {
+		if (adjacency_insert(g, g->fwd_index, g->fwd, follower, followed)) {
+			adjacency_insert(g, g->rev_index, g->rev, followed, follower);
+			++g->edges;
+		}
+	} else {
+		if (adjacency_remove(g, g->fwd_index, g->fwd, follower, followed)) {
+			adjacency_remove(g, g->rev_index, g->rev, followed, follower);
+			--g->edges;
+		}
+	}
+	follow_graph_unlock(g);
+}
+
+static int follow_graph_read(bool reverse, user_id_t uid, user_id_t **list)
+{
+	*list = NULL;
+	follow_graph_t *g = follow_graph_get();
+	if (!g)
+		return -1;
+
+	const int32_t *index = reverse ? g->rev_index : g->fwd_index;
+	const user_id_t *edges = reverse ? g->rev : g->fwd;
+	for (int i = 0; i < FOLLOW_GRAPH_RETRY; ++i) {
+		unsigned int seq = *(volatile unsigned int *) &g->seq;
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		if (!g->loaded)
+			return -1;
+
+		int count = 0;
+		if (uid > 0 && uid < FOLLOW_GRAPH_NODES) {
+			int32_t begin = index[uid], end = index[uid + 1];
+			if (begin >= 0 && end <= FOLLOW_GRAPH_EDGES && begin <= end)
+				count = end - begin;
+			if (count) {
+				user_id_t *l = realloc(*list, sizeof(*l) * count);
+				if (!l) {
+					free(*list);
+					*list = NULL;
+					return -1;
+				}
+				*list = l;
+				memcpy(l, edges + begin, sizeof(*l) * count);
+			}
+		}
+
+		__sync_synchronize();
+		if (*(volatile unsigned int *) &g->seq == seq)
+			return count;
+	}
+	free(*list);
+	*list = NULL;
+	return -1;
+}
+
+/**
+ * 获取某用户关注的人
+ * @param[in] uid 用户ID
+ * @param[out] list 有序的用户ID数组, 由调用者free()
+ * @return 人数, 关注关系图不可用时返回-1
+ */
+int follow_graph_following(user_id_t uid, user_id_t **list)
+{
+	return follow_graph_read(false, uid, list);
+}
+
+/**
+ * 获取关注某用户的人
+ * @param[in] uid 用户ID
+ * @param[out] list 有序的用户ID数组, 由调用者free()
+ * @return 人数, 关注关系图不可用时返回-1
+ */
+int follow_graph_followers(user_id_t uid, user_id_t **list)
+{
+	return follow_graph_read(true, uid, list);
+}
+
 /**
  * Follow a person.
  * @param follower The follower id.
@@ -29,6 +298,8 @@ int follow(user_id_t follower, const char *followed, const char *notes)
 	if (res) {
 		int ret = db_cmd_rows(res);
 		db_clear(res);
+		if (ret > 0)
+			follow_graph_update(follower, uid, true);
 		return ret;
 	}
 	return 0;
@@ -42,6 +313,8 @@ int unfollow(user_id_t follower, user_id_t followed)
 	if (res) {
 		int ret = db_cmd_rows(res);
 		db_clear(res);
+		if (ret > 0)
+			follow_graph_update(follower, followed, false);
 		return ret;
 	}
 	return 0;
@@ -91,6 +364,11 @@ bool black_list_add(user_id_t uid, const char *blocked, const char *notes)
 	db_res_t *res = db_cmd("INSERT INTO blacklists"
 			" (user_id, blocked, notes, stamp)"
 			" VALUES (%d, %d, %s, current_timestamp)", uid, block_id, notes);
+	if (res) {
+		// blacklist_after_trigger删除双方之间的关注关系
+		follow_graph_update(uid, block_id, false);
+		follow_graph_update(block_id, uid, false);
+	}
 	db_clear(res);
 	return res;
 }
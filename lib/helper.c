@@ -213,7 +213,7 @@ int del_from_file(const char *file, const char *str)
  */
 const char *mask_host(const char *host)
 {
-	static char masked[IP_LEN];
+	static FB_THREAD_LOCAL char masked[IP_LEN];
 	char *end = masked + sizeof(masked);	
 	strlcpy(masked, host, sizeof(masked));
 	char *last = strrchr(masked, '.'); // IPv4 address.
@@ -271,6 +271,23 @@ void initialize_db(void)
 			config_get("password"))) {
 		exit(EXIT_FAILURE);
 	}
+
+	// replica_hosts = host:port host:port ...
+	const char *replicas = config_get("replica_hosts");
+	if (replicas) {
+		char buf[256];
+		strlcpy(buf, replicas, sizeof(buf));
+		for (char *s = strtok(buf, ", "); s; s = strtok(NULL, ", ")) {
+			char *port = strchr(s, ':');
+			if (port)
+				*port++ = '\0';
+			db_add_replica(s, port ? port : config_get("port"),
+					config_get("dbname"), config_get("user"),
+					config_get("password"));
+		}
+		db_set_replica_max_lag(config_get_integer("replica_max_lag",
+					DB_REPLICA_DEFAULT_MAX_LAG));
+	}
 }
 
 void initialize_mdb(void)
@@ -1,8 +1,12 @@
+#include <poll.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <hiredis/hiredis.h>
+#include "fbbs/log.h"
 #include "fbbs/mdbi.h"
 #include "fbbs/string.h"
+#include "fbbs/time.h"
 
 enum {
 	MDB_RES_STATUS = REDIS_REPLY_STATUS,
@@ -17,21 +21,77 @@ enum {
 	MDB_CMD_BUF_LEN = 128,
 };
 
+typedef struct {
+	bool active;
+	int queued; ///< commands sent without reading replies
+	int count; ///< replies collected
+	int capacity;
+	redisReply **replies;
+} mdb_pipeline_t;
+
+enum {
+	MDB_CACHE_KEYS = 16,
+	MDB_CACHE_BUCKETS = 512,
+	MDB_CACHE_MAX_ENTRIES = 65536, ///< per key
+};
+
+typedef struct mdb_cache_entry_t {
+	struct mdb_cache_entry_t *next;
+	char *field;
+	char *str;
+	size_t len;
+	long long integer;
+	fb_time_t expire;
+	int type;
+} mdb_cache_entry_t;
+
+/** Client-side cache of one Redis key (a hash or a plain value). */
+typedef struct {
+	char *key;
+	int ttl;
+	int entries;
+	bool tracked; ///< invalidated by the server
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long invalidations;
+	mdb_cache_entry_t *buckets[MDB_CACHE_BUCKETS];
+} mdb_cache_key_t;
+
+typedef struct {
+	int count;
+	mdb_cache_key_t *keys[MDB_CACHE_KEYS];
+	/** Connection receiving invalidation messages. */
+	redisContext *inv;
+	long long inv_id;
+} mdb_cache_t;
+
 typedef struct {
 	redisContext *c;
 	char buf[MDB_CMD_BUF_LEN];
+	mdb_pipeline_t pipeline;
+	mdb_cache_t cache;
+	char host[64];
+	int port;
+	char path[108];
 } mdb_conn_t;
 
-static mdb_conn_t _mdb;
+static FB_THREAD_LOCAL mdb_conn_t _mdb;
+
+/** Returned for commands queued in a pipeline. */
+static redisReply _mdb_queued;
+#define MDB_QUEUED  (&_mdb_queued)
 
 int mdb_connect(const char *host, int port)
 {
+	strlcpy(_mdb.host, host, sizeof(_mdb.host));
+	_mdb.port = port;
 	_mdb.c = redisConnect(host, port);
 	return (!_mdb.c || _mdb.c->err) ? -1 : 0;
 }
 
 int mdb_connect_unix(const char *path)
 {
+	strlcpy(_mdb.path, path, sizeof(_mdb.path));
 	_mdb.c = redisConnectUnix(path);
 	if (!_mdb.c || _mdb.c->err)
 		return -1;
@@ -40,6 +100,8 @@ int mdb_connect_unix(const char *path)
 
 void mdb_disconnect(void)
 {
+	if (_mdb.cache.inv)
+		redisFree(_mdb.cache.inv);
 	redisFree(_mdb.c);
 }
 
@@ -67,20 +129,459 @@ static char *smart_vsnprintf(char *buf, size_t size,
 
 void mdb_clear(mdb_res_t *res)
 {
-	if (res)
+	if (res && res != MDB_QUEUED)
 		freeReplyObject(res);
 }
 
-static mdb_res_t *mdb_vcmd(bool safe, const char *cmd, const char *fmt,
+static int mdb_append(bool safe, const char *fmt, va_list ap)
+{
+	int ret;
+	if (safe) {
+		ret = redisvAppendCommand(_mdb.c, fmt, ap);
+	} else {
+		char *buf = _mdb.buf;
+		char *s = smart_vsnprintf(buf, sizeof(_mdb.buf), fmt, ap);
+		ret = redisAppendCommand(_mdb.c, s);
+		if (s != buf)
+			free(s);
+	}
+	if (ret != REDIS_OK)
+		return -1;
+	++_mdb.pipeline.queued;
+	return 0;
+}
+
+static void mdb_pipeline_push(redisReply *r)
+{
+	mdb_pipeline_t *p = &_mdb.pipeline;
+	if (p->count >= p->capacity) {
+		int capacity = p->capacity ? p->capacity * 2 : 8;
+		redisReply **replies = realloc(p->replies,
+				capacity * sizeof(*replies));
+		if (!replies) {
+			mdb_clear(r);
+			return;
+		}
+		p->replies = replies;
+		p->capacity = capacity;
+	}
+	p->replies[p->count++] = r;
+}
+
+/**
+ * Flush queued commands and read their replies.
+ * @param keep_last Whether to keep the last reply in the pipeline.
+ * @return The last reply if not kept, NULL otherwise.
+ */
+static redisReply *mdb_pipeline_drain(bool keep_last)
+{
+	redisReply *last = NULL;
+	while (_mdb.pipeline.queued > 0) {
+		void *r = NULL;
+		if (redisGetReply(_mdb.c, &r) != REDIS_OK)
+			r = NULL;
+		if (--_mdb.pipeline.queued || keep_last)
+			mdb_pipeline_push(r);
+		else
+			last = r;
+	}
+	return last;
+}
+
+/**
+ * Start buffering commands.
+ * Until ::mdb_pipeline_exec, commands issued via ::mdb_cmd are only
+ * queued and report success. Commands whose reply is needed at once
+ * (::mdb_res, ::mdb_integer...) flush the queue together with themselves,
+ * so queued writes ride along with the next read.
+ */
+void mdb_pipeline_begin(void)
+{
+	_mdb.pipeline.active = true;
+}
+
+/**
+ * Flush the pipeline and end buffering.
+ * @return An array of the replies of queued commands in order, excluding
+ *         those already returned to the caller, NULL for a failed one.
+ *         Should be freed with ::mdb_clear.
+ */
+mdb_res_t *mdb_pipeline_exec(void)
+{
+	mdb_pipeline_t *p = &_mdb.pipeline;
+	mdb_pipeline_drain(true);
+	p->active = false;
+
+	redisReply *r = calloc(1, sizeof(*r));
+	if (!r) {
+		for (int i = 0; i < p->count; ++i)
+			mdb_clear(p->replies[i]);
+	} else {
+		r->type = MDB_RES_ARRAY;
+		r->elements = p->count;
+		r->element = p->replies;
+		p->replies = NULL;
+		p->capacity = 0;
+	}
+	p->count = 0;
+	return r;
+}
+
+/** @defgroup mdb_cache Client-side Cache */
+/** @{ */
+
+#define MDB_INVALIDATE_CHANNEL  "__redis__:invalidate"
+
+static uint32_t mdb_cache_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h % MDB_CACHE_BUCKETS;
+}
+
+static void mdb_cache_entry_free(mdb_cache_entry_t *e)
+{
+	free(e->field);
+	free(e->str);
+	free(e);
+}
+
+static void mdb_cache_clear_key(mdb_cache_key_t *k)
+{
+	for (int i = 0; i < MDB_CACHE_BUCKETS; ++i) {
+		mdb_cache_entry_t *e = k->buckets[i];
+		while (e) {
+			mdb_cache_entry_t *next = e->next;
+			mdb_cache_entry_free(e);
+			e = next;
+		}
+		k->buckets[i] = NULL;
+	}
+	k->entries = 0;
+}
+
+static mdb_cache_key_t *mdb_cache_find_key(const char *key, size_t len)
+{
+	for (int i = 0; i < _mdb.cache.count; ++i) {
+		mdb_cache_key_t *k = _mdb.cache.keys[i];
+		if (strlen(k->key) == len && !memcmp(k->key, key, len))
+			return k;
+	}
+	return NULL;
+}
+
+/** Find the registered key a command format operates on. */
+static mdb_cache_key_t *mdb_cache_key_of(const char *fmt)
+{
+	if (!_mdb.cache.count)
+		return NULL;
+	size_t len = strcspn(fmt, " ");
+	if (memchr(fmt, '%', len))
+		return NULL;
+	return mdb_cache_find_key(fmt, len);
+}
+
+static bool mdb_cache_connect_inv(void)
+{
+	if (_mdb.path[0])
+		_mdb.cache.inv = redisConnectUnix(_mdb.path);
+	else
+		_mdb.cache.inv = redisConnect(_mdb.host, _mdb.port);
+	if (!_mdb.cache.inv || _mdb.cache.inv->err)
+		return false;
+
+	redisReply *r = redisCommand(_mdb.cache.inv, "CLIENT ID");
+	if (!r || r->type != MDB_RES_INTEGER) {
+		mdb_clear(r);
+		return false;
+	}
+	_mdb.cache.inv_id = r->integer;
+	freeReplyObject(r);
+
+	r = redisCommand(_mdb.cache.inv, "SUBSCRIBE "MDB_INVALIDATE_CHANNEL);
+	bool ok = r && r->type == MDB_RES_ARRAY;
+	mdb_clear(r);
+	return ok;
+}
+
+/**
+ * Ask the server to report changes of a key to the invalidation
+ * connection, in broadcasting mode so that it costs no server memory.
+ */
+static bool mdb_cache_track(const char *key)
+{
+	if (!_mdb.cache.inv && !mdb_cache_connect_inv()) {
+		if (_mdb.cache.inv)
+			redisFree(_mdb.cache.inv);
+		_mdb.cache.inv = NULL;
+		return false;
+	}
+
+	redisReply *r = redisCommand(_mdb.c,
+			"CLIENT TRACKING ON REDIRECT %lld BCAST PREFIX %s",
+			_mdb.cache.inv_id, key);
+	bool ok = r && r->type == MDB_RES_STATUS;
+	mdb_clear(r);
+	return ok;
+}
+
+/**
+ * Apply pending invalidation messages without blocking.
+ */
+static void mdb_cache_poll(void)
+{
+	redisContext *inv = _mdb.cache.inv;
+	if (!inv)
+		return;
+
+	struct pollfd pfd = { .fd = inv->fd, .events = POLLIN };
+	if (poll(&pfd, 1, 0) <= 0)
+		return;
+
+	if (redisBufferRead(inv) != REDIS_OK) {
+		// Fall back to expiration only.
+		redisFree(inv);
+		_mdb.cache.inv = NULL;
+		for (int i = 0; i < _mdb.cache.count; ++i) {
+			_mdb.cache.keys[i]->tracked = false;
+			mdb_cache_clear_key(_mdb.cache.keys[i]);
+		}
+		return;
+	}
+
+	void *reply;
+	while (redisGetReplyFromReader(inv, &reply) == REDIS_OK && reply) {
+		redisReply *r = reply;
+		// ["message", channel, [keys...] or nil (flush)]
+		if (r->type == MDB_RES_ARRAY && r->elements == 3
+				&& r->element[0]->type == MDB_RES_STRING
+				&& streq(r->element[0]->str, "message")) {
+			redisReply *keys = r->element[2];
+			for (int i = 0; i < _mdb.cache.count; ++i) {
+				mdb_cache_key_t *k = _mdb.cache.keys[i];
+				bool hit = keys->type != MDB_RES_ARRAY;
+				for (size_t j = 0; !hit && j < keys->elements; ++j) {
+					redisReply *e = keys->element[j];
+					hit = e->type == MDB_RES_STRING && streq(e->str, k->key);
+				}
+				if (hit && k->entries) {
+					mdb_cache_clear_key(k);
+					++k->invalidations;
+				}
+			}
+		}
+		freeReplyObject(r);
+	}
+}
+
+static mdb_cache_entry_t **mdb_cache_slot(mdb_cache_key_t *k,
+		const char *field)
+{
+	mdb_cache_entry_t **e = k->buckets + mdb_cache_hash(field);
+	while (*e && !streq((*e)->field, field))
+		e = &(*e)->next;
+	return e;
+}
+
+static redisReply *mdb_cache_get(mdb_cache_key_t *k, const char *field)
+{
+	mdb_cache_poll();
+
+	mdb_cache_entry_t **slot = mdb_cache_slot(k, field), *e = *slot;
+	if (!e)
+		return NULL;
+
+	if (fb_time() >= e->expire) {
+		*slot = e->next;
+		mdb_cache_entry_free(e);
+		--k->entries;
+		return NULL;
+	}
+
+	redisReply *r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->type = e->type;
+	r->integer = e->integer;
+	if (e->str) {
+		r->str = malloc(e->len + 1);
+		if (!r->str) {
+			free(r);
+			return NULL;
+		}
+		memcpy(r->str, e->str, e->len + 1);
+		r->len = e->len;
+	}
+	return r;
+}
+
+static void mdb_cache_put(mdb_cache_key_t *k, const char *field,
+		const redisReply *r)
+{
+	if (r->type != MDB_RES_STRING && r->type != MDB_RES_INTEGER
+			&& r->type != MDB_RES_NIL)
+		return;
+
+	if (k->entries >= MDB_CACHE_MAX_ENTRIES)
+		mdb_cache_clear_key(k);
+
+	mdb_cache_entry_t **slot = mdb_cache_slot(k, field), *e = *slot;
+	if (!e) {
+		e = calloc(1, sizeof(*e));
+		if (!e || !(e->field = strdup(field))) {
+			free(e);
+			return;
+		}
+		*slot = e;
+		++k->entries;
+	}
+
+	free(e->str);
+	e->str = NULL;
+	if (r->str) {
+		e->str = malloc(r->len + 1);
+		if (e->str)
+			memcpy(e->str, r->str, r->len + 1);
+	}
+	e->len = r->len;
+	e->type = r->type;
+	e->integer = r->integer;
+	e->expire = fb_time() + k->ttl;
+}
+
+/**
+ * Cache values of a key in this process.
+ * Afterwards "GET key" and "HGET key field" issued via the unsafe calls
+ * (::mdb_res, ::mdb_integer...) are answered locally when possible. Entries
+ * are dropped when the server reports a change of the key (client
+ * tracking), when this process modifies the key, or after @a ttl seconds.
+ * @param key The key, must be a literal in command formats.
+ * @param ttl Maximum time an entry is trusted.
+ * @return 0 on success, -1 on error.
+ */
+int mdb_cache_enable(const char *key, int ttl)
+{
+	if (_mdb.cache.count >= MDB_CACHE_KEYS || ttl <= 0
+			|| mdb_cache_find_key(key, strlen(key)))
+		return -1;
+
+	mdb_cache_key_t *k = calloc(1, sizeof(*k));
+	if (!k || !(k->key = strdup(key))) {
+		free(k);
+		return -1;
+	}
+	k->ttl = ttl;
+	k->tracked = mdb_cache_track(key);
+	_mdb.cache.keys[_mdb.cache.count++] = k;
+	return 0;
+}
+
+/**
+ * Log hit rates of cached keys.
+ */
+void mdb_cache_report(void)
+{
+	for (int i = 0; i < _mdb.cache.count; ++i) {
+		const mdb_cache_key_t *k = _mdb.cache.keys[i];
+		unsigned long total = k->hits + k->misses;
+		log_internal_info("mdb cache %s: %lu/%lu hits (%.1f%%), %lu"
+				" invalidations, %d entries%s", k->key, k->hits, total,
+				total ? 100.0 * k->hits / total : 0.0, k->invalidations,
+				k->entries, k->tracked ? "" : ", untracked");
+	}
+}
+
+/** @} */
+
+/**
+ * Try answering a read from the cache.
+ * @param k The cached key.
+ * @param line The formatted command, "GET key" or "HGET key field".
+ * @param field Set to the field to be cached on a miss.
+ * @return The reply on a hit, NULL otherwise.
+ */
+static redisReply *mdb_cache_lookup(mdb_cache_key_t *k, const char *line,
+		const char **field)
+{
+	*field = NULL;
+	bool hget = !strncmp(line, "HGET ", 5);
+	if (!hget && strncmp(line, "GET ", 4))
+		return NULL;
+
+	const char *f = line + (hget ? 5 : 4) + strlen(k->key);
+	if (hget) {
+		if (*f != ' ' || strchr(f + 1, ' '))
+			return NULL;
+		++f;
+	} else if (*f != '\0') {
+		return NULL;
+	}
+
+	*field = f;
+	redisReply *r = mdb_cache_get(k, f);
+	if (r)
+		++k->hits;
+	else
+		++k->misses;
+	return r;
+}
+
+static redisReply *mdb_vcmd_cached(mdb_cache_key_t *k, const char *fmt,
 		va_list ap)
+{
+	char *buf = _mdb.buf;
+	char *s = smart_vsnprintf(buf, sizeof(_mdb.buf), fmt, ap);
+
+	const char *field;
+	redisReply *res = mdb_cache_lookup(k, s, &field);
+	if (!res) {
+		if (_mdb.pipeline.active) {
+			if (redisAppendCommand(_mdb.c, s) == REDIS_OK) {
+				++_mdb.pipeline.queued;
+				res = mdb_pipeline_drain(false);
+			}
+		} else {
+			res = redisCommand(_mdb.c, s);
+		}
+		if (res && field)
+			mdb_cache_put(k, field, res);
+	}
+
+	if (s != buf)
+		free(s);
+	return res;
+}
+
+static mdb_res_t *mdb_vcmd(bool safe, bool wait, const char *cmd,
+		const char *fmt, va_list ap)
 {
 	char real_fmt[64];
 	size_t bytes = snprintf(real_fmt, sizeof(real_fmt), "%s %s", cmd, fmt);
 	if (bytes >= sizeof(real_fmt))
 		return NULL;
 
+	mdb_cache_key_t *k = mdb_cache_key_of(fmt);
+	bool cached = k && !safe && (streq(cmd, "HGET") || streq(cmd, "GET"));
+	bool readonly = streq(cmd, "HMGET") || streq(cmd, "MGET")
+			|| streq(cmd, "HGETALL");
+	if (k && !cached && !readonly) {
+		// Written by ourselves, don't wait for the server to tell.
+		mdb_cache_clear_key(k);
+	}
+
 	redisReply *res;
-	if (safe) {
+	if (cached) {
+		res = mdb_vcmd_cached(k, real_fmt, ap);
+	} else if (_mdb.pipeline.active) {
+		if (mdb_append(safe, real_fmt, ap) < 0)
+			return NULL;
+		if (!wait)
+			return MDB_QUEUED;
+		res = mdb_pipeline_drain(false);
+	} else if (safe) {
 		res = redisvCommand(_mdb.c, real_fmt, ap);
 	} else {
 		char *buf = _mdb.buf;
@@ -97,35 +598,35 @@ static mdb_res_t *mdb_vcmd(bool safe, const char *cmd, const char *fmt,
 	return res;
 }
 
-#define MDB_CMD_HELPER(safe)  \
+#define MDB_CMD_HELPER(safe, wait)  \
 	va_list ap; \
 	va_start(ap, fmt); \
-	redisReply *res = mdb_vcmd(safe, cmd, fmt, ap); \
+	redisReply *res = mdb_vcmd(safe, wait, cmd, fmt, ap); \
 	va_end(ap);
 
 bool mdb_cmd(const char *cmd, const char *fmt, ...)
 {
-	MDB_CMD_HELPER(false);
+	MDB_CMD_HELPER(false, false);
 	mdb_clear(res);
 	return res;
 }
 
 bool mdb_cmd_safe(const char *cmd, const char *fmt, ...)
 {
-	MDB_CMD_HELPER(true);
+	MDB_CMD_HELPER(true, false);
 	mdb_clear(res);
 	return res;
 }
 
 mdb_res_t *mdb_res(const char *cmd, const char *fmt, ...)
 {
-	MDB_CMD_HELPER(false);
+	MDB_CMD_HELPER(false, true);
 	return res;
 }
 
 mdb_res_t *mdb_res_safe(const char *cmd, const char *fmt, ...)
 {
-	MDB_CMD_HELPER(true);
+	MDB_CMD_HELPER(true, true);
 	return res;
 }
 
@@ -147,7 +648,7 @@ mdb_res_t *mdb_recv(void)
 
 mdb_int_t mdb_integer(mdb_int_t invalid, const char *cmd, const char *fmt, ...)
 {
-	MDB_CMD_HELPER(false);
+	MDB_CMD_HELPER(false, true);
 	if (!res)
 		return invalid;
 
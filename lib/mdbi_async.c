@@ -0,0 +1,178 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <hiredis/adapters/libev.h>
+#include "fbbs/mdbi_async.h"
+#include "fbbs/string.h"
+
+/**
+ * Asynchronous access to the memory database on a libev loop.
+ * It uses its own connection and can be used alongside the synchronous
+ * interface in lib/mdbi.c.
+ */
+
+typedef struct {
+	redisAsyncContext *c;
+	struct ev_loop *loop;
+	char host[64];
+	int port;
+	char path[108];
+} mdb_async_conn_t;
+
+typedef struct {
+	mdb_async_callback_t callback;
+	void *arg;
+	ev_timer timer;
+	bool done; ///< callback already invoked due to timeout
+} mdb_async_call_t;
+
+static mdb_async_conn_t _mdb_async;
+
+static void connect_callback(const redisAsyncContext *c, int status)
+{
+	// the context is freed by hiredis on failure
+	if (status != REDIS_OK && c == _mdb_async.c)
+		_mdb_async.c = NULL;
+}
+
+static void disconnect_callback(const redisAsyncContext *c, int status)
+{
+	if (c == _mdb_async.c)
+		_mdb_async.c = NULL;
+}
+
+static int mdb_async_attach(redisAsyncContext *c)
+{
+	if (!c)
+		return -1;
+	if (c->err || redisLibevAttach(_mdb_async.loop, c) != REDIS_OK) {
+		redisAsyncFree(c);
+		return -1;
+	}
+	redisAsyncSetConnectCallback(c, connect_callback);
+	redisAsyncSetDisconnectCallback(c, disconnect_callback);
+	_mdb_async.c = c;
+	return 0;
+}
+
+int mdb_async_connect(struct ev_loop *loop, const char *host, int port)
+{
+	_mdb_async.loop = loop;
+	strlcpy(_mdb_async.host, host, sizeof(_mdb_async.host));
+	_mdb_async.port = port;
+	_mdb_async.path[0] = '\0';
+	return mdb_async_attach(redisAsyncConnect(host, port));
+}
+
+int mdb_async_connect_unix(struct ev_loop *loop, const char *path)
+{
+	_mdb_async.loop = loop;
+	strlcpy(_mdb_async.path, path, sizeof(_mdb_async.path));
+	_mdb_async.host[0] = '\0';
+	return mdb_async_attach(redisAsyncConnectUnix(path));
+}
+
+/**
+ * Close the connection after pending replies are received.
+ */
+void mdb_async_disconnect(void)
+{
+	redisAsyncContext *c = _mdb_async.c;
+	_mdb_async.c = NULL;
+	_mdb_async.host[0] = _mdb_async.path[0] = '\0';
+	if (c)
+		redisAsyncDisconnect(c);
+}
+
+bool mdb_async_connected(void)
+{
+	return _mdb_async.c;
+}
+
+static bool mdb_async_reconnect(void)
+{
+	if (_mdb_async.c)
+		return true;
+	if (!_mdb_async.loop || (!_mdb_async.host[0] && !_mdb_async.path[0]))
+		return false;
+	if (_mdb_async.path[0])
+		return mdb_async_attach(redisAsyncConnectUnix(_mdb_async.path)) == 0;
+	return mdb_async_attach(redisAsyncConnect(_mdb_async.host,
+				_mdb_async.port)) == 0;
+}
+
+static void timeout_callback(EV_P_ ev_timer *w, int revents)
+{
+	mdb_async_call_t *call = w->data;
+	call->done = true;
+	call->callback(NULL, call->arg);
+	// freed when hiredis gives up the call
+}
+
+static void reply_callback(redisAsyncContext *c, void *reply, void *privdata)
+{
+	mdb_async_call_t *call = privdata;
+	ev_timer_stop(_mdb_async.loop, &call->timer);
+
+	if (!call->done) {
+		redisReply *r = reply;
+		if (r && r->type == REDIS_REPLY_ERROR)
+			r = NULL;
+		call->callback(r, call->arg);
+	}
+	free(call);
+}
+
+/**
+ * Send a command without waiting for the reply.
+ * Arguments are formatted as ::mdb_cmd_safe does.
+ * @param callback Function to receive the reply, may be NULL.
+ * @param arg Argument passed to @a callback.
+ * @param timeout Milliseconds to wait for the reply, 0 for no limit.
+ *        On timeout @a callback is invoked with NULL and the late
+ *        reply is discarded.
+ * @param cmd The command.
+ * @param fmt Format of arguments.
+ * @return 0 if queued, -1 on error (@a callback will not be called).
+ */
+int mdb_async_cmd(mdb_async_callback_t callback, void *arg, int timeout,
+		const char *cmd, const char *fmt, ...)
+{
+	char real_fmt[64];
+	size_t bytes = snprintf(real_fmt, sizeof(real_fmt), "%s %s", cmd, fmt);
+	if (bytes >= sizeof(real_fmt) || !mdb_async_reconnect())
+		return -1;
+
+	if (!callback) {
+		va_list ap;
+		va_start(ap, fmt);
+		int ret = redisvAsyncCommand(_mdb_async.c, NULL, NULL, real_fmt, ap);
+		va_end(ap);
+		return ret == REDIS_OK ? 0 : -1;
+	}
+
+	mdb_async_call_t *call = malloc(sizeof(*call));
+	if (!call)
+		return -1;
+	call->callback = callback;
+	call->arg = arg;
+	call->done = false;
+	ev_timer_init(&call->timer, timeout_callback, timeout / 1000.0, 0.);
+	call->timer.data = call;
+
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = redisvAsyncCommand(_mdb_async.c, reply_callback, call,
+			real_fmt, ap);
+	va_end(ap);
+
+	if (ret != REDIS_OK) {
+		free(call);
+		return -1;
+	}
+	if (timeout > 0)
+		ev_timer_start(_mdb_async.loop, &call->timer);
+	return 0;
+}
@@ -1,8 +1,10 @@
 #include <arpa/inet.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "fbbs/dbi.h"
 #include "fbbs/list.h"
 #include "fbbs/pool.h"
@@ -20,27 +22,212 @@
 
 typedef PGconn db_conn_t;
 
-static db_conn_t *global_db_conn;
+enum {
+	DB_MAX_REPLICAS = 8,
+	DB_REPLICA_CHECK_INTERVAL = 2, ///< seconds between two lag checks
+	DB_REPLICA_RETRY_INTERVAL = 30, ///< seconds before reconnecting
+};
+
+typedef struct {
+	db_conn_t *conn;
+	uint64_t replay_lsn; ///< last known replay position
+	fb_time_t checked; ///< time of last lag check
+	fb_time_t failed; ///< time of last failure, 0 if healthy
+	bool fresh; ///< within the staleness bound at last check
+} db_replica_t;
+
+/**
+ * Read/write router.
+ * Writes and plain queries always go to the primary. Queries marked with
+ * ::query_readonly are sent to a replica whose replay LSN lags behind the
+ * primary's WAL position by no more than ::max_lag bytes; otherwise, or if
+ * the replica fails, they fall back to the primary.
+ * Within one request (see db_request_begin()) all replica reads use the same
+ * replica, and once the request has written, reads stay on the primary so
+ * that it sees its own writes.
+ */
+typedef struct {
+	db_conn_t *primary;
+	uint64_t primary_lsn;
+	fb_time_t primary_checked;
+	db_replica_t replicas[DB_MAX_REPLICAS];
+	int count;
+	int next; ///< round-robin cursor
+	uint64_t max_lag;
+	int trans; ///< transaction depth, pins reads to the primary
+	bool pinned; ///< the request has written, reads stay on the primary
+	db_replica_t *current; ///< replica used by the request so far
+} db_router_t;
+
+static FB_THREAD_LOCAL db_router_t router = { .max_lag = DB_REPLICA_DEFAULT_MAX_LAG };
 
 bool db_connect(const char *host, const char *port, const char *db,
 		const char *user, const char *pwd)
 {
-	global_db_conn = PQsetdbLogin(host, port, NULL, NULL, db, user, pwd);
+	router.primary = PQsetdbLogin(host, port, NULL, NULL, db, user, pwd);
 
-	if (PQstatus(global_db_conn) != CONNECTION_OK)
-		global_db_conn = NULL;
+	if (PQstatus(router.primary) != CONNECTION_OK)
+		router.primary = NULL;
+	return router.primary;
+}
+
+/**
+ * Add a read replica.
+ * A replica that is unreachable now is kept and retried later.
+ * @return 0 on success, -1 if there are too many replicas.
+ */
+int db_add_replica(const char *host, const char *port, const char *db,
+		const char *user, const char *pwd)
+{
+	if (router.count >= DB_MAX_REPLICAS)
+		return -1;
+
+	db_replica_t *r = router.replicas + router.count++;
+	memset(r, 0, sizeof(*r));
+	r->conn = PQsetdbLogin(host, port, NULL, NULL, db, user, pwd);
+	if (PQstatus(r->conn) != CONNECTION_OK)
+		r->failed = fb_time();
+	return 0;
+}
 
-	return global_db_conn;
+/**
+ * Set the staleness bound of replicas.
+ * @param bytes Maximum WAL distance between primary and replica.
+ */
+void db_set_replica_max_lag(int64_t bytes)
+{
+	router.max_lag = bytes > 0 ? bytes : 0;
 }
 
 void db_finish(void)
 {
-	PQfinish(global_db_conn);
+	for (int i = 0; i < router.count; ++i)
+		PQfinish(router.replicas[i].conn);
+	router.count = 0;
+	PQfinish(router.primary);
 }
 
 const char *db_errmsg(void)
 {
-	return PQerrorMessage(global_db_conn);
+	return PQerrorMessage(router.primary);
+}
+
+/**
+ * Fetch a WAL position from the server.
+ * @param conn The connection.
+ * @param func "pg_current_wal_lsn" or "pg_last_wal_replay_lsn".
+ * @param lsn Set to the position in bytes.
+ * @return 0 on success, -1 on error or NULL position.
+ */
+static int fetch_lsn(db_conn_t *conn, const char *func, uint64_t *lsn)
+{
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "SELECT %s()", func);
+
+	int ret = -1;
+	db_res_t *res = PQexec(conn, cmd);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1
+			&& !PQgetisnull(res, 0, 0)) {
+		// text form is "%X/%X"
+		char *end;
+		uint64_t hi = strtoull(PQgetvalue(res, 0, 0), &end, 16);
+		if (*end == '/') {
+			uint64_t lo = strtoull(end + 1, NULL, 16);
+			*lsn = (hi << 32) | lo;
+			ret = 0;
+		}
+	}
+	PQclear(res);
+	return ret;
+}
+
+static void replica_fail(db_replica_t *r, fb_time_t now)
+{
+	r->failed = now;
+	r->fresh = false;
+}
+
+static bool replica_usable(db_replica_t *r, fb_time_t now)
+{
+	if (r->failed) {
+		if (now - r->failed < DB_REPLICA_RETRY_INTERVAL)
+			return false;
+		PQreset(r->conn);
+		if (PQstatus(r->conn) != CONNECTION_OK) {
+			r->failed = now;
+			return false;
+		}
+		r->failed = 0;
+		r->checked = 0;
+	}
+
+	if (now - r->checked < DB_REPLICA_CHECK_INTERVAL)
+		return r->fresh;
+
+	if (now - router.primary_checked >= DB_REPLICA_CHECK_INTERVAL) {
+		if (fetch_lsn(router.primary, "pg_current_wal_lsn",
+					&router.primary_lsn) != 0)
+			return false;
+		router.primary_checked = now;
+	}
+
+	r->checked = now;
+	if (fetch_lsn(r->conn, "pg_last_wal_replay_lsn", &r->replay_lsn) != 0) {
+		// not in recovery, or broken connection
+		if (PQstatus(r->conn) != CONNECTION_OK)
+			replica_fail(r, now);
+		r->fresh = false;
+		return false;
+	}
+
+	r->fresh = router.primary_lsn <= r->replay_lsn
+			|| router.primary_lsn - r->replay_lsn <= router.max_lag;
+	return r->fresh;
+}
+
+/** Pick a replica for a read-only query, NULL if none qualifies. */
+static db_replica_t *pick_replica(void)
+{
+	if (!router.count || router.trans || router.pinned)
+		return NULL;
+
+	fb_time_t now = fb_time();
+	if (router.current && replica_usable(router.current, now))
+		return router.current;
+	for (int i = 0; i < router.count; ++i) {
+		db_replica_t *r = router.replicas + router.next;
+		if (++router.next >= router.count)
+			router.next = 0;
+		if (replica_usable(r, now))
+			return router.current = r;
+	}
+	return NULL;
+}
+
+/**
+ * Start a new request.
+ * Releases the primary pin and the replica chosen by the previous request.
+ */
+void db_request_begin(void)
+{
+	router.pinned = false;
+	router.current = NULL;
+}
+
+/**
+ * Send the remaining read-only queries of this request to the primary.
+ * Writes through ::db_cmd, ::query_cmd or a non-SELECT query pin
+ * automatically.
+ */
+void db_pin_primary(void)
+{
+	router.pinned = true;
+}
+
+static void pin_after_write(const char *cmd, int expected)
+{
+	if (expected == DBRES_COMMAND_OK || strncasecmp(cmd, "SELECT", 6) != 0)
+		router.pinned = true;
 }
 
 fb_time_t ts_to_time(db_timestamp ts)
@@ -53,10 +240,25 @@ db_timestamp time_to_ts(fb_time_t t)
 	return (t - POSTGRES_EPOCH_TIME) * INT64_C(1000000);
 }
 
+enum {
+	DB_DECODE_MAX_COLUMNS = 64, ///< larger descriptor tables are not cached
+};
+
+/** Column numbers resolved by the last db_decode_rows() call. */
+static FB_THREAD_LOCAL struct {
+	const db_res_t *res;
+	const db_column_t *columns;
+	int index[DB_DECODE_MAX_COLUMNS];
+} decode_cache;
+
 void db_clear(db_res_t *res)
 {
-	if (res)
+	if (res) {
+		// the address may be reused by the next result
+		if (decode_cache.res == res)
+			decode_cache.res = NULL;
 		PQclear(res);
+	}
 }
 
 #define _is_binary_field(res, col)  PQfformat(res, col)
@@ -139,19 +341,131 @@ float db_get_float(const db_res_t *res, int row, int col)
 	}
 }
 
+static int64_t decode_integer(const db_res_t *res, int row, int col)
+{
+	const char *r = PQgetvalue(res, row, col);
+	if (!_is_binary_field(res, col))
+		return strtoll(r, NULL, 10);
+
+	switch (PQgetlength(res, row, col)) {
+		case 1:
+			return *r;
+		case 2:
+			return (int16_t) ntohs(*(const uint16_t *) r);
+		case 4:
+			return (int32_t) ntohl(*(const uint32_t *) r);
+		default:
+			return (int64_t) be64toh(*(const uint64_t *) r);
+	}
+}
+
+static void store_integer(void *field, size_t size, int64_t val)
+{
+	switch (size) {
+		case 1:
+			*(int8_t *) field = val;
+			break;
+		case 2:
+			*(int16_t *) field = val;
+			break;
+		case 4:
+			*(int32_t *) field = val;
+			break;
+		default:
+			*(int64_t *) field = val;
+			break;
+	}
+}
+
+/**
+ * Decode result rows into an array of structs.
+ * Column numbers are resolved by name once per result and descriptor
+ * table, so the same table works for any select list containing the
+ * columns, and callers decoding one row at a time pay for the lookup once.
+ * Fields whose column is absent or NULL are left zeroed.
+ * @param res The query result.
+ * @param row The first row to decode.
+ * @param count Maximum number of rows to decode.
+ * @param columns The column descriptors.
+ * @param ncolumns Number of column descriptors.
+ * @param buf The first struct.
+ * @param stride Distance in bytes between two structs.
+ * @return Number of rows decoded.
+ */
+int db_decode_rows(const db_res_t *res, int row, int count,
+		const db_column_t *columns, int ncolumns, void *buf, size_t stride)
+{
+	if (!res || row < 0)
+		return 0;
+	if (count > db_res_rows(res) - row)
+		count = db_res_rows(res) - row;
+	if (count <= 0)
+		return 0;
+
+	int buf_index[ncolumns];
+	int *index = buf_index;
+	bool resolved = false;
+	if (ncolumns <= DB_DECODE_MAX_COLUMNS) {
+		index = decode_cache.index;
+		resolved = decode_cache.res == res && decode_cache.columns == columns;
+		decode_cache.res = res;
+		decode_cache.columns = columns;
+	}
+	if (!resolved) {
+		for (int i = 0; i < ncolumns; ++i)
+			index[i] = PQfnumber(res, columns[i].name);
+	}
+
+	char *ptr = buf;
+	for (int r = row; r < row + count; ++r, ptr += stride) {
+		memset(ptr, 0, stride);
+		for (int i = 0; i < ncolumns; ++i) {
+			const db_column_t *c = columns + i;
+			int col = index[i];
+			if (col < 0 || PQgetisnull(res, r, col))
+				continue;
+
+			void *field = ptr + c->offset;
+			switch (c->type) {
+				case DB_COLUMN_INTEGER:
+					store_integer(field, c->size, decode_integer(res, r, col));
+					break;
+				case DB_COLUMN_BOOL:
+					*(bool *) field = db_get_bool(res, r, col);
+					break;
+				case DB_COLUMN_TIME:
+					*(fb_time_t *) field = db_get_time(res, r, col);
+					break;
+				case DB_COLUMN_STRING:
+					strlcpy(field, PQgetvalue(res, r, col), c->size);
+					break;
+				case DB_COLUMN_FLAG:
+					if (db_get_bool(res, r, col))
+						*(int *) field |= c->flag;
+					break;
+			}
+		}
+	}
+	return count;
+}
+
 int db_begin_trans(void)
 {
-	db_res_t *res = PQexec(global_db_conn, "BEGIN");
+	db_res_t *res = PQexec(router.primary, "BEGIN");
 	int r = (PQresultStatus(res) == PGRES_COMMAND_OK ? 0 : -1);
 	PQclear(res);
+	if (r == 0)
+		++router.trans;
 	return r;
 }
 
 int db_end_trans(void)
 {
-	db_res_t *res = PQexec(global_db_conn, "END");
+	db_res_t *res = PQexec(router.primary, "END");
 	int r = (PQresultStatus(res) == PGRES_COMMAND_OK ? 0 : -1);
 	PQclear(res);
+	if (router.trans > 0)
+		--router.trans;
 	return r;
 }
 
@@ -185,6 +499,7 @@ struct query_t {
 	struct query_param_list_t params;
 	query_param_t *tail;
 	int count;
+	bool readonly;
 };
 
 static void query_append_param(query_t *q, query_param_t *p)
@@ -346,19 +661,34 @@ static void query_free(query_t *q)
 
 static db_res_t *_query_exec(query_t *q, int expected)
 {
-	db_res_t *res;
+	const char **vals = NULL;
+	int *lens = NULL, *fmts = NULL;
 	if (q->count) {
-		const char **vals = pool_alloc(q->p, q->count * sizeof(*vals));
-		int *lens = pool_alloc(q->p, q->count * sizeof(*lens));
-		int *fmts = pool_alloc(q->p, q->count * sizeof(*fmts));
-
+		vals = pool_alloc(q->p, q->count * sizeof(*vals));
+		lens = pool_alloc(q->p, q->count * sizeof(*lens));
+		fmts = pool_alloc(q->p, q->count * sizeof(*fmts));
 		convert_param_array(q, vals, lens, fmts);
-		res = PQexecParams(global_db_conn, pstring(q->query), q->count, NULL,
+	}
+
+	db_res_t *res;
+	db_replica_t *r = q->readonly ? pick_replica() : NULL;
+	if (r) {
+		res = PQexecParams(r->conn, pstring(q->query), q->count, NULL,
 				vals, lens, fmts, 1);
-	} else {
-		res = PQexecParams(global_db_conn, pstring(q->query), 0, NULL, NULL,
-				NULL, NULL, 1);
+		if (db_res_status(res) == expected) {
+			query_free(q);
+			return res;
+		}
+		// e.g. canceled by recovery conflict, retry on primary
+		if (PQstatus(r->conn) != CONNECTION_OK)
+			replica_fail(r, fb_time());
+		db_clear(res);
 	}
+
+	if (!q->readonly)
+		pin_after_write(pstring(q->query), expected);
+	res = PQexecParams(router.primary, pstring(q->query), q->count, NULL,
+			vals, lens, fmts, 1);
 	query_free(q);
 
 	if (db_res_status(res) != expected) {
@@ -378,6 +708,16 @@ db_res_t *query_cmd(query_t *q)
 	return _query_exec(q, DBRES_COMMAND_OK);
 }
 
+/**
+ * Mark a query as read-only.
+ * It may then be served by a replica within the staleness bound.
+ * @param q The query.
+ */
+void query_readonly(query_t *q)
+{
+	q->readonly = true;
+}
+
 query_t *query_new(size_t size)
 {
 	pool_t *pool = pool_create(0);
@@ -388,6 +728,7 @@ query_t *query_new(size_t size)
 	SLIST_INIT_HEAD(&q->params);
 	q->tail = NULL;
 	q->count = 0;
+	q->readonly = false;
 
 	if (!size)
 		size = 511;
@@ -425,7 +766,8 @@ static db_res_t *db_exec(const char *cmd, va_list ap, int expected)
 		query_vappend(q, cmd, ap);
 		res = _query_exec(q, expected);
 	} else {
-		res = PQexecParams(global_db_conn, cmd, 0, NULL, NULL, NULL, NULL, 1);
+		pin_after_write(cmd, expected);
+		res = PQexecParams(router.primary, cmd, 0, NULL, NULL, NULL, NULL, 1);
 		if (db_res_status(res) != expected) {
 			db_clear(res);
 			return NULL;
@@ -15,6 +15,7 @@
 #include "fbbs/session.h"
 #include "fbbs/string.h"
 
+#include "s11n/db_post.h"
 #include "s11n/frontend_post.h"
 
 int post_record_cmp(const void *p1, const void *p2)
@@ -640,11 +641,9 @@ int post_dump_gbk_file(const char *utf8_str, size_t length, char *file,
 	return 0;
 }
 
-/** 版面最新一篇文章的时间 @mdb_hash */
-#define LAST_POST_KEY  "last_post"
-
 bool set_last_post_time(int bid, fb_time_t stamp)
 {
+	board_stat_set_last_post(bid, stamp);
 	return mdb_cmd("HSET", LAST_POST_KEY " %d %"PRIdFBT, bid, stamp);
 }
 
@@ -653,6 +652,39 @@ fb_time_t get_last_post_time(int bid)
 	return (fb_time_t) mdb_integer(0, "HGET", LAST_POST_KEY " %d", bid);
 }
 
+/**
+ * 以一条HMGET获取多个版面的最新发文时间
+ * @param[in] bids 版面ID数组
+ * @param[in] count 版面数
+ * @param[out] stamps 各版面的最新发文时间, 未知时为0
+ * @return 成功返回0, 否则-1
+ */
+int get_last_post_times(const int *bids, int count, fb_time_t *stamps)
+{
+	memset(stamps, 0, sizeof(*stamps) * count);
+	if (count <= 0)
+		return 0;
+
+	char *args = malloc(count * 12);
+	if (!args)
+		return -1;
+	char *p = args;
+	for (int i = 0; i < count; ++i)
+		p += sprintf(p, i ? " %d" : "%d", bids[i]);
+
+	mdb_res_t *res = mdb_res("HMGET", LAST_POST_KEY " %s", args);
+	free(args);
+	if (!res)
+		return -1;
+	for (int i = 0; i < count; ++i) {
+		const char *s = mdb_string(mdb_res_at(res, i));
+		if (s)
+			stamps[i] = strtoll(s, NULL, 10);
+	}
+	mdb_clear(res);
+	return 0;
+}
+
 /**
  * 删除版面上符合条件的文章
  * @param filter 文章过滤条件，其中必须指定版面 ID
@@ -822,24 +854,9 @@ int post_record_invalidity_get(int board_id)
 void post_record_from_query(db_res_t *res, int row, post_record_t *post,
 		bool sticky)
 {
-	post->id = db_get_post_id(res, row, 0);
-	post->reply_id = db_get_post_id(res, row, 1);
-	post->thread_id = db_get_post_id(res, row, 2);
-	post->user_id = db_get_user_id(res, row, 3);
-	post->user_id_replied = db_get_user_id(res, row, 4);
-	post->board_id = db_get_integer(res, row, 7);
-	post->flag = (db_get_bool(res, row, 9) ? POST_FLAG_DIGEST : 0)
-			| (db_get_bool(res, row, 10) ? POST_FLAG_MARKED : 0)
-			| (db_get_bool(res, row, 11) ? POST_FLAG_LOCKED : 0)
-			| (db_get_bool(res, row, 12) ? POST_FLAG_IMPORT : 0)
-			| (db_get_bool(res, row, 13) ? POST_FLAG_WATER : 0)
-			| (sticky ? POST_FLAG_STICKY : 0);
-	string_copy_allow_null(post->user_name, db_get_value(res, row, 6),
-			sizeof(post->user_name));
-	string_copy_allow_null(post->utf8_title, db_get_value(res, row, 15),
-			sizeof(post->utf8_title));
-
-	post->board_name[0] = '\0';
+	db_decode_post_record(res, row, 1, post, sizeof(*post));
+	if (sticky)
+		post->flag |= POST_FLAG_STICKY;
 }
 
 static void convert_post_record_extended(db_res_t *res, int row,
@@ -881,8 +898,10 @@ static bool update_record(record_t *rec, int bid, bool sticky)
 	int rows = db_res_rows(res);
 	post_record_t *posts = malloc(sizeof(*posts) * rows);
 	if (posts) {
-		for (int i = 0; i < rows; ++i) {
-			post_record_from_query(res, i, posts + i, sticky);
+		db_decode_post_record(res, 0, rows, posts, sizeof(*posts));
+		if (sticky) {
+			for (int i = 0; i < rows; ++i)
+				posts[i].flag |= POST_FLAG_STICKY;
 		}
 		qsort(posts, rows, sizeof(*posts),
 				sticky ? post_sticky_compare : post_record_compare);
@@ -922,6 +941,64 @@ bool post_update_record(int board_id, bool force)
 	return updated;
 }
 
+/**
+ * 打开版面文章记录缓存, 不检查其是否过期
+ * @param[in] board_id 版面ID
+ * @param[out] record 记录文件
+ * @return 文件描述符, 出错返回-1
+ */
+int post_record_open_cached(int board_id, record_t *record)
+{
+	return _post_record_open(board_id, RECORD_READ, record);
+}
+
+static uint64_t post_record_file_version(int fd, uint64_t version,
+		fb_time_t *modified)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return version;
+
+	post_record_t last = { .id = 0 };
+	if (st.st_size >= sizeof(last)
+			&& pread(fd, &last, sizeof(last), st.st_size - sizeof(last))
+				!= sizeof(last))
+		last.id = 0;
+
+	version = version * 1000003 + st.st_mtime;
+	version = version * 1000003 + st.st_size;
+	version = version * 1000003 + last.id;
+	if (st.st_mtime > *modified)
+		*modified = st.st_mtime;
+	return version;
+}
+
+/**
+ * 版面文章记录缓存的版本, 用于HTTP条件请求
+ * 由记录文件和置顶文件的修改时间, 大小及最大文章ID组成.
+ * @param[in] board_id 版面ID
+ * @param[out] modified 最后修改时间
+ * @return 版本, 缓存需要更新或不存在时返回0
+ */
+uint64_t post_record_version(int board_id, fb_time_t *modified)
+{
+	*modified = 0;
+	if (post_record_invalidity_get(board_id))
+		return 0;
+
+	record_t record;
+	if (_post_record_open(board_id, RECORD_READ, &record) < 0)
+		return 0;
+	uint64_t version = post_record_file_version(record.fd, 1, modified);
+	record_close(&record);
+
+	if (_post_record_open_sticky(board_id, RECORD_READ, &record) >= 0) {
+		version = post_record_file_version(record.fd, version, modified);
+		record_close(&record);
+	}
+	return version;
+}
+
 int post_record_open(int board_id, record_t *record)
 {
 	int fd = _post_record_open(board_id, RECORD_READ, record);
@@ -973,11 +1050,9 @@ bool post_update_trash_record(record_t *record, post_trash_e trash,
 	int rows = db_res_rows(res);
 	post_record_extended_t *posts = malloc(sizeof(*posts) * rows);
 	if (posts) {
-		for (int i = 0; i < rows; ++i) {
-			post_record_from_query(res, i, (post_record_t *) (posts + i),
-					false);
+		db_decode_post_record(res, 0, rows, &posts->basic, sizeof(*posts));
+		for (int i = 0; i < rows; ++i)
 			convert_post_record_extended(res, i, posts + i);
-		}
 		qsort(posts, rows, sizeof(*posts), post_record_compare);
 		record_write(record, posts, rows, 0);
 		record_truncate(record, rows);
@@ -1072,6 +1147,25 @@ static bool post_content_update_cache(const char *file, const char *str,
 	return ok;
 }
 
+/**
+ * 文章内容缓存的版本, 修改文章时缓存文件会被删除重建
+ * @param[in] post_id 文章ID
+ * @param[out] modified 缓存文件的修改时间
+ * @return 版本, 尚未缓存时返回0
+ */
+uint64_t post_content_version(post_id_t post_id, fb_time_t *modified)
+{
+	char file[HOMELEN];
+	post_content_cache_filename(post_id, file, sizeof(file));
+
+	struct stat st;
+	if (stat(file, &st) != 0)
+		return 0;
+	*modified = st.st_mtime;
+	return ((uint64_t) st.st_mtime << 24) ^ ((uint64_t) st.st_ino << 8)
+			^ st.st_size;
+}
+
 char *post_content_get(post_id_t post_id, bool read_deleted)
 {
 	char file[HOMELEN];
@@ -1175,21 +1269,7 @@ int _post_reply_load(const char *table_name, bool unread_only,
 		return -1;
 
 	int rows = db_res_rows(res);
-	for (int i = 0; i < rows && i < size; ++i) {
-		post_info_t *pi = buf + i;
-		pi->id = db_get_post_id(res, i, 0);
-		pi->reply_id = db_get_post_id(res, i, 1);
-		pi->thread_id = db_get_post_id(res, i, 2);
-		pi->flag = db_get_bool(res, i, 8) ? POST_FLAG_READ : 0;
-		pi->user_id = db_get_user_id(res, i, 3);
-		pi->board_id = db_get_integer(res, i, 5);
-		string_copy_allow_null(pi->user_name, db_get_value(res, i, 4),
-				sizeof(pi->user_name));
-		string_copy_allow_null(pi->board_name, db_get_value(res, i, 6),
-				sizeof(pi->board_name));
-		string_copy_allow_null(pi->utf8_title, db_get_value(res, i, 7),
-				sizeof(pi->utf8_title));
-	}
+	db_decode_post_info(res, 0, size, buf, sizeof(*buf));
 	db_clear(res);
 	return rows;
 }
@@ -1226,7 +1306,7 @@ int post_reply_delete(user_id_t user_id, post_id_t post_id)
 #define POST_REPLY_COUNT_KEY  "post:reply_count"
 
 /** 缓存的新回复计数 */
-static int _post_reply_count;
+static FB_THREAD_LOCAL int _post_reply_count;
 
 bool post_reply_incr_count(user_id_t user_id, int delta)
 {
@@ -1315,7 +1395,7 @@ int post_mention_delete(user_id_t user_id, post_id_t post_id)
 #define POST_MENTION_COUNT_KEY  "post:mention_count"
 
 /** 缓存的新提及计数 */
-static int _post_mention_count;
+static FB_THREAD_LOCAL int _post_mention_count;
 
 bool post_mention_incr_count(user_id_t user_id, int delta)
 {
@@ -1,7 +1,11 @@
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "bbs.h"
+#include "fbbs/friend.h"
+#include "fbbs/log.h"
 #include "fbbs/mdbi.h"
 #include "fbbs/session.h"
 #include "fbbs/string.h"
@@ -10,6 +14,12 @@ enum {
 	IDLE_TIME_REFRESH_THRESHOLD = 5,
 	ONLINE_FOLLOWS_COUNT_REFRESH_INTERVAL = 15,
 	ONLINE_COUNT_REFRESH_INTERVAL = 15,
+
+	SESSION_TABLE_SHMKEY = 30080,
+	SESSION_TABLE_SLOTS = MAXACTIVE * 4,
+	SESSION_TABLE_PROBES = 64,
+	SESSION_TABLE_USERS = MAXUSERS * 2,
+	SESSION_LIST_INITIAL_SIZE = 64,
 };
 
 typedef struct {
@@ -23,7 +33,7 @@ typedef struct {
 } bbs_session_t;
 
 /** 当前用户会话数据 */
-static bbs_session_t session;
+static FB_THREAD_LOCAL bbs_session_t session;
 
 session_id_t session_get_id(void)
 {
@@ -76,11 +86,378 @@ void session_clear(void)
 	session.visible = true;
 }
 
+/**
+ * 共享内存会话表
+ *
+ * 每个在线会话占用一个槽位, 以会话ID散列定位, 冲突时线性探测.
+ * 写者以CAS抢占空槽位, 填好各字段后才发布ID; 读者先后两次读取ID,
+ * 一致则认为拷贝有效, 因此无需加锁. 数据库中的sessions表仅作为持久记录.
+ * 表不可用, 尚未载入或有会话溢出时, 读者回退到数据库和redis.
+ * 另按用户ID记录在线会话数, 用于快速判断用户是否在线.
+ */
+typedef struct {
+	int loaded; ///< 已从数据库载入活动会话
+	int overflow; ///< 未能放入表中的会话数, 由clean_session定期重新统计
+	uint16_t online[SESSION_TABLE_USERS]; ///< 各用户的在线会话数
+	uint16_t visible[SESSION_TABLE_USERS]; ///< 各用户的可见会话数
+	session_info_t slots[SESSION_TABLE_SLOTS];
+} session_table_t;
+
+static session_table_t *session_table;
+
+static session_info_t *session_table_find(session_table_t *t,
+		session_id_t sid)
+{
+	if (!t || sid <= 0)
+		return NULL;
+	int slot = (uint64_t) sid % SESSION_TABLE_SLOTS;
+	for (int i = 0; i < SESSION_TABLE_PROBES; ++i) {
+		session_info_t *s = t->slots + slot;
+		if (*(volatile session_id_t *) &s->id == sid)
+			return s;
+		if (++slot == SESSION_TABLE_SLOTS)
+			slot = 0;
+	}
+	return NULL;
+}
+
+static void session_table_count(session_table_t *t, user_id_t user_id,
+		int flag, int delta)
+{
+	if (user_id > 0 && user_id < SESSION_TABLE_USERS) {
+		__sync_fetch_and_add(t->online + user_id, delta);
+		if (!(flag & SESSION_FLAG_INVISIBLE))
+			__sync_fetch_and_add(t->visible + user_id, delta);
+	}
+}
+
+static bool _session_table_insert(session_table_t *t, session_id_t sid,
+		user_id_t user_id, const char *user_name, int pid,
+		const char *ip_addr, int flag, fb_time_t idle)
+{
+	if (session_table_find(t, sid))
+		return true;
+
+	if (user_id >= SESSION_TABLE_USERS) {
+		log_internal_err("session table: user id %"PRIdUID" too large",
+				user_id);
+		return false;
+	}
+
+	int slot = (uint64_t) sid % SESSION_TABLE_SLOTS;
+	for (int i = 0; i < SESSION_TABLE_PROBES; ++i) {
+		session_info_t *s = t->slots + slot;
+		// 以负数ID占位, 读者不会匹配到尚未填好的槽位
+		if (__sync_bool_compare_and_swap(&s->id, 0, -sid)) {
+			s->user_id = user_id;
+			s->pid = pid;
+			s->board = 0;
+			s->idle = idle;
+			s->status = ST_IDLE;
+			s->flag = flag;
+			strlcpy(s->user_name, user_name ? user_name : "",
+					sizeof(s->user_name));
+			strlcpy(s->ip_addr, ip_addr ? ip_addr : "", sizeof(s->ip_addr));
+			__sync_synchronize();
+			s->id = sid;
+			session_table_count(t, user_id, flag, 1);
+			return true;
+		}
+		if (++slot == SESSION_TABLE_SLOTS)
+			slot = 0;
+	}
+
+	log_internal_err("session table overflow, sid %"PRIdSID, sid);
+	return false;
+}
+
+static int session_id_cmp(const void *l, const void *r)
+{
+	session_id_t a = *(const session_id_t *) l;
+	session_id_t b = *(const session_id_t *) r;
+	return a < b ? -1 : (a > b);
+}
+
+/**
+ * 按数据库中的活动会话校正会话表
+ * 补入缺失的会话, 清除没有数据库记录的槽位(如载入与会话结束并发时留下的),
+ * 并重新统计溢出数. 成功后会话表即视为已载入.
+ */
+static int session_table_reload(session_table_t *t)
+{
+	// 只清除查询前已存在的槽位, 查询之后加入的会话不在结果中
+	session_id_t *known = malloc(sizeof(*known) * SESSION_TABLE_SLOTS);
+	if (!known)
+		return -1;
+	for (int i = 0; i < SESSION_TABLE_SLOTS; ++i)
+		known[i] = *(volatile session_id_t *) &t->slots[i].id;
+	int overflow = *(volatile int *) &t->overflow;
+
+	db_res_t *res = db_query("SELECT id, user_id, user_name, pid, ip_addr,"
+			" web, visible, stamp FROM sessions WHERE active");
+	int rows = res ? db_res_rows(res) : 0;
+	session_id_t *active = malloc(sizeof(*active) * (rows + 1));
+	if (!res || !active) {
+		db_clear(res);
+		free(active);
+		free(known);
+		return -1;
+	}
+
+	int missing = 0;
+	for (int i = 0; i < rows; ++i) {
+		active[i] = db_get_session_id(res, i, 0);
+		int flag = (db_get_bool(res, i, 5) ? SESSION_FLAG_WEB : 0)
+				| (db_get_bool(res, i, 6) ? 0 : SESSION_FLAG_INVISIBLE);
+		if (!_session_table_insert(t, active[i],
+				db_get_user_id(res, i, 1), db_get_value(res, i, 2),
+				db_get_integer(res, i, 3), db_get_value(res, i, 4), flag,
+				db_get_time(res, i, 7)))
+			++missing;
+	}
+	db_clear(res);
+	qsort(active, rows, sizeof(*active), session_id_cmp);
+
+	int reaped = 0;
+	for (int i = 0; i < SESSION_TABLE_SLOTS; ++i) {
+		session_id_t sid = known[i];
+		if (sid <= 0 || bsearch(&sid, active, rows, sizeof(*active),
+				session_id_cmp))
+			continue;
+		session_info_t *s = t->slots + i;
+		user_id_t user_id = s->user_id;
+		int flag = s->flag;
+		if (__sync_bool_compare_and_swap(&s->id, sid, 0)) {
+			session_table_count(t, user_id, flag, -1);
+			++reaped;
+		}
+	}
+	if (reaped)
+		log_internal_err("session table: reaped %d stale slots", reaped);
+
+	// 期间有新的溢出时保留原值, 留待下次校正
+	__sync_bool_compare_and_swap(&t->overflow, overflow, missing);
+	__sync_synchronize();
+	t->loaded = true;
+
+	free(active);
+	free(known);
+	return 0;
+}
+
+static session_table_t *session_table_get(void)
+{
+	static shm_once_t once;
+	int created;
+	session_table_t *t = attach_shm_once(&once, "SESSION_SHMKEY",
+			SESSION_TABLE_SHMKEY, sizeof(*t), &created);
+	session_table = t;
+	if (t && created)
+		session_table_reload(t);
+	return t;
+}
+
+/**
+ * 按数据库校正共享内存会话表, 由clean_session定期调用
+ * 会话表载入失败时也借此重试.
+ * @return 成功返回0, 否则-1
+ */
+int session_table_sync(void)
+{
+	session_table_t *t = session_table_get();
+	return t ? session_table_reload(t) : -1;
+}
+
+/** 会话表完整可靠时返回会话表, 否则返回NULL */
+static session_table_t *session_table_complete(void)
+{
+	session_table_t *t = session_table_get();
+	if (t && *(volatile int *) &t->loaded && !*(volatile int *) &t->overflow)
+		return t;
+	return NULL;
+}
+
+static session_info_t *session_table_slot(session_id_t sid)
+{
+	return session_table_find(session_table_get(), sid);
+}
+
+/**
+ * 将会话加入共享内存会话表
+ * @param[in] sid 会话ID
+ * @param[in] user_id 用户ID
+ * @param[in] user_name 用户名
+ * @param[in] pid 进程号, web会话为0
+ * @param[in] ip_addr 来源地址
+ * @param[in] is_web 是否为web会话
+ * @param[in] visible 是否可见
+ * @return 成功返回true
+ */
+bool session_table_insert(session_id_t sid, user_id_t user_id,
+		const char *user_name, int pid, const char *ip_addr, bool is_web,
+		bool visible)
+{
+	session_table_t *t = session_table_get();
+	if (!t)
+		return false;
+	int flag = (is_web ? SESSION_FLAG_WEB : 0)
+			| (visible ? 0 : SESSION_FLAG_INVISIBLE);
+	if (_session_table_insert(t, sid, user_id, user_name, pid, ip_addr,
+			flag, fb_time()))
+		return true;
+	__sync_fetch_and_add(&t->overflow, 1);
+	return false;
+}
+
+static void session_table_remove(session_id_t sid)
+{
+	session_info_t *s = session_table_slot(sid);
+	if (s) {
+		user_id_t user_id = s->user_id;
+		int flag = s->flag;
+		if (__sync_bool_compare_and_swap(&s->id, sid, 0))
+			session_table_count(session_table, user_id, flag, -1);
+	}
+}
+
+/**
+ * 统计给定用户中在线的人数
+ * @param[in] uids 用户ID数组
+ * @param[in] count 数组长度
+ * @param[in] visible_only 是否只计入有可见会话的用户
+ * @return 在线人数, 会话表不可用时返回-1
+ */
+int session_count_online_users(const user_id_t *uids, int count,
+		bool visible_only)
+{
+	session_table_t *t = session_table_complete();
+	if (!t)
+		return -1;
+
+	const volatile uint16_t *map = visible_only ? t->visible : t->online;
+	int online = 0;
+	for (int i = 0; i < count; ++i) {
+		user_id_t uid = uids[i];
+		if (uid > 0 && uid < SESSION_TABLE_USERS && map[uid])
+			++online;
+	}
+	return online;
+}
+
+/** 拷贝槽位, 槽位为空或拷贝期间被改写时返回false */
+static bool session_table_copy(const session_info_t *s, session_info_t *copy)
+{
+	session_id_t sid = *(volatile const session_id_t *) &s->id;
+	if (sid <= 0)
+		return false;
+	__sync_synchronize();
+	memcpy(copy, s, sizeof(*copy));
+	__sync_synchronize();
+	return *(volatile const session_id_t *) &s->id == sid && copy->id == sid;
+}
+
+/**
+ * 会话是否为共享内存会话表中属于该用户的活动web会话
+ * 会话结束或失效时即从表中移除, 因此可用于校验无状态的会话凭据.
+ * @param[in] sid 会话ID
+ * @param[in] user_id 用户ID
+ * @return 是返回true, 不在表中(包括表不可用)返回false
+ */
+bool session_table_active(session_id_t sid, user_id_t user_id)
+{
+	session_info_t *s = session_table_slot(sid);
+	session_info_t copy;
+	return s && session_table_copy(s, &copy) && copy.user_id == user_id
+			&& (copy.flag & SESSION_FLAG_WEB);
+}
+
+static int session_list_append(session_info_t **list, int *size, int count,
+		const session_info_t *s)
+{
+	if (count >= *size) {
+		int new_size = *size ? *size * 2 : SESSION_LIST_INITIAL_SIZE;
+		session_info_t *l = realloc(*list, new_size * sizeof(**list));
+		if (!l)
+			return count;
+		*list = l;
+		*size = new_size;
+	}
+	(*list)[count] = *s;
+	return count + 1;
+}
+
+static int session_list_db(session_info_t **list, user_id_t user_id)
+{
+	query_t *q = query_new(0);
+	query_select(q, "id, user_id, user_name, pid, ip_addr, web, visible");
+	query_from(q, "sessions");
+	query_where(q, "active");
+	if (user_id)
+		query_and(q, "user_id = %"DBIdUID, user_id);
+	db_res_t *res = query_exec(q);
+	if (!res)
+		return -1;
+
+	int size = 0, count = 0;
+	for (int i = 0; i < db_res_rows(res); ++i) {
+		session_info_t s = {
+			.id = db_get_session_id(res, i, 0),
+			.user_id = db_get_user_id(res, i, 1),
+			.pid = db_get_integer(res, i, 3),
+			.flag = (db_get_bool(res, i, 5) ? SESSION_FLAG_WEB : 0)
+					| (db_get_bool(res, i, 6) ? 0 : SESSION_FLAG_INVISIBLE),
+		};
+		strlcpy(s.user_name, db_get_value(res, i, 2), sizeof(s.user_name));
+		strlcpy(s.ip_addr, db_get_value(res, i, 4), sizeof(s.ip_addr));
+		s.board = session_get_board(s.id);
+		s.idle = session_get_idle(s.id);
+		s.status = get_user_status(s.id);
+		count = session_list_append(list, &size, count, &s);
+	}
+	db_clear(res);
+	return count;
+}
+
+/**
+ * 获取在线会话列表
+ * 优先读取共享内存会话表, 不可用时回退到数据库.
+ * @param[out] list 会话数组, 由调用者free()
+ * @param[in] user_id 只列出该用户的会话, 0表示全部
+ * @return 会话数, 出错返回-1
+ */
+int session_list(session_info_t **list, user_id_t user_id)
+{
+	*list = NULL;
+
+	session_table_t *t = session_table_complete();
+	if (!t)
+		return session_list_db(list, user_id);
+
+	int size = 0, count = 0;
+	for (int i = 0; i < SESSION_TABLE_SLOTS; ++i) {
+		session_info_t s;
+		if (session_table_copy(t->slots + i, &s)
+				&& (!user_id || s.user_id == user_id))
+			count = session_list_append(list, &size, count, &s);
+	}
+	return count;
+}
+
 /** 在线人数 @mdb_string */
 #define ONLINE_COUNT_CACHE_KEY  "c:online"
 
 int session_count_online(void)
 {
+	session_table_t *t = session_table_complete();
+	if (t) {
+		int online = 0;
+		for (int i = 0; i < SESSION_TABLE_SLOTS; ++i) {
+			if (*(volatile session_id_t *) &t->slots[i].id > 0)
+				++online;
+		}
+		return online;
+	}
+
 	int cached = mdb_integer(-1, "GET", ONLINE_COUNT_CACHE_KEY);
 	if (cached >= 0)
 		return cached;
@@ -139,7 +516,9 @@ session_id_t session_new(const char *key, const char *token, session_id_t sid,
 	if (res) {
 		db_clear(res);
 		session.id = sid;
-		session_set_idle(sid, now);
+		if (!session_table_insert(sid, user_id, user_name, pid, ip_addr,
+					is_web, visible))
+			session_set_idle(sid, now);
 		return sid;
 	} else {
 		return session.id = 0;
@@ -155,6 +534,7 @@ session_id_t session_new(const char *key, const char *token, session_id_t sid,
 
 static void purge_session_cache(session_id_t sid)
 {
+	session_table_remove(sid);
 	mdb_cmd("ZREM", SESSION_BOARD_KEY" %"PRIdSID, sid);
 	mdb_cmd("ZREM", SESSION_IDLE_KEY" %"PRIdSID, sid);
 	mdb_cmd("HDEL", SESSION_STATUS_KEY" %"PRIdSID, sid);
@@ -185,6 +565,11 @@ int session_inactivate(session_id_t session_id, user_id_t user_id,
 
 int session_set_idle(session_id_t sid, fb_time_t t)
 {
+	session_info_t *s = session_table_slot(sid);
+	if (s) {
+		s->idle = t;
+		return 0;
+	}
 	return !mdb_cmd("ZADD", SESSION_IDLE_KEY" %"PRIdFBT" %"PRIdSID, t, sid);
 }
 
@@ -198,6 +583,9 @@ void session_set_idle_cached(void)
 
 fb_time_t session_get_idle(session_id_t sid)
 {
+	session_info_t *s = session_table_slot(sid);
+	if (s)
+		return *(volatile fb_time_t *) &s->idle;
 	return (fb_time_t) mdb_integer(0, "ZSCORE", SESSION_IDLE_KEY" %"PRIdSID,
 			sid);
 }
@@ -206,12 +594,19 @@ int session_set_board(int bid)
 {
 	if (!session.id)
 		return 0;
+	session_info_t *s = session_table_slot(session.id);
+	if (s)
+		s->board = bid;
+	// 按版面计数仍依赖redis中的有序集合
 	return !mdb_cmd("ZADD", SESSION_BOARD_KEY" %d %"PRIdSID, bid,
 			session.id);
 }
 
 int session_get_board(session_id_t sid)
 {
+	session_info_t *s = session_table_slot(sid);
+	if (s)
+		return *(volatile int *) &s->board;
 	return (int) mdb_integer(0, "ZSCORE", SESSION_BOARD_KEY" %"PRIdSID, sid);
 }
 
@@ -220,15 +615,59 @@ int session_count_online_board(int bid)
 	return (int) mdb_integer(0, "ZCOUNT", SESSION_BOARD_KEY" %d %d", bid, bid);
 }
 
+/**
+ * 统计各版面的在线会话数
+ * @param[out] counts counts[bid]累加版面bid上的会话数, 由调用者清零
+ * @param[in] size counts的长度
+ * @return 成功返回0, 否则-1
+ */
+int session_count_online_boards(int *counts, int size)
+{
+	session_table_t *t = session_table_complete();
+	if (t) {
+		for (int i = 0; i < SESSION_TABLE_SLOTS; ++i) {
+			const session_info_t *s = t->slots + i;
+			if (*(volatile const session_id_t *) &s->id <= 0)
+				continue;
+			int bid = *(volatile const int *) &s->board;
+			if (bid > 0 && bid < size)
+				++counts[bid];
+		}
+		return 0;
+	}
+
+	mdb_res_t *res = mdb_res("ZRANGE", SESSION_BOARD_KEY" 0 -1 WITHSCORES");
+	if (!res)
+		return -1;
+	for (int i = 1; ; i += 2) {
+		const char *score = mdb_string(mdb_res_at(res, i));
+		if (!score)
+			break;
+		int bid = strtol(score, NULL, 10);
+		if (bid > 0 && bid < size)
+			++counts[bid];
+	}
+	mdb_clear(res);
+	return 0;
+}
+
 int set_user_status(int status)
 {
 	session.status = status;
+	session_info_t *s = session_table_slot(session.id);
+	if (s) {
+		s->status = status;
+		return 0;
+	}
 	return !mdb_cmd("HSET", SESSION_STATUS_KEY" %"PRIdSID" %d", session.id,
 			status);
 }
 
 session_status_e get_user_status(session_id_t sid)
 {
+	session_info_t *s = session_table_slot(sid);
+	if (s)
+		return *(volatile int *) &s->status;
 	return mdb_integer(0, "HGET", SESSION_STATUS_KEY" %"PRIdSID, sid);
 }
 
@@ -237,8 +676,17 @@ bool session_toggle_visibility(void)
 	db_res_t *res = db_cmd("UPDATE sessions SET visible = %b"
 			" WHERE id = %"DBIdSID, !session.visible, session.id);
 	db_clear(res);
-	if (res)
+	if (res) {
 		session.visible = !session.visible;
+		session_info_t *s = session_table_slot(session.id);
+		if (s) {
+			__sync_fetch_and_xor(&s->flag, SESSION_FLAG_INVISIBLE);
+			if (s->user_id > 0 && s->user_id < SESSION_TABLE_USERS) {
+				__sync_fetch_and_add(session_table->visible + s->user_id,
+						session.visible ? 1 : -1);
+			}
+		}
+	}
 	return session.visible;
 }
 
@@ -280,13 +728,30 @@ static session_basic_info_t *basic_sessions_of_follows(void)
 
 int session_count_online_followed(bool visible_only)
 {
-	static time_t uptime = 0;
-	static int count = 0;
+	user_id_t *follows;
+	int following = follow_graph_following(session.user_id, &follows);
+	if (following >= 0) {
+		int online = session_count_online_users(follows, following,
+				visible_only);
+		free(follows);
+		if (online >= 0)
+			return online;
+	}
+
+	// 缓存属于某个用户, web线程会轮流服务不同的用户
+	static FB_THREAD_LOCAL time_t uptime = 0;
+	static FB_THREAD_LOCAL int count = 0;
+	static FB_THREAD_LOCAL user_id_t cached_user_id = 0;
+	static FB_THREAD_LOCAL bool cached_visible_only = false;
 
 	time_t now = time(NULL);
-	if (now <= uptime + ONLINE_FOLLOWS_COUNT_REFRESH_INTERVAL)
+	if (cached_user_id == session.user_id
+			&& cached_visible_only == visible_only
+			&& now <= uptime + ONLINE_FOLLOWS_COUNT_REFRESH_INTERVAL)
 		return count;
 	uptime = now;
+	cached_user_id = session.user_id;
+	cached_visible_only = visible_only;
 
 	session_basic_info_t *s = basic_sessions_of_follows();
 	if (s) {
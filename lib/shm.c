@@ -1,5 +1,6 @@
 // Functions to attach or remove shared memory segements.
 
+#include <sched.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include "bbs.h"
@@ -18,7 +19,11 @@ const static struct _shmkey shmkeys[] = {
 	{ "UTMP_SHMKEY", 30020 }, { "ACBOARD_SHMKEY", 30030 },
 	{ "ISSUE_SHMKEY", 30040 }, { "GOODBYE_SHMKEY", 30050 },
 	{ "WELCOME_SHMKEY", 30060 }, { "STAT_SHMKEY", 30070 },
-	{ "ACACHE_SHMKEY", 30005 }, { "", 0 }
+	{ "ACACHE_SHMKEY", 30005 }, { "SESSION_SHMKEY", 30080 },
+	{ "FOLLOW_SHMKEY", 30090 }, { "MSGRING_SHMKEY", 30100 },
+	{ "BRDMETA_SHMKEY", 30110 }, { "BRDSTAT_SHMKEY", 30120 },
+	{ "WEBCACHE_SHMKEY", 30130 }, { "HOTTOPIC_SHMKEY", 30140 },
+	{ "", 0 }
 };
 
 // Prints error message.
@@ -137,6 +142,31 @@ void *attach_shm2(const char *shmstr, int defaultkey, int shmsize, int *iscreate
 	return shmptr;
 }
 
+// Does the same to attach_shm2(), but only once per process.
+// The first caller attaches and publishes the address in 'once';
+// concurrent callers (threads) wait until it is published, so none of
+// them sees NULL while the segment is being attached.
+// 'iscreate' is set to 1 only for the caller that created the segment.
+void *attach_shm_once(shm_once_t *once, const char *shmstr, int defaultkey,
+		int shmsize, int *iscreate)
+{
+	*iscreate = 0;
+	if (*(volatile int *) &once->state == 2)
+		return once->ptr;
+
+	if (__sync_bool_compare_and_swap(&once->state, 0, 1)) {
+		once->ptr = attach_shm2(shmstr, defaultkey, shmsize, iscreate);
+		__sync_synchronize();
+		once->state = 2;
+		return once->ptr;
+	}
+
+	while (*(volatile int *) &once->state != 2)
+		sched_yield();
+	__sync_synchronize();
+	return once->ptr;
+}
+
 // Finds shared memory key corresponding to 'shmstr'.
 // If not found, uses defaultkey instead.
 // Then mark the segment to be destroyed.
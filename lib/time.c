@@ -1,16 +1,19 @@
 #include <stdio.h>
 #include "fbbs/time.h"
+#include "fbbs/util.h"
 
 struct tm *fb_localtime(const fb_time_t *t)
 {
+	static FB_THREAD_LOCAL struct tm tm;
 	time_t tt = (time_t)*t;
-	return localtime(&tt);
+	return localtime_r(&tt, &tm);
 }
 
 const char *fb_ctime(const fb_time_t *t)
 {
+	static FB_THREAD_LOCAL char str[26];
 	time_t tt = (time_t)*t;
-	return ctime(&tt);
+	return ctime_r(&tt, str);
 }
 
 /**
@@ -29,7 +32,7 @@ char *format_time(fb_time_t time, time_format_e fmt)
 	const char *utf8_weeknum[] = {
 		"天", "一", "二", "三", "四", "五", "六"
 	};
-	static char str[36] = { '\0' };
+	static FB_THREAD_LOCAL char str[36] = { '\0' };
 
 	struct tm *t = fb_localtime(&time);
 	switch (fmt) {
@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "bbs.h"
+#include "fbbs/log.h"
+#include "fbbs/post.h"
+#include "fbbs/string.h"
+
+/**
+ * @defgroup hot_topic 热门话题
+ *
+ * 发文时由后端更新共享内存中的主题热度, 网页直接读取排名, 不再定期扫描数据库.
+ *
+ * 热度按半衰期指数衰减. 由于所有主题衰减速率相同, 相对大小只在发文时改变,
+ * 因此保存的是折算到基准时刻的热度, 排名也只需在发文时重新计算.
+ * 同一作者在同一主题的后续发文只计部分热度. 共享内存新建时从最近24小时的文章恢复.
+ */
+/** @{ */
+
+enum {
+	HOT_TOPIC_SHMKEY = 30140,
+	HOT_TOPIC_THREADS = 2048, ///< 跟踪的主题数
+	HOT_TOPIC_PROBES = 16, ///< 散列表探测长度
+	HOT_TOPIC_AUTHORS = 16, ///< 每个主题记录的不同作者数
+	HOT_TOPIC_HALF_LIFE = 6 * 60 * 60,
+	HOT_TOPIC_REBASE = 30 * 24 * 60 * 60, ///< 重设基准时刻的间隔
+	HOT_TOPIC_WINDOW = 24 * 60 * 60, ///< 超过此时间无新文章的主题不参与排名
+	HOT_TOPIC_HOUR = 60 * 60,
+	HOT_TOPIC_HOURS = HOT_TOPIC_WINDOW / HOT_TOPIC_HOUR,
+	HOT_TOPIC_LIMIT = 10,
+	HOT_TOPIC_BOARD_QUOTA = 1, ///< 每个版面最多上榜的主题数
+	HOT_TOPIC_RETRY = 8,
+};
+
+/** 已删除主题的tid, 探测时跳过, 插入时可复用 */
+#define HOT_TOPIC_REMOVED  ((post_id_t) -1)
+
+#define HOT_TOPIC_NEW_AUTHOR  1.0
+#define HOT_TOPIC_SAME_AUTHOR  0.25
+
+typedef struct {
+	topic_stat_t stat; ///< count不使用, 读取时由hourly算出
+	fb_time_t hour; ///< hourly[0]对应的小时
+	uint16_t hourly[HOT_TOPIC_HOURS]; ///< 每小时的文章数, 由近及远
+} hot_topic_entry_t;
+
+typedef struct {
+	hot_topic_entry_t entry;
+	double score; ///< 折算到基准时刻的热度
+	int authors; ///< 已记录的作者数
+	user_id_t author[HOT_TOPIC_AUTHORS];
+} hot_thread_t;
+
+typedef struct {
+	pid_t lock; ///< 持有写锁的进程
+	uint32_t seq; ///< 更新排名时为奇数
+	fb_time_t base; ///< 热度基准时刻
+	int count; ///< 排名中的主题数
+	hot_topic_entry_t ranking[HOT_TOPIC_LIMIT];
+	double scores[HOT_TOPIC_LIMIT]; ///< 上榜主题的热度, 仅写者使用
+	hot_thread_t threads[HOT_TOPIC_THREADS];
+} hot_topic_table_t;
+
+static void hot_topic_seed(hot_topic_table_t *t);
+
+static hot_topic_table_t *hot_topic_table(void)
+{
+	static shm_once_t once;
+	int created;
+	hot_topic_table_t *t = attach_shm_once(&once, "HOTTOPIC_SHMKEY",
+			HOT_TOPIC_SHMKEY, sizeof(hot_topic_table_t), &created);
+	if (t && created)
+		hot_topic_seed(t);
+	return t;
+}
+
+static void hot_topic_lock(hot_topic_table_t *t)
+{
+	pid_t pid = getpid();
+	while (true) {
+		pid_t holder = __sync_val_compare_and_swap(&t->lock, 0, pid);
+		if (!holder)
+			return;
+		if (holder != pid && kill(holder, 0) < 0 && errno == ESRCH
+				&& __sync_bool_compare_and_swap(&t->lock, holder, pid)) {
+			// 热度和计数至多差一篇文章, 只需修正排名的序号
+			log_internal_err("hot topic: lock holder %d died", holder);
+			if (t->seq & 1)
+				__sync_add_and_fetch(&t->seq, 1);
+			return;
+		}
+		sched_yield();
+	}
+}
+
+static void hot_topic_unlock(hot_topic_table_t *t)
+{
+	__sync_lock_release(&t->lock);
+}
+
+/**
+ * 热门话题是否排除该版面的文章
+ * @param[in] board 版面
+ * @return 目录, 只读, 不计文章数, 有权限限制或读限制俱乐部的版面返回true
+ */
+bool hot_topic_excluded(const board_t *board)
+{
+	return board->perm || (board->flag & (BOARD_FLAG_DIR | BOARD_FLAG_POST
+			| BOARD_FLAG_JUNK | BOARD_FLAG_READ));
+}
+
+static hot_thread_t *hot_topic_find(hot_topic_table_t *t, post_id_t tid)
+{
+	int start = tid % HOT_TOPIC_THREADS;
+	for (int i = 0; i < HOT_TOPIC_PROBES; ++i) {
+		hot_thread_t *h = t->threads + (start + i) % HOT_TOPIC_THREADS;
+		if (h->entry.stat.tid == tid)
+			return h;
+		if (!h->entry.stat.tid)
+			break;
+	}
+	return NULL;
+}
+
+/** 找到空位, 或替换探测范围内热度最低的主题 */
+static hot_thread_t *hot_topic_slot(hot_topic_table_t *t, post_id_t tid)
+{
+	int start = tid % HOT_TOPIC_THREADS;
+	hot_thread_t *victim = NULL;
+	for (int i = 0; i < HOT_TOPIC_PROBES; ++i) {
+		hot_thread_t *h = t->threads + (start + i) % HOT_TOPIC_THREADS;
+		if (h->entry.stat.tid <= 0)
+			return h;
+		if (!victim || h->score < victim->score)
+			victim = h;
+	}
+	return victim;
+}
+
+/** 基准时刻过旧时整体折算, 以免热度溢出 */
+static void hot_topic_rebase(hot_topic_table_t *t, fb_time_t now)
+{
+	if (!t->base) {
+		t->base = now;
+		return;
+	}
+	if (now - t->base < HOT_TOPIC_REBASE)
+		return;
+	double factor = exp2(-(double) (now - t->base) / HOT_TOPIC_HALF_LIFE);
+	for (int i = 0; i < HOT_TOPIC_THREADS; ++i)
+		t->threads[i].score *= factor;
+	t->base = now;
+}
+
+/** 作者首次在该主题发文时记录并返回true */
+static bool hot_topic_add_author(hot_thread_t *h, user_id_t uid)
+{
+	for (int i = 0; i < h->authors; ++i) {
+		if (h->author[i] == uid)
+			return false;
+	}
+	if (h->authors < HOT_TOPIC_AUTHORS)
+		h->author[h->authors++] = uid;
+	return true;
+}
+
+/** 将文章计入所在小时 */
+static void hot_topic_count_post(hot_topic_entry_t *e, fb_time_t stamp)
+{
+	fb_time_t hour = stamp / HOT_TOPIC_HOUR;
+	if (hour > e->hour) {
+		fb_time_t shift = hour - e->hour;
+		if (shift >= HOT_TOPIC_HOURS) {
+			memset(e->hourly, 0, sizeof(e->hourly));
+		} else {
+			memmove(e->hourly + shift, e->hourly,
+					sizeof(*e->hourly) * (HOT_TOPIC_HOURS - shift));
+			memset(e->hourly, 0, sizeof(*e->hourly) * shift);
+		}
+		e->hour = hour;
+	}
+	fb_time_t i = e->hour - hour;
+	if (i < HOT_TOPIC_HOURS && e->hourly[i] < UINT16_MAX)
+		++e->hourly[i];
+}
+
+/** 最近24小时内的文章数 */
+static uint_t hot_topic_count(const hot_topic_entry_t *e, fb_time_t now)
+{
+	fb_time_t age = now / HOT_TOPIC_HOUR - e->hour;
+	if (age < 0)
+		age = 0;
+	uint_t count = 0;
+	for (fb_time_t i = 0; i < HOT_TOPIC_HOURS - age; ++i)
+		count += e->hourly[i];
+	return count;
+}
+
+static int hot_topic_cmp(const void *l, const void *r)
+{
+	const hot_thread_t *a = *(const hot_thread_t * const *) l;
+	const hot_thread_t *b = *(const hot_thread_t * const *) r;
+	if (a->score != b->score)
+		return a->score < b->score ? 1 : -1;
+	if (a->entry.stat.last != b->entry.stat.last)
+		return a->entry.stat.last < b->entry.stat.last ? 1 : -1;
+	return 0;
+}
+
+/** 按热度重新生成排名, 每个版面最多HOT_TOPIC_BOARD_QUOTA个主题 */
+static void hot_topic_rank(hot_topic_table_t *t, fb_time_t expire)
+{
+	hot_thread_t *sorted[HOT_TOPIC_THREADS];
+	int n = 0;
+	for (int i = 0; i < HOT_TOPIC_THREADS; ++i) {
+		const topic_stat_t *stat = &t->threads[i].entry.stat;
+		if (stat->tid > 0 && stat->last >= expire)
+			sorted[n++] = t->threads + i;
+	}
+	qsort(sorted, n, sizeof(*sorted), hot_topic_cmp);
+
+	hot_topic_entry_t ranking[HOT_TOPIC_LIMIT];
+	int count = 0;
+	for (int i = 0; i < n && count < HOT_TOPIC_LIMIT; ++i) {
+		int quota = 0;
+		for (int j = 0; j < count; ++j) {
+			if (ranking[j].stat.bid == sorted[i]->entry.stat.bid)
+				++quota;
+		}
+		if (quota < HOT_TOPIC_BOARD_QUOTA) {
+			t->scores[count] = sorted[i]->score;
+			ranking[count++] = sorted[i]->entry;
+		}
+	}
+
+	__sync_add_and_fetch(&t->seq, 1);
+	memcpy(t->ranking, ranking, sizeof(*ranking) * count);
+	t->count = count;
+	__sync_add_and_fetch(&t->seq, 1);
+}
+
+/** 记录一篇文章, 须持有写锁. 返回排名是否可能改变 */
+static bool hot_topic_add(hot_topic_table_t *t, const topic_stat_t *topic,
+		user_id_t author)
+{
+	hot_topic_rebase(t, topic->last);
+
+	hot_thread_t *h = hot_topic_find(t, topic->tid);
+	if (!h && *topic->utf8_title) {
+		h = hot_topic_slot(t, topic->tid);
+		memset(h, 0, sizeof(*h));
+		h->entry.stat = *topic;
+		h->entry.stat.count = 0;
+	}
+	if (!h)
+		return false;
+
+	double weight = hot_topic_add_author(h, author)
+			? HOT_TOPIC_NEW_AUTHOR : HOT_TOPIC_SAME_AUTHOR;
+	h->score += weight
+			* exp2((double) (topic->last - t->base) / HOT_TOPIC_HALF_LIFE);
+	hot_topic_count_post(&h->entry, topic->last);
+	if (topic->last > h->entry.stat.last)
+		h->entry.stat.last = topic->last;
+
+	// 榜上没有过期主题时, 未上榜且热度不超过榜尾的主题不影响排名
+	fb_time_t expire = topic->last - HOT_TOPIC_WINDOW;
+	bool rank = t->count < HOT_TOPIC_LIMIT
+			|| h->score >= t->scores[t->count - 1];
+	for (int i = 0; i < t->count && !rank; ++i) {
+		rank = t->ranking[i].stat.tid == h->entry.stat.tid
+				|| t->ranking[i].stat.last < expire;
+	}
+	return rank;
+}
+
+/** 新建的共享内存从最近24小时的文章恢复 */
+static void hot_topic_seed(hot_topic_table_t *t)
+{
+	fb_time_t now = fb_time();
+	db_res_t *res = db_query("SELECT p.thread_id, p.board_id, p.real_user_id,"
+			" p.id, t.user_name, t.title"
+			" FROM post.recent p JOIN post.recent t ON t.id = p.thread_id"
+			" WHERE p.id >= %"DBIdPID" ORDER BY p.id",
+			post_id_from_stamp(now - HOT_TOPIC_WINDOW));
+	if (!res)
+		return;
+
+	hot_topic_lock(t);
+	board_t board = { .id = 0 };
+	for (int i = 0, rows = db_res_rows(res); i < rows; ++i) {
+		int bid = db_get_integer(res, i, 1);
+		if (bid != board.id && !get_board_by_bid(bid, &board)) {
+			board.id = 0;
+			continue;
+		}
+		if (hot_topic_excluded(&board))
+			continue;
+
+		topic_stat_t topic = {
+			.tid = db_get_post_id(res, i, 0),
+			.last = post_stamp(db_get_post_id(res, i, 3)),
+			.bid = bid,
+		};
+		strlcpy(topic.bname, board.name, sizeof(topic.bname));
+		strlcpy(topic.owner, db_get_value(res, i, 4), sizeof(topic.owner));
+		strlcpy(topic.utf8_title, db_get_value(res, i, 5),
+				sizeof(topic.utf8_title));
+		hot_topic_add(t, &topic, db_get_user_id(res, i, 2));
+	}
+	hot_topic_rank(t, now - HOT_TOPIC_WINDOW);
+	hot_topic_unlock(t);
+	db_clear(res);
+}
+
+/**
+ * 主题是否已在热度表中
+ * 不在时, 回帖者应先取得主题的标题和作者再调用hot_topic_update().
+ * @param[in] tid 主题ID
+ * @return 已在表中返回true
+ */
+bool hot_topic_tracked(post_id_t tid)
+{
+	hot_topic_table_t *t = hot_topic_table();
+	if (!t)
+		return false;
+	for (int i = 0; i < HOT_TOPIC_PROBES; ++i) {
+		const hot_thread_t *h =
+				t->threads + (tid % HOT_TOPIC_THREADS + i) % HOT_TOPIC_THREADS;
+		post_id_t id = *(volatile post_id_t *) &h->entry.stat.tid;
+		if (id == tid)
+			return true;
+		if (!id)
+			break;
+	}
+	return false;
+}
+
+/**
+ * 记录一篇新文章
+ * @param[in] topic 主题信息, 需填写tid, last, bid, bname; 主题不在表中时
+ *                  还需填写标题和作者
+ * @param[in] author 发文者ID, 用于区分不同作者
+ */
+void hot_topic_update(const topic_stat_t *topic, user_id_t author)
+{
+	hot_topic_table_t *t = hot_topic_table();
+	if (!t)
+		return;
+
+	hot_topic_lock(t);
+	if (hot_topic_add(t, topic, author))
+		hot_topic_rank(t, topic->last - HOT_TOPIC_WINDOW);
+	hot_topic_unlock(t);
+}
+
+/** 移除满足条件的主题并重新排名 */
+static void hot_topic_remove_if(bool (*match)(const topic_stat_t *, int64_t),
+		int64_t arg)
+{
+	hot_topic_table_t *t = hot_topic_table();
+	if (!t)
+		return;
+
+	hot_topic_lock(t);
+	bool removed = false;
+	for (int i = 0; i < HOT_TOPIC_THREADS; ++i) {
+		hot_thread_t *h = t->threads + i;
+		if (h->entry.stat.tid > 0 && match(&h->entry.stat, arg)) {
+			memset(h, 0, sizeof(*h));
+			h->entry.stat.tid = HOT_TOPIC_REMOVED;
+			removed = true;
+		}
+	}
+	if (removed)
+		hot_topic_rank(t, fb_time() - HOT_TOPIC_WINDOW);
+	hot_topic_unlock(t);
+}
+
+static bool hot_topic_match_thread(const topic_stat_t *stat, int64_t tid)
+{
+	return stat->tid == tid;
+}
+
+static bool hot_topic_match_board(const topic_stat_t *stat, int64_t bid)
+{
+	return stat->bid == bid;
+}
+
+/**
+ * 主题被删除时将其移出热门话题
+ * @param[in] tid 主题ID
+ */
+void hot_topic_remove(post_id_t tid)
+{
+	hot_topic_remove_if(hot_topic_match_thread, tid);
+}
+
+/**
+ * 版面属性修改后, 移除不再统计的版面的主题
+ * @param[in] board 修改后的版面
+ */
+void hot_topic_board_changed(const board_t *board)
+{
+	if (hot_topic_excluded(board))
+		hot_topic_remove_if(hot_topic_match_board, board->id);
+}
+
+/**
+ * 读取热门话题
+ * @param[out] topics 热门话题
+ * @param[in] max 最多读取的个数
+ * @return 读取的个数
+ */
+int hot_topic_get(topic_stat_t *topics, int max)
+{
+	hot_topic_table_t *t = hot_topic_table();
+	if (!t)
+		return 0;
+
+	hot_topic_entry_t ranking[HOT_TOPIC_LIMIT];
+	int count = 0;
+	for (int i = 0; i < HOT_TOPIC_RETRY; ++i) {
+		uint32_t seq = *(volatile uint32_t *) &t->seq;
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		count = t->count;
+		if (count < 0 || count > HOT_TOPIC_LIMIT)
+			count = 0;
+		memcpy(ranking, t->ranking, sizeof(*ranking) * count);
+		__sync_synchronize();
+		if (*(volatile uint32_t *) &t->seq == seq)
+			break;
+		count = 0;
+	}
+
+	fb_time_t now = fb_time(), expire = now - HOT_TOPIC_WINDOW;
+	int n = 0;
+	for (int i = 0; i < count && n < max; ++i) {
+		if (ranking[i].stat.last >= expire) {
+			topics[n] = ranking[i].stat;
+			topics[n++].count = hot_topic_count(ranking + i, now);
+		}
+	}
+	return n;
+}
+/** @} */
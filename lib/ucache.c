@@ -1,10 +1,12 @@
 // Handle user cache.
 
 #include "bbs.h"
+#include <sched.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <stdio.h>
 #include <time.h>
+#include "mmap.h"
 #include "record.h"
 
 #include "fbbs/dbi.h"
@@ -25,7 +27,7 @@ enum {
 // The starting address of cache for all users.
 struct UCACHE *uidshm = NULL;
 // A global variable to hold result when searching users.
-struct userec lookupuser;
+FB_THREAD_LOCAL struct userec lookupuser;
 
 int cmpuids(const void *uid, const void *up)
 {
@@ -47,63 +49,245 @@ int dosearchuser(const char *userid, struct userec *user, int *unum)
 	return *unum = 0;
 }
 
-// Returns hashkey of 'userid'.
-// The hashkey is the sum of ASCII codes of the third to the last letter
-// in uppercase.
-// a1 is 0~25 (A-Z or a-z respectively) for the first letter.
-// a2 is 0~25 (A-Z or a-z respectively) for the second letter.
-int uhashkey(const char *userid, int *a1, int *a2)
+enum {
+	UINDEX_SLOTS = ARRAY_SIZE(((struct UCACHE *) NULL)->index),
+	UINDEX_TOMBSTONE = -1,
+};
+
+/*
+ * The user name index is an open addressing table in UCACHE.
+ * Each entry packs the case-folded hash of a name (high 32 bits) and the
+ * user's place in the cache (low 32 bits) into one word, so lookups read
+ * it atomically without a lock and compare the stored hash before touching
+ * 'userid'. Writers hold the ucache lock, except for deletion and renaming
+ * which only need an atomic swap of the entry.
+ */
+#define uindex_entry(hash, num)  (((uint64_t)(hash) << 32) | (uint32_t)(num))
+#define uindex_hash(entry)  ((uint32_t)((entry) >> 32))
+#define uindex_num(entry)  ((int32_t)(uint32_t)(entry))
+
+// Returns the case-insensitive FNV-1a hash of 'userid'.
+static uint32_t uhash(const char *userid)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *c = userid; *c != '\0'; ++c) {
+		hash ^= (unsigned char) toupper(*c);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Probes the whole chain for the entry before reusing the first free slot,
+// so a tombstone in front of an existing entry does not duplicate it.
+static void uindex_insert(const char *userid, int num)
+{
+	uint32_t hash = uhash(userid);
+	uint64_t entry = uindex_entry(hash, num);
+	while (true) {
+		int pos = hash % UINDEX_SLOTS, free_pos = -1;
+		uint64_t free_entry = 0;
+		for (int i = 0; i < UINDEX_SLOTS; ++i) {
+			uint64_t e = *(volatile uint64_t *) (uidshm->index + pos);
+			int n = uindex_num(e);
+			if (n == num && uindex_hash(e) == hash)
+				return;
+			if ((n == 0 || n == UINDEX_TOMBSTONE) && free_pos < 0) {
+				free_pos = pos;
+				free_entry = e;
+			}
+			if (n == 0)
+				break;
+			if (++pos == UINDEX_SLOTS)
+				pos = 0;
+		}
+		if (free_pos < 0)
+			return;
+		// a concurrent removal or rename changed the slot, probe again
+		if (__sync_bool_compare_and_swap(uidshm->index + free_pos,
+					free_entry, entry))
+			return;
+	}
+}
+
+static bool uindex_remove(const char *userid, int num)
+{
+	uint32_t hash = uhash(userid);
+	int pos = hash % UINDEX_SLOTS;
+	for (int i = 0; i < UINDEX_SLOTS; ++i) {
+		uint64_t e = *(volatile uint64_t *) (uidshm->index + pos);
+		int n = uindex_num(e);
+		if (n == 0)
+			return false;
+		if (n == num && uindex_hash(e) == hash) {
+			return __sync_bool_compare_and_swap(uidshm->index + pos, e,
+					uindex_entry(0, UINDEX_TOMBSTONE));
+		}
+		if (++pos == UINDEX_SLOTS)
+			pos = 0;
+	}
+	return false;
+}
+
+/*
+ * 'sorted' lists the occupied places in 'userid' ordered by case-folded
+ * name, so names with a given prefix form a range found by binary search.
+ * Writers make 'sorted_seq' odd while shifting the array; readers retry if
+ * it was odd or changed while they copied a range.
+ */
+static void usorted_lock(void)
+{
+	while (true) {
+		int seq = *(volatile int *) &uidshm->sorted_seq;
+		if (!(seq & 1) && __sync_bool_compare_and_swap(&uidshm->sorted_seq,
+					seq, seq + 1))
+			break;
+		sched_yield();
+	}
+}
+
+static void usorted_unlock(void)
+{
+	__sync_add_and_fetch(&uidshm->sorted_seq, 1);
+}
+
+static const char *usorted_name(int pos)
 {
-	const char *c = userid;
-	int key = 0;
+	int num = uidshm->sorted[pos];
+	if (num <= 0 || num > MAXUSERS)
+		return "";
+	return uidshm->userid[num - 1];
+}
+
+// Returns the first position whose name is not less than 'name'.
+// Only the first 'len' characters are compared if 'len' is not 0.
+static int usorted_lower_bound(const char *name, size_t len)
+{
+	int lo = 0, hi = uidshm->sorted_count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		const char *s = usorted_name(mid);
+		if ((len ? strncasecmp(s, name, len) : strcasecmp(s, name)) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Returns the first position whose first 'len' characters are greater
+// than 'prefix'.
+static int usorted_upper_bound(const char *prefix, size_t len)
+{
+	int lo = 0, hi = uidshm->sorted_count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (strncasecmp(usorted_name(mid), prefix, len) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void usorted_insert(int num)
+{
+	usorted_lock();
+	int count = uidshm->sorted_count;
+	if (count < MAXUSERS) {
+		int pos = usorted_lower_bound(uidshm->userid[num - 1], 0);
+		memmove(uidshm->sorted + pos + 1, uidshm->sorted + pos,
+				sizeof(*uidshm->sorted) * (count - pos));
+		uidshm->sorted[pos] = num;
+		uidshm->sorted_count = count + 1;
+	}
+	usorted_unlock();
+}
 
-	if (*c >= 'a' && *c <= 'z') {
-		*a1 = *c - 'a';
-	} else if ( *c >= 'A' && *c <= 'Z') {
-		*a1 = *c - 'A';
-	} else {
-		*a1 = 0;
+// Must be called before 'userid' of 'num' is changed.
+static void usorted_remove(int num)
+{
+	usorted_lock();
+	int count = uidshm->sorted_count;
+	int pos = usorted_lower_bound(uidshm->userid[num - 1], 0);
+	if (pos >= count || uidshm->sorted[pos] != num) {
+		for (pos = 0; pos < count && uidshm->sorted[pos] != num; ++pos)
+			;
 	}
-	c++;
-
-	if ( *c >= 'a' && *c <= 'z') {
-		*a2 = *c - 'a';
-	} else if ( *c >= 'A' && *c <= 'Z') {
-		*a2 = *c - 'A';
-	} else {
-		*a2 = 0;
+	if (pos < count) {
+		memmove(uidshm->sorted + pos, uidshm->sorted + pos + 1,
+				sizeof(*uidshm->sorted) * (count - pos - 1));
+		uidshm->sorted_count = count - 1;
 	}
-	c++;
+	usorted_unlock();
+}
+
+static int usorted_cmp(const void *n1, const void *n2)
+{
+	return strcasecmp(uidshm->userid[*(const int *) n1 - 1],
+			uidshm->userid[*(const int *) n2 - 1]);
+}
 
-	while (*c != '\0') {
-		key += toupper(*c);
-		c++;
+static void usorted_build(void)
+{
+	usorted_lock();
+	int count = 0;
+	for (int i = 0; i < MAXUSERS; ++i) {
+		if (uidshm->userid[i][0] != '\0')
+			uidshm->sorted[count++] = i + 1;
+	}
+	qsort(uidshm->sorted, count, sizeof(*uidshm->sorted), usorted_cmp);
+	uidshm->sorted_count = count;
+	usorted_unlock();
+}
+
+/**
+ * Find user names starting with a prefix, case-insensitively.
+ * @param[in] prefix the prefix.
+ * @param[in,out] names array of names in cache, grown by realloc().
+ * @param[in,out] size capacity of the array.
+ * @return number of names found, in case-insensitive order.
+ */
+int ucache_prefix_search(const char *prefix, const char ***names, int *size)
+{
+	if (resolve_ucache() == -1)
+		return 0;
+
+	size_t len = strlen(prefix);
+	while (true) {
+		int seq = *(volatile int *) &uidshm->sorted_seq;
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+
+		int begin = len ? usorted_lower_bound(prefix, len) : 0;
+		int end = len ? usorted_upper_bound(prefix, len)
+				: uidshm->sorted_count;
+		int count = end > begin ? end - begin : 0;
+		if (count > *size) {
+			const char **n = realloc(*names, sizeof(*n) * count);
+			if (!n)
+				return 0;
+			*names = n;
+			*size = count;
+		}
+		for (int i = 0; i < count; ++i)
+			(*names)[i] = usorted_name(begin + i);
+
+		__sync_synchronize();
+		if (*(volatile int *) &uidshm->sorted_seq == seq)
+			return count;
 	}
-	return key % 256;
 }
 
 // Put userid(in struct uentp) into cache for all users.
-// Find a proper entry of user hash.
 static int fillucache(const struct userec *uentp, int count)
 {
-	int a1, a2;
-	int key;
-
 	if (count < MAXUSERS) {
 		strlcpy(uidshm->userid[count++], uentp->userid, sizeof(uidshm->userid[0]));
 		if(uentp->userid[0] != '\0') {
-			key = uhashkey(uentp->userid, &a1, &a2);
-			if (uidshm->hash[a1][a2][key] == 0) {
-				// If the hash entry is empty, put 'count' in it.
-				uidshm->hash[a1][a2][key] = count;
-			} else {
-				// Put 'count' into the doubly linked list.
-				int i = uidshm->hash[a1][a2][key];
-				while (uidshm->next[i - 1] != 0)
-					i = uidshm->next[i - 1];
-				uidshm->next[i - 1] = count;
-				uidshm->prev[count - 1] = i;
-			}
+			uindex_insert(uentp->userid, count);
 			return 1;
 		}
 	}
@@ -113,39 +297,13 @@ static int fillucache(const struct userec *uentp, int count)
 /* hash 删除 */
 int del_uidshm(int num, char *userid)
 {
-	int a1, a2;
-	int key;
-	int i;
-
 	if (num <= 0 || num > MAXUSERS)
 		return 0;
 
-	key = uhashkey(userid, &a1, &a2);
-	i=uidshm->hash[a1][a2][key];
-	if (i<=0)
-		return 0;
-	for (; i!=num && i>0; i=uidshm->next[i-1])
-		;
-	if (i!= num || i<=0)
+	if (!uindex_remove(userid, num))
 		return 0;
-	if (uidshm->next[i-1]) {
-		if (uidshm->prev[i-1]) {
-			uidshm->next[ uidshm->prev[i-1]-1 ] = uidshm->next[i-1];
-			uidshm->prev[ uidshm->next[i-1]-1 ] = uidshm->prev[i-1];
-		} else {
-			uidshm->hash[a1][a2][key] = uidshm->next[i-1];
-			uidshm->prev[ uidshm->next[i-1]-1 ] = 0;
-		}
-	} else {
-		if (uidshm->prev[i-1]) {
-			uidshm->next[ uidshm->prev[i-1]-1 ] = 0;
-		} else {
-			uidshm->hash[a1][a2][key] = 0;
-		}
-	}
-	uidshm->next[i-1]=0;
-	uidshm->prev[i-1]=0;
-	uidshm->userid[i-1][0]='\0';
+	usorted_remove(num);
+	uidshm->userid[num - 1][0] = '\0';
 	return 1;
 }
 /* endof hash删除 */
@@ -185,7 +343,157 @@ void ucache_unlock(int fd)
 	shm_unlock(fd);
 }
 
-// Loads PASSFILE into cache for all users.
+enum {
+	UCACHE_SNAPSHOT_VERSION = 2,
+	UCACHE_SNAPSHOT_CHUNK = 64 * 1024,
+};
+
+/*
+ * A snapshot is a header followed by a verbatim copy of struct UCACHE.
+ * The checksum covers the copy and is computed a word at a time, so a
+ * snapshot is validated in the same pass that reads it. 'passwd_mtime'
+ * records PASSFILE's modification time when the snapshot was taken; a
+ * PASSFILE changed afterwards makes the snapshot stale.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t maxusers;
+	uint64_t size;
+	uint64_t checksum;
+	int64_t passwd_mtime;
+} ucache_snapshot_header_t;
+
+static const char ucache_snapshot_magic[8] = { 'F', 'B', 'U', 'C', 'A', 'C',
+		'H', 'E' };
+
+static uint64_t snapshot_checksum(uint64_t sum, const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+	for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+		uint64_t word = 0;
+		size_t len = size - i < sizeof(word) ? size - i : sizeof(word);
+		memcpy(&word, p + i, len);
+		sum = (sum ^ word) * 0x100000001b3ULL;
+		sum ^= sum >> 29;
+	}
+	return sum;
+}
+
+// Saves cache for all users to 'file' atomically.
+// Returns 0 on success, -1 on error.
+int ucache_snapshot_save(const char *file)
+{
+	struct stat st;
+	if (resolve_ucache() == -1 || stat(PASSFILE, &st) < 0)
+		return -1;
+
+	char temp[HOMELEN];
+	snprintf(temp, sizeof(temp), "%s.%d", file, getpid());
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	if (fd < 0)
+		return -1;
+
+	ucache_snapshot_header_t header = {
+		.version = UCACHE_SNAPSHOT_VERSION,
+		.maxusers = MAXUSERS,
+		.size = sizeof(*uidshm),
+		.passwd_mtime = st.st_mtime,
+	};
+	memcpy(header.magic, ucache_snapshot_magic, sizeof(header.magic));
+
+	bool ok = lseek(fd, sizeof(header), SEEK_SET) == sizeof(header);
+
+	// Keep registrations out while copying.
+	int lock = ucache_lock();
+	uint64_t sum = 0;
+	char *buf = malloc(UCACHE_SNAPSHOT_CHUNK);
+	ok = ok && buf;
+	for (size_t off = 0; ok && off < sizeof(*uidshm);
+			off += UCACHE_SNAPSHOT_CHUNK) {
+		size_t len = sizeof(*uidshm) - off;
+		if (len > UCACHE_SNAPSHOT_CHUNK)
+			len = UCACHE_SNAPSHOT_CHUNK;
+		memcpy(buf, (const char *) uidshm + off, len);
+		sum = snapshot_checksum(sum, buf, len);
+		ok = file_write(fd, buf, len) == len;
+	}
+	if (lock >= 0)
+		ucache_unlock(lock);
+	free(buf);
+
+	header.checksum = sum;
+	ok = ok && lseek(fd, 0, SEEK_SET) == 0
+			&& file_write(fd, &header, sizeof(header)) == sizeof(header)
+			&& fsync(fd) == 0;
+	ok = (close(fd) == 0) && ok;
+
+	if (ok && rename(temp, file) == 0)
+		return 0;
+	unlink(temp);
+	return -1;
+}
+
+// Maps 'file' and validates its header and checksum.
+// Returns 0 on success, -1 on error.
+static int ucache_snapshot_open(const char *file, mmap_t *m)
+{
+	m->oflag = O_RDONLY;
+	if (mmap_open(file, m) < 0)
+		return -1;
+
+	const ucache_snapshot_header_t *header = m->ptr;
+	if (m->size == sizeof(*header) + sizeof(*uidshm)
+			&& !memcmp(header->magic, ucache_snapshot_magic,
+				sizeof(header->magic))
+			&& header->version == UCACHE_SNAPSHOT_VERSION
+			&& header->maxusers == MAXUSERS
+			&& header->size == sizeof(*uidshm)
+			&& snapshot_checksum(0, header + 1, sizeof(*uidshm))
+				== header->checksum) {
+		return 0;
+	}
+	mmap_close(m);
+	return -1;
+}
+
+// Checks whether 'file' is a valid snapshot.
+// Stores PASSFILE's modification time at the snapshot in 'stamp'.
+// Returns 0 if valid, -1 otherwise.
+int ucache_snapshot_verify(const char *file, fb_time_t *stamp)
+{
+	mmap_t m;
+	if (ucache_snapshot_open(file, &m) < 0)
+		return -1;
+	if (stamp)
+		*stamp = ((const ucache_snapshot_header_t *) m.ptr)->passwd_mtime;
+	mmap_close(&m);
+	return 0;
+}
+
+// Fills newly created cache from 'file' unless PASSFILE is newer.
+// Returns 0 on success, -1 on error.
+static int ucache_snapshot_restore(const char *file)
+{
+	mmap_t m;
+	if (ucache_snapshot_open(file, &m) < 0)
+		return -1;
+
+	const ucache_snapshot_header_t *header = m.ptr;
+	struct stat st;
+	int ret = -1;
+	if (stat(PASSFILE, &st) == 0 && st.st_mtime <= header->passwd_mtime) {
+		memcpy(uidshm, header + 1, sizeof(*uidshm));
+		memset(uidshm->status, 0, sizeof(uidshm->status));
+		uidshm->uptime = time(NULL);
+		ret = 0;
+	}
+	mmap_close(&m);
+	return ret;
+}
+
+// Loads cache for all users, from UCACHE_SNAPSHOT if the shared memory
+// is newly created and the snapshot is valid, otherwise from PASSFILE.
 // Returns 0 on success, -1 on error.
 int load_ucache(void)
 {
@@ -204,6 +512,12 @@ int load_ucache(void)
 		if(uidshm == NULL)
 			exit(1);
 	}
+
+	if (iscreate && ucache_snapshot_restore(UCACHE_SNAPSHOT) == 0) {
+		log_usies("CACHE", "restore ucache from snapshot", NULL);
+		ucache_unlock(fd);
+		return 0;
+	}
 	log_usies("CACHE", "reload ucache", NULL);
 
 	// Load PASSFILE.
@@ -219,11 +533,10 @@ int load_ucache(void)
 		return -1;
 	}
 
-	// Initialize 'userid' and hash.
+	// Initialize 'userid' and index.
 	memset(uidshm->userid, 0, sizeof(uidshm->userid));
-	memset(uidshm->hash, 0, sizeof(uidshm->hash));
-	memset(uidshm->next, 0, sizeof(uidshm->next));
-	memset(uidshm->prev, 0, sizeof(uidshm->prev));
+	memset(uidshm->index, 0, sizeof(uidshm->index));
+	uidshm->sorted_count = 0;
 
 	// Fill cache.
 	int last = 0;
@@ -231,6 +544,7 @@ int load_ucache(void)
 		if (fillucache(&(uidshm->passwd[i]), i))
 			last = i;
 	}
+	usorted_build();
 	uidshm->number = ++last;
 	uidshm->uptime = time(NULL);
 
@@ -277,29 +591,15 @@ void setuserid(int num, const char *userid)
 	if (num > 0 && num <= MAXUSERS) {
 		if (num > uidshm->number)
 			uidshm->number = num;
+		if (uidshm->userid[num - 1][0] != '\0') {
+			uindex_remove(uidshm->userid[num - 1], num);
+			usorted_remove(num);
+		}
 		strlcpy(uidshm->userid[num - 1], userid, IDLEN + 1);
-		/* hash 填充 */
-		if (strcmp(userid, "new") ) {
-			int a1, a2;
-			int key;
-
-			key = uhashkey(userid, &a1, &a2);
-			if (uidshm->hash[a1][a2][key] == 0) {
-				uidshm->hash[a1][a2][key] = num;
-				uidshm->next[num-1]=0;
-				uidshm->prev[num-1]=0;
-			} else {
-				int i;
-				for (i=uidshm->hash[a1][a2][key]; uidshm->next[i-1]; i
-						=uidshm->next[i-1])
-					;//找到一个空位置
-
-				uidshm->next[i-1] = num;
-				uidshm->prev[num-1] = i;
-				uidshm->next[num-1] = 0;
-			}
+		if (strcmp(userid, "new")) {
+			uindex_insert(userid, num);
+			usorted_insert(num);
 		}
-		/* end of hash 填充 */
 	}
 }
 
@@ -329,20 +629,23 @@ int getuserid(char *userid, int uid, size_t len)
 // Returns the place of 'userid' in cache for all users, 0 if not found.
 int searchuser(const char *userid)
 {
-	register int i;
-	int a1, a2;
-	int key;
-
 	if (resolve_ucache() == -1)
 		return 0;
-	key = uhashkey(userid, &a1, &a2);
-	i = uidshm->hash[a1][a2][key];
-	while (i) {
-		if (!strncasecmp(userid, uidshm->userid[i - 1],
-				sizeof(uidshm->userid[0]))) {
-			return i;
+
+	uint32_t hash = uhash(userid);
+	int pos = hash % UINDEX_SLOTS;
+	for (int i = 0; i < UINDEX_SLOTS; ++i) {
+		uint64_t e = *(volatile uint64_t *) (uidshm->index + pos);
+		int num = uindex_num(e);
+		if (num == 0)
+			return 0;
+		if (num > 0 && num <= MAXUSERS && uindex_hash(e) == hash
+				&& !strncasecmp(userid, uidshm->userid[num - 1],
+					sizeof(uidshm->userid[0]))) {
+			return num;
 		}
-		i = uidshm->next[i - 1];
+		if (++pos == UINDEX_SLOTS)
+			pos = 0;
 	}
 	return 0;
 }
@@ -17,7 +17,7 @@ enum {
 const char *cexpstr(int exp)
 {
 	const char *c = "-=+*#A";
-	static char ce[11];
+	static FB_THREAD_LOCAL char ce[11];
 	memset(ce, ' ', 10);
 
 	if (exp < 0)
@@ -4,10 +4,7 @@
 #include "fbbs/session.h"
 #include "fbbs/string.h"
 
-/** 以用户名查用户ID @mdb_hash */
-#define USER_ID_HASH_KEY  "user_id"
-
-struct userec currentuser;
+FB_THREAD_LOCAL struct userec currentuser;
 
 static void set_user_id_cache(const char *uname, user_id_t uid)
 {
@@ -137,6 +137,7 @@ static bool ordain_bm(int bid, const char *uname)
 	db_res_t *res = db_cmd("INSERT INTO bms (user_id, board_id, stamp) "
 			"VALUES (%d, %d, current_timestamp) ", uid, bid);
 	db_clear(res);
+	board_cache_invalidate();
 	return res;
 }
 
@@ -322,6 +323,7 @@ static bool retire_bm(int bid, const char *uname)
 			"WHERE b.user_id = u.id AND b.board_id = %d AND u.name = %s",
 			bid, uname);
 	db_clear(res);
+	board_cache_invalidate();
 	return res;
 }
 
@@ -741,6 +743,7 @@ int tui_new_board(const char *cmd)
 	}
 	int bid = db_get_integer(res, 0, 0);
 	db_clear(res);
+	board_cache_invalidate();
 
 	char *bms = NULL;
 	if (!(flag & BOARD_FLAG_DIR)
@@ -866,6 +869,7 @@ static bool alter_board_name(board_t *bp)
 	db_res_t *res = db_cmd("UPDATE boards SET name = %s WHERE id = %d",
 			bname, bp->id);
 	db_clear(res);
+	board_cache_invalidate();
 	return res;
 }
 
@@ -882,6 +886,7 @@ static bool alter_board_descr(board_t *bp)
 	db_res_t *res = db_cmd("UPDATE boards SET descr = %s WHERE id = %d",
 			utf8_descr, bp->id);
 	db_clear(res);
+	board_cache_invalidate();
 	return res;
 }
 
@@ -898,6 +903,7 @@ static bool alter_board_parent(board_t *bp)
 	db_res_t *res = db_cmd("UPDATE boards SET parent = %d WHERE id = %d",
 			parent.id, bp->id);
 	db_clear(res);
+	board_cache_invalidate();
 	return res;
 }
 
@@ -950,6 +956,7 @@ static bool alter_board_perm(board_t *bp)
 	db_res_t *res = db_cmd("UPDATE boards SET flag = %d, perm = %d "
 			"WHERE id = %d", flag, perm, bp->id);
 	db_clear(res);
+	board_cache_invalidate();
 	return res;
 }
 
@@ -975,6 +982,7 @@ static bool alter_board_flag(board_t *bp, const char *prompt, int flag)
 	db_res_t *res = db_cmd("UPDATE boards SET flag = %d WHERE id = %d",
 			f, bp->id);
 	db_clear(res);
+	board_cache_invalidate();
 	return res;
 }
 
@@ -1073,7 +1081,8 @@ int tui_edit_board(const char *cmd)
 
 	if (res) {
 		board_t nb;
-		get_board_by_bid(board.id, &nb);
+		if (get_board_by_bid(board.id, &nb))
+			hot_topic_board_changed(&nb);
 		board_to_gbk(&board);
 
 		if (ans[0] == '1') {
@@ -15,8 +15,12 @@ struct ac_list {
 	pool_t *pool;
 	ac_name_list *head;
 	ac_name_list *tail;
-	ac_name_list **col;
-	ac_name_list *seek;
+	ac_lookup_t lookup;
+	const char **matches; ///< names matching the current prefix
+	int nmatches;
+	int msize;
+	int *col;
+	int seek; ///< index into 'matches' to continue listing, -1 if none
 	const char *match;
 	int extra;
 	int xbase;
@@ -27,11 +31,21 @@ ac_list *ac_list_new(void)
 {
 	pool_t *p = pool_create(0);
 	ac_list *acl = pool_alloc(p, sizeof(*acl));
+	memset(acl, 0, sizeof(*acl));
 	acl->pool = p;
-	acl->head = NULL;
-	acl->tail = NULL;
-	acl->col = NULL;
-	acl->seek = NULL;
+	acl->seek = -1;
+	return acl;
+}
+
+/**
+ * Create an autocomplete list whose candidates come from a lookup function.
+ * @param lookup function returning names with a given prefix.
+ * @return the list.
+ */
+ac_list *ac_list_new_lookup(ac_lookup_t lookup)
+{
+	ac_list *acl = ac_list_new();
+	acl->lookup = lookup;
 	return acl;
 }
 
@@ -51,29 +65,44 @@ void ac_list_add(ac_list *acl, const char *name)
 
 void ac_list_free(ac_list *acl)
 {
-	if (acl && acl->pool)
-		pool_destroy(acl->pool);
+	if (acl) {
+		free(acl->matches);
+		if (acl->pool)
+			pool_destroy(acl->pool);
+	}
 }
 
-static ac_name_list *next_match(ac_name_list *l, const char *prefix)
+static int match_prefix(ac_list *acl, const char *prefix)
 {
+	if (acl->lookup)
+		return acl->nmatches = acl->lookup(prefix, &acl->matches, &acl->msize);
+
 	size_t len = strlen(prefix);
-	for (; l; l = l->next) {
-		if (strncaseeq(prefix, l->name, len)) {
-			return l;
+	int count = 0;
+	for (ac_name_list *l = acl->head; l; l = l->next) {
+		if (!strncaseeq(prefix, l->name, len))
+			continue;
+		if (count >= acl->msize) {
+			int size = acl->msize ? acl->msize * 2 : 64;
+			const char **m = realloc(acl->matches, sizeof(*m) * size);
+			if (!m)
+				break;
+			acl->matches = m;
+			acl->msize = size;
 		}
+		acl->matches[count++] = l->name;
 	}
-	return NULL;
+	return acl->nmatches = count;
 }
 
-static const char *best_match(ac_name_list *l, const char *prefix)
+static const char *best_match(ac_list *acl, const char *prefix)
 {
-	ac_name_list *first = next_match(l, prefix);
-	for (l = first; l; l = l->next) {
-		if (strcaseeq(prefix, l->name))
-			return l->name;
+	int count = match_prefix(acl, prefix);
+	for (int i = 0; i < count; ++i) {
+		if (strcaseeq(prefix, acl->matches[i]))
+			return acl->matches[i];
 	}
-	return first ? first->name : NULL;
+	return count ? acl->matches[0] : NULL;
 }
 
 static int _autocomplete(ac_list *acl, char *buf, size_t size)
@@ -81,19 +110,22 @@ static int _autocomplete(ac_list *acl, char *buf, size_t size)
 	int rows = screen_lines() - acl->ybase - 2, extra = 0;
 	const char *base = NULL;
 
-	if (!acl->seek || acl->seek == acl->head) {
-		ac_name_list *l1 = next_match(acl->head, buf);
-		if (!l1)
+	int count = match_prefix(acl, buf);
+	if (acl->seek >= count)
+		acl->seek = -1;
+
+	if (acl->seek <= 0) {
+		if (!count)
 			return 0;
 
-		ac_name_list *l2 = next_match(l1->next, buf);
-		if (!l2) {
-			extra = strlen(l1->name) - strlen(buf);
-			strlcpy(buf, l1->name, size);
+		const char *first = acl->matches[0];
+		if (count == 1) {
+			extra = strlen(first) - strlen(buf);
+			strlcpy(buf, first, size);
 			return extra;
 		}
 
-		base = l1->name;
+		base = first;
 		extra = strlen(base) - strlen(buf);
 
 		if (!acl->col) {
@@ -107,31 +139,30 @@ static int _autocomplete(ac_list *acl, char *buf, size_t size)
 	printdash(" \xc1\xd0\xb1\xed ");
 
 	const int columns = 80;
-	int xbase = 0, width = 0, count = 0;
-	if (!acl->seek)
-		acl->seek = acl->head;
+	int xbase = 0, width = 0, ncol = 0;
+	if (acl->seek < 0)
+		acl->seek = 0;
 	size_t len = strlen(buf);
 
-	for (ac_name_list *l = acl->seek; l; l = l->next) {
-		if (strncaseeq(l->name, buf, len)) {
-			acl->col[count++] = l;
-
-			int w = strlen(l->name);
-			if (w > width)
-				width = w;
-			if (extra) {
-				if (extra > w - len)
-					extra = w - len;
-				for (int i = len; i < len + extra; ++i) {
-					if (base[i] != l->name[i]) {
-						extra = i - len;
-						break;
-					}
+	for (int i = acl->seek; i < count; ++i) {
+		const char *name = acl->matches[i];
+		acl->col[ncol++] = i;
+
+		int w = strlen(name);
+		if (w > width)
+			width = w;
+		if (extra) {
+			if (extra > w - len)
+				extra = w - len;
+			for (int j = len; j < len + extra; ++j) {
+				if (base[j] != name[j]) {
+					extra = j - len;
+					break;
 				}
 			}
 		}
 
-		if (count == rows - 1 || !l->next) {
+		if (ncol == rows - 1 || i == count - 1) {
 			if (xbase + width > columns) {
 				acl->seek = *acl->col;
 				screen_move_clear(-1);
@@ -139,15 +170,15 @@ static int _autocomplete(ac_list *acl, char *buf, size_t size)
 				prints("\033[1m -- \xbb\xb9\xd3\xd0 --\033[m");
 				break;
 			} else {
-				acl->seek = NULL;
-				for (int i = 0; i < count; ++i) {
-					screen_move(acl->ybase + i + 2, xbase);
-					outs(acl->col[i]->name);
+				acl->seek = -1;
+				for (int j = 0; j < ncol; ++j) {
+					screen_move(acl->ybase + j + 2, xbase);
+					outs(acl->matches[acl->col[j]]);
 				}
 				screen_move_clear(-1);
 				xbase += width + 1;
 				width = 0;
-				count = 0;
+				ncol = 0;
 			}
 		}
 	}
@@ -155,7 +186,7 @@ static int _autocomplete(ac_list *acl, char *buf, size_t size)
 	if (len + extra >= size - 1)
 		extra = size - 1 - len;
 	if (extra > 0)
-		strlcpy(buf + len, (*acl->col)->name + len, extra + 1);
+		strlcpy(buf + len, acl->matches[*acl->col] + len, extra + 1);
 	return extra;
 }
 
@@ -179,7 +210,7 @@ void autocomplete(ac_list *acl, const char *prompt, char *buf, size_t size)
 				{
 					if (!*buf)
 						return;
-					const char *match = best_match(acl->head, buf);
+					const char *match = best_match(acl, buf);
 					if (match)
 						strlcpy(buf, match, size);
 				}
@@ -198,14 +229,14 @@ void autocomplete(ac_list *acl, const char *prompt, char *buf, size_t size)
 					screen_move(acl->ybase, acl->xbase + len);
 					screen_putc(' ');
 					screen_move(acl->ybase, real_xbase + len);
-					acl->seek = NULL;
+					acl->seek = -1;
 				}
 				break;
 			default:
 				if (len < size - 1) {
 					buf[len++] = ch;
 					buf[len] = '\0';
-					if (next_match(acl->head, buf)) {
+					if (match_prefix(acl, buf)) {
 						screen_move(acl->ybase, acl->xbase + len - 1);
 						outc(ch);
 						screen_move(acl->ybase, real_xbase + len);
@@ -216,7 +247,7 @@ void autocomplete(ac_list *acl, const char *prompt, char *buf, size_t size)
 						screen_move(acl->ybase, real_xbase + len);
 					}
 				}
-				acl->seek = NULL;
+				acl->seek = -1;
 				break;
 		}
 	}
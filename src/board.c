@@ -17,6 +17,8 @@ typedef struct {
 	board_t board;
 	int folder;
 	int online;
+	int posts;
+	int unread; ///< 未读文章数
 } board_extra_t;
 
 typedef struct {
@@ -293,11 +295,6 @@ static int tui_favorite_rm(tui_list_t *tl)
 	return DONOTHING;
 }
 
-static bool check_newpost(board_t *board)
-{
-	return brc_board_unread(currentuser.userid, board->name, board->id);
-}
-
 static void res_to_board_array(board_list_t *bl, db_res_t *r1, db_res_t *r2)
 {
 	int rows = db_res_rows(r1) + db_res_rows(r2);
@@ -398,8 +395,7 @@ static void jump_to_first_unread(tui_list_t *tl)
 	if (bl->newflag) {
 		int i;
 		for (i = tl->cur; i < tl->all; ++i) {
-			board_t *bp = &(bl->indices[i]->board);
-			if (!(bp->flag & BOARD_FLAG_DIR) && check_newpost(bp))
+			if (bl->indices[i]->unread)
 				break;
 		}
 		if (i < tl->all)
@@ -409,13 +405,33 @@ static void jump_to_first_unread(tui_list_t *tl)
 
 static void load_online_data(board_list_t *bl)
 {
+	int *bids = malloc(sizeof(*bids) * bl->bcount);
+	bool *unread = malloc(sizeof(*unread) * bl->bcount);
+	if (bids && unread) {
+		for (int i = 0; i < bl->bcount; ++i)
+			bids[i] = bl->boards[i].board.id;
+		brc_boards_unread(currentuser.userid, bids, bl->bcount, unread);
+	}
+
 	for (int i = 0; i < bl->bcount; ++i) {
 		board_extra_t *b = bl->boards + i;
-		if (b->board.flag & BOARD_FLAG_DIR)
-			b->online = 0;
-		else
-			b->online = session_count_online_board(b->board.id);
+		if (b->board.flag & BOARD_FLAG_DIR) {
+			b->online = b->posts = b->unread = 0;
+		} else {
+			board_stat_t stat;
+			board_stat_get(b->board.id, &stat);
+			b->online = stat.online;
+			b->posts = stat.posts;
+			// 最新文章已读的版面不必逐篇统计
+			if (unread && !unread[i])
+				b->unread = 0;
+			else
+				b->unread = brc_unread_count(currentuser.userid,
+						b->board.name, b->board.id);
+		}
 	}
+	free(bids);
+	free(unread);
 }
 
 static tui_list_loader_t board_list_load(tui_list_t *tl)
@@ -551,7 +567,7 @@ static tui_list_display_t board_list_display(tui_list_t *tl, int n)
 	else if (board->flag & BOARD_FLAG_DIR)
 		screen_printf("  目录");
 	else {
-		int count = post_get_board_count(board->id);
+		int count = be->posts;
 		if (count < 100000) {
 			screen_printf(" %5d", count);
 		} else {
@@ -563,8 +579,7 @@ static tui_list_display_t board_list_display(tui_list_t *tl, int n)
 	if (board->flag & BOARD_FLAG_DIR) {
 		screen_printf("＋");
 	} else {
-		bool unread = check_newpost(board);
-		screen_printf(unread ? "◆" : "◇");
+		screen_printf(be->unread ? "◆" : "◇");
 	}
 
 	char descr[24];
@@ -76,7 +76,7 @@ void showstuff(char *buf) {
 #endif
 	char buf2[STRLEN], *ptr, *ptr2;
 
-	static logout loglst[] = {
+	logout loglst[] = {
 			{ "userid", currentuser.userid },
 			{ "username", currentuser.username },
 			{ "email", currentuser.email },
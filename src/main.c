@@ -161,6 +161,7 @@ static void u_enter(void)
 			SESSION_PLAIN
 #endif
 			, session_visible(), 0);
+	msg_ring_open();
 
 	int pager = load_pager();
 	set_pager(pager);
@@ -196,6 +197,7 @@ void u_exit(void)
 	substitut_record(PASSFILE, &currentuser, sizeof(currentuser), usernum);
 	uidshm->status[usernum - 1]--;
 
+	msg_ring_close();
 	session_destroy(session_get_id());
 	session_set_pid(0);
 }
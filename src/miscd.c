@@ -8,6 +8,7 @@ extern int b_closepolls(void);
 //退出时执行的函数
 void do_exit() {
 	flush_ucache();
+	ucache_snapshot_save(UCACHE_SNAPSHOT);
 }
 
 int main(int argc, char *argv[]) {
@@ -49,6 +50,7 @@ int main(int argc, char *argv[]) {
 		while (1) { //循环
 			b_closepolls(); //关闭投票
 			flush_ucache(); //将用户在内存中的数据写回.PASSWDS
+			ucache_snapshot_save(UCACHE_SNAPSHOT); //保存快照, 供下次冷启动使用
 			sleep(60 * 15); //睡眠十分钟,即每十五分钟同步一次.        
 		}
 	} else if ( !strcasecmp(argv[1], "flushed") ) { //miscd flushed
@@ -26,7 +26,14 @@ typedef struct {
 } online_user_info_t;
 
 typedef struct {
-	db_res_t *res;
+	user_id_t uid;
+	int row;
+} follow_index_t;
+
+typedef struct {
+	session_info_t *sessions;
+	following_list_t *follows;
+	follow_index_t *follow_index; ///< follows的行号, 按用户ID排序
 	fb_time_t uptime;
 	online_user_info_t *users;
 	int num;
@@ -35,29 +42,67 @@ typedef struct {
 	bool show_note;
 } online_users_t;
 
-static void _fill_session_array(tui_list_t *p, int i)
+static int follow_index_cmp(const void *l, const void *r)
 {
-	online_users_t *up = p->data;
-	db_res_t *res = up->res;
+	const follow_index_t *a = l, *b = r;
+	return a->uid < b->uid ? -1 : (a->uid > b->uid);
+}
 
-	bool visible = db_get_bool(res, i, 3);
-	if (!visible && !HAS_PERM(PERM_SEECLOAK))
+static void follow_index_build(online_users_t *up)
+{
+	free(up->follow_index);
+	up->follow_index = NULL;
+	if (!up->follows)
 		return;
 
-	session_id_t sid = db_get_session_id(res, i, 0);
-	if (up->bid && session_get_board(sid) != up->bid)
+	int rows = following_list_rows(up->follows);
+	up->follow_index = malloc(sizeof(*up->follow_index) * (rows + 1));
+	if (!up->follow_index)
 		return;
+	for (int i = 0; i < rows; ++i) {
+		up->follow_index[i].uid = following_list_get_id(up->follows, i);
+		up->follow_index[i].row = i;
+	}
+	qsort(up->follow_index, rows, sizeof(*up->follow_index),
+			follow_index_cmp);
+}
+
+static const char *following_note(const online_users_t *up, user_id_t uid)
+{
+	follow_index_t key = { .uid = uid };
+	const follow_index_t *f = bsearch(&key, up->follow_index,
+			following_list_rows(up->follows), sizeof(*up->follow_index),
+			follow_index_cmp);
+	return f ? following_list_get_notes(up->follows, f->row) : NULL;
+}
+
+static void _fill_session_array(online_users_t *up, const session_info_t *s)
+{
+	if ((s->flag & SESSION_FLAG_INVISIBLE) && !HAS_PERM(PERM_SEECLOAK))
+		return;
+
+	if (up->bid && s->board != up->bid)
+		return;
+
+	const char *note = NULL;
+	if (up->follow) {
+		note = following_note(up, s->user_id);
+		if (!note)
+			return;
+	}
 
 	online_user_info_t *ip = up->users + up->num;
 	memset(ip, 0, sizeof(*ip));
 
-	ip->sid = sid;
-	ip->name = db_get_value(res, i, 2);
-	ip->host = db_get_value(res, i, 4);
-	ip->note = up->follow ? db_get_value(res, i, 6) : NULL;
-	ip->uid = db_get_user_id(res, i, 1);
-	ip->flag = (db_get_bool(res, i, 5) ? SESSION_FLAG_WEB : 0)
-			| (visible ? 0 : SESSION_FLAG_INVISIBLE);
+	ip->sid = s->id;
+	ip->name = s->user_name;
+	ip->host = s->ip_addr;
+	ip->note = note;
+	ip->uid = s->user_id;
+	ip->pid = s->pid;
+	ip->idle = s->idle;
+	ip->status = s->status;
+	ip->flag = s->flag;
 
 	++up->num;
 }
@@ -75,20 +120,19 @@ static int session_cmp(const void *s1, const void *s2)
 static tui_list_loader_t fill_session_array(tui_list_t *p)
 {
 	online_users_t *up = p->data;
-	db_res_t *res = up->res;
 
 	p->all = up->num = 0;
 
-	if (!res || db_res_rows(res) < 1) {
+	int count = session_list(&up->sessions, 0);
+	if (count < 1 || (up->follow && !up->follow_index)) {
 		free(up->users);
 		up->users = NULL;
 		return 0;
 	}
 
-	int count = db_res_rows(res);
 	up->users = malloc(count * sizeof(*up->users));
 	for (int i = 0; i < count; ++i) {
-		_fill_session_array(p, i);
+		_fill_session_array(up, up->sessions + i);
 	}
 	qsort(up->users, up->num, sizeof(*up->users), session_cmp);
 
@@ -98,28 +142,20 @@ static tui_list_loader_t fill_session_array(tui_list_t *p)
 static tui_list_loader_t online_users_load_followings(tui_list_t *p)
 {
 	online_users_t *up = p->data;
-	up->res = session_get_followed();
-	return fill_session_array(p);
-}
-
-static tui_list_loader_t online_users_load_board(tui_list_t *p)
-{
-	// TODO: load from redis first
-	online_users_t *up = p->data;
-	up->res = session_get_active();
-	return fill_session_array(p);
-}
-
-static tui_list_loader_t online_users_load_all(tui_list_t *p)
-{
-	online_users_t *up = p->data;
-	up->res = session_get_active();
+	following_list_free(up->follows);
+	up->follows = following_list_load(session_get_user_id());
+	follow_index_build(up);
 	return fill_session_array(p);
 }
 
 static void online_users_free(online_users_t *up)
 {
-	db_clear(up->res);
+	following_list_free(up->follows);
+	up->follows = NULL;
+	free(up->follow_index);
+	up->follow_index = NULL;
+	free(up->sessions);
+	up->sessions = NULL;
 	free(up->users);
 	up->users = NULL;
 }
@@ -135,14 +171,9 @@ static tui_list_loader_t online_users_load(tui_list_t *p)
 
 	online_users_free(up);
 
-	if (up->follow) {
+	if (up->follow)
 		return online_users_load_followings(p);
-	} else {
-		if (up->bid)
-			return online_users_load_board(p);
-		else
-			return online_users_load_all(p);
-	}
+	return fill_session_array(p);
 }
 
 static tui_list_title_t online_users_title(tui_list_t *p)
@@ -7,6 +7,7 @@
 #include "fbbs/friend.h"
 #include "fbbs/helper.h"
 #include "fbbs/mail.h"
+#include "fbbs/msg.h"
 #include "fbbs/session.h"
 #include "fbbs/string.h"
 #include "fbbs/terminal.h"
@@ -18,24 +19,276 @@ enum {
 	BROADCAST_MSG,
 };
 
-typedef db_res_t msg_session_info_t;
-
-#define MSG_SESSION_INFO_FIELDS  "s.id, s.pid, s.web, s.visible, s.user_name"
-#define MSG_SESSION_INFO_QUERY  \
-	"SELECT "MSG_SESSION_INFO_FIELDS " FROM sessions s"
+typedef struct {
+	session_info_t *sessions;
+	int count;
+} msg_session_info_t;
 
-#define msg_session_info_sid(s, i)  db_get_session_id(s, i, 0)
-#define msg_session_info_pid(s, i)  db_get_integer(s, i, 1)
-#define msg_session_info_web(s, i)  db_get_bool(s, i, 2)
-#define msg_session_info_visible(s, i)  db_get_bool(s, i, 3)
-#define msg_session_info_uname(s, i)  db_get_value(s, i, 4)
+#define msg_session_info_sid(s, i)  ((s)->sessions[i].id)
+#define msg_session_info_pid(s, i)  ((s)->sessions[i].pid)
+#define msg_session_info_web(s, i)  ((s)->sessions[i].flag & SESSION_FLAG_WEB)
+#define msg_session_info_visible(s, i) \
+	(!((s)->sessions[i].flag & SESSION_FLAG_INVISIBLE))
+#define msg_session_info_uname(s, i)  ((s)->sessions[i].user_name)
+#define msg_session_info_status(s, i)  ((s)->sessions[i].status)
 
-#define msg_session_info_count(s)  db_res_rows(s)
-#define msg_session_info_clear(s)  db_clear(s)
+#define msg_session_info_count(s)  ((s)->count)
 
 extern int RMSG;
 extern int msg_num;
 
+enum {
+	MSG_RING_SHMKEY = 30100,
+	MSG_RINGS = MAXACTIVE,
+	MSG_RING_SLOTS = 32,
+	MSG_RING_PROBES = 64,
+	MSG_HISTORY_SIZE = 64,
+};
+
+typedef struct {
+	uint32_t seq; ///< 写完后置为讯息序号+1
+	session_id_t sid; ///< 收信会话, 被接收方取走或发送方撤回后清零
+	char text[MAX_MSG_SIZE + 2];
+} msg_ring_slot_t;
+
+/**
+ * 共享内存中的讯息环, 每个终端会话一个
+ *
+ * 发送方以CAS抢占序号, 写好槽位后发布序号; 接收方按序号依次读取,
+ * 读完后发布tail. 环满时发送方不覆盖旧讯息, 而是直接追加到接收方的讯息
+ * 文件并增加overflow, 接收方据此计数. 接收方取走讯息前清除notified,
+ * 发送方仅在notified由0变1时发出SIGUSR2, 因此连续的讯息只触发一次信号.
+ *
+ * 槽位记录收信会话, 接收方与发送方都以CAS清除它来认领讯息. 发布后讯息环
+ * 已不属于收信会话时, 发送方尝试撤回并改写入文件; 撤回失败说明接收方
+ * 已经取走. 因此讯息恰好送达一次, 也不会被讯息环的下一个主人读到.
+ */
+typedef struct {
+	session_id_t sid; ///< 所属会话, 0表示空闲
+	int pid;
+	int notified;
+	int overflow; ///< 环满时直接写入文件的讯息数
+	uint32_t head; ///< 下一条讯息的序号
+	uint32_t tail; ///< 接收方已取走的讯息序号
+	msg_ring_slot_t slots[MSG_RING_SLOTS];
+} msg_ring_t;
+
+typedef struct {
+	msg_ring_t rings[MSG_RINGS];
+} msg_ring_table_t;
+
+typedef struct {
+	char head[LINE_BUFSIZE];
+	char buf[LINE_BUFSIZE];
+} msg_history_t;
+
+static msg_ring_t *my_ring;
+static session_id_t my_ring_sid;
+static uint32_t my_ring_tail;
+
+/** 本次登录收到的最近讯息, 更早的讯息从文件中读取 */
+static msg_history_t msg_history[MSG_HISTORY_SIZE];
+static int msg_history_count;
+
+static msg_ring_table_t *msg_ring_table(void)
+{
+	static shm_once_t once;
+	int created;
+	return attach_shm_once(&once, "MSGRING_SHMKEY", MSG_RING_SHMKEY,
+			sizeof(msg_ring_table_t), &created);
+}
+
+static msg_ring_t *msg_ring_find(session_id_t sid)
+{
+	msg_ring_table_t *table = msg_ring_table();
+	if (!table || sid <= 0)
+		return NULL;
+	int pos = (uint64_t) sid % MSG_RINGS;
+	for (int i = 0; i < MSG_RING_PROBES; ++i) {
+		msg_ring_t *ring = table->rings + pos;
+		if (*(volatile session_id_t *) &ring->sid == sid)
+			return ring;
+		if (++pos == MSG_RINGS)
+			pos = 0;
+	}
+	return NULL;
+}
+
+/**
+ * 为当前会话申请讯息环
+ * @return 成功返回true, 否则讯息仍通过文件传递
+ */
+bool msg_ring_open(void)
+{
+	msg_ring_table_t *table = msg_ring_table();
+	session_id_t sid = session_get_id();
+	if (!table || sid <= 0)
+		return false;
+
+	int pos = (uint64_t) sid % MSG_RINGS;
+	for (int i = 0; i < MSG_RING_PROBES; ++i) {
+		msg_ring_t *ring = table->rings + pos;
+		session_id_t owner = ring->sid;
+		// 进程异常退出时遗留的讯息环可以回收
+		bool stale = owner && ring->pid > 0
+				&& kill(ring->pid, 0) < 0 && errno == ESRCH;
+		if ((!owner || stale)
+				&& __sync_bool_compare_and_swap(&ring->sid, owner, sid)) {
+			ring->pid = getpid();
+			ring->notified = 0;
+			ring->overflow = 0;
+			my_ring_tail = *(volatile uint32_t *) &ring->head;
+			ring->tail = my_ring_tail;
+			my_ring = ring;
+			my_ring_sid = sid;
+			return true;
+		}
+		if (++pos == MSG_RINGS)
+			pos = 0;
+	}
+	return false;
+}
+
+static int msg_ring_drain(bool closing);
+
+void msg_ring_close(void)
+{
+	if (my_ring) {
+		// 释放后发布的讯息由发送方撤回写入文件, 此前发布的在此取走
+		msg_ring_drain(false);
+		__sync_bool_compare_and_swap(&my_ring->sid, my_ring_sid, 0);
+		__sync_synchronize();
+		msg_ring_drain(true);
+		my_ring = NULL;
+		my_ring_sid = 0;
+	}
+}
+
+static void msg_file_append(const char *uname, const char *text)
+{
+	char file[HOMELEN];
+	sethomefile(file, uname, "msgfile");
+	file_append(file, text);
+	sethomefile(file, uname, "msgfile.me");
+	file_append(file, text);
+}
+
+static bool msg_ring_push(session_id_t sid, const char *uname,
+		const char *text)
+{
+	msg_ring_t *ring = msg_ring_find(sid);
+	if (!ring)
+		return false;
+
+	uint32_t seq;
+	bool full;
+	do {
+		seq = *(volatile uint32_t *) &ring->head;
+		full = seq - *(volatile uint32_t *) &ring->tail >= MSG_RING_SLOTS;
+	} while (!full
+			&& !__sync_bool_compare_and_swap(&ring->head, seq, seq + 1));
+
+	if (full) {
+		msg_file_append(uname, text);
+		__sync_add_and_fetch(&ring->overflow, 1);
+	} else {
+		msg_ring_slot_t *slot = ring->slots + seq % MSG_RING_SLOTS;
+		slot->seq = 0;
+		__sync_synchronize();
+		slot->sid = sid;
+		strlcpy(slot->text, text, sizeof(slot->text));
+		__sync_synchronize();
+		slot->seq = seq + 1;
+		__sync_synchronize();
+
+		// 讯息环已被释放或转给其他会话, 接收方未取走时改写入文件
+		if (*(volatile session_id_t *) &ring->sid != sid) {
+			if (__sync_bool_compare_and_swap(&slot->sid, sid, 0))
+				msg_file_append(uname, text);
+			return true;
+		}
+	}
+
+	if (!__sync_lock_test_and_set(&ring->notified, 1))
+		bbs_kill(0, ring->pid, SIGUSR2);
+	return true;
+}
+
+static void msg_history_add(const char *text)
+{
+	msg_history_t *h = msg_history + msg_history_count % MSG_HISTORY_SIZE;
+	const char *end = strchr(text, '\n');
+	if (end) {
+		strlcpy(h->head, text, sizeof(h->head));
+		int len = end - text + 1;
+		if (len < sizeof(h->head))
+			h->head[len] = '\0';
+		strlcpy(h->buf, end + 1, sizeof(h->buf));
+	} else {
+		strlcpy(h->head, text, sizeof(h->head));
+		h->buf[0] = '\0';
+	}
+	++msg_history_count;
+}
+
+/**
+ * 取走讯息环中的新讯息, 并追加到讯息记录文件
+ * @param[in] closing 讯息环已释放. 此时跳过尚未写完的槽位, 由发送方撤回
+ * @return 新讯息数, 没有讯息环时返回-1
+ */
+static int msg_ring_drain(bool closing)
+{
+	if (!my_ring)
+		return -1;
+
+	// 释放后讯息环的状态可能已属于下一个主人, 只认领自己的槽位
+	int overflow = 0;
+	if (!closing) {
+		__sync_lock_release(&my_ring->notified);
+		__sync_synchronize();
+		overflow = __sync_fetch_and_and(&my_ring->overflow, 0);
+	}
+
+	char log[MSG_RING_SLOTS * (MAX_MSG_SIZE + 2)];
+	size_t len = 0;
+	int count = 0;
+
+	uint32_t head = *(volatile uint32_t *) &my_ring->head;
+	if (closing && head - my_ring_tail > MSG_RING_SLOTS)
+		head = my_ring_tail + MSG_RING_SLOTS;
+	while (my_ring_tail != head) {
+		msg_ring_slot_t *slot = my_ring->slots + my_ring_tail % MSG_RING_SLOTS;
+		uint32_t seq = *(volatile uint32_t *) &slot->seq;
+		if ((!seq || (int32_t) (seq - my_ring_tail - 1) < 0) && !closing)
+			break; // 发送方尚未写完, 写完后会再次通知
+
+		char text[MAX_MSG_SIZE + 2];
+		__sync_synchronize();
+		strlcpy(text, slot->text, sizeof(text));
+		__sync_synchronize();
+		if (seq == my_ring_tail + 1
+				&& *(volatile uint32_t *) &slot->seq == seq
+				&& __sync_bool_compare_and_swap(&slot->sid, my_ring_sid, 0)) {
+			msg_history_add(text);
+			len += strlcpy(log + len, text, sizeof(log) - len);
+			++count;
+		}
+		++my_ring_tail;
+	}
+
+	if (!closing) {
+		__sync_synchronize();
+		my_ring->tail = my_ring_tail;
+	}
+
+	if (len)
+		msg_file_append(currentuser.userid, log);
+	// 环外的讯息只在文件中, 之后改为从文件读取
+	if (overflow)
+		msg_history_count = 0;
+	return count + overflow;
+}
+
 static int get_num_msgs(const char *filename)
 {
 	int i = 0;
@@ -82,13 +335,33 @@ int get_msg(const char *uid, char *msg, int line)
 	} //while
 }
 
+static void msg_session_info_clear(msg_session_info_t *s)
+{
+	if (s) {
+		free(s->sessions);
+		free(s);
+	}
+}
+
+static msg_session_info_t *msg_session_info_load(user_id_t user_id)
+{
+	msg_session_info_t *s = malloc(sizeof(*s));
+	if (!s)
+		return NULL;
+	s->count = session_list(&s->sessions, user_id);
+	if (s->count < 0) {
+		msg_session_info_clear(s);
+		return NULL;
+	}
+	return s;
+}
+
 static msg_session_info_t *get_msg_sessions(const char *user_name)
 {
 	user_id_t user_id = get_user_id(user_name);
 	if (user_id <= 0)
 		return NULL;
-	return db_query(MSG_SESSION_INFO_QUERY " WHERE s.user_id = %"DBIdUID,
-			user_id);
+	return msg_session_info_load(user_id);
 }
 
 static void generate_full_msg(const char *msg, int type,
@@ -158,7 +431,7 @@ static bool session_msgable(const msg_session_info_t *s, int i, int type)
 	if (msg_session_info_web(s, i))
 		return false;
 
-	int status = get_user_status(msg_session_info_sid(s, i));
+	int status = msg_session_info_status(s, i);
 	if (status == ST_BBSNET || status == ST_LOCKSCREEN)
 		return false;
 
@@ -204,26 +477,29 @@ static bool user_msgable(const msg_session_info_t *s)
 	return false;
 }
 
-static int send_one_msg(int pid, const char *uname, const char *full)
+static int send_one_msg(session_id_t sid, int pid, const char *uname,
+		const char *full)
 {
-	char file[HOMELEN];
-	sethomefile(file, uname, "msgfile");
-	file_append(file, full);
-	sethomefile(file, uname, "msgfile.me");
-	file_append(file, full);
+	if (msg_ring_push(sid, uname, full))
+		return true;
 
+	msg_file_append(uname, full);
 	return !bbs_kill(0, pid, SIGUSR2);
 }
 
 static int send_msg(const msg_session_info_t *s, const char *msg, int type)
 {
+	if (!s)
+		return 0;
+
 	char full[MAX_MSG_SIZE + 2];
 	generate_full_msg(msg, type, full, sizeof(full));
 
 	int sent = 0;
 	for (int i = 0; i < msg_session_info_count(s); ++i) {
 		if (session_msgable(s, i, type)
-				&& send_one_msg(msg_session_info_pid(s, i), 
+				&& send_one_msg(msg_session_info_sid(s, i),
+					msg_session_info_pid(s, i),
 					msg_session_info_uname(s, i), full))
 			++sent;
 	}
@@ -300,17 +576,56 @@ int msg_author(int ent, const struct fileheader *fileinfo, char *direct)
 
 int broadcast_msg(const char *msg)
 {
-	msg_session_info_t *all = db_query(MSG_SESSION_INFO_QUERY);
+	msg_session_info_t *all = msg_session_info_load(0);
+	if (!all)
+		return 0;
 	int r = send_msg(all, msg, BROADCAST_MSG);
 	msg_session_info_clear(all);
 	return r;
 }
 
+static int uid_cmp(const void *a, const void *b)
+{
+	user_id_t u1 = *(const user_id_t *) a, u2 = *(const user_id_t *) b;
+	return u1 < u2 ? -1 : u1 > u2;
+}
+
 static msg_session_info_t *get_sessions_of_followers(void)
 {
-	return db_query(MSG_SESSION_INFO_QUERY
-			" JOIN follows f ON s.user_id = f.follower"
-			" WHERE f.user_id = %"DBIdUID, session_get_user_id());
+	user_id_t *followers;
+	int count = follow_graph_followers(session_get_user_id(), &followers);
+	if (count == 0 || (count > 0
+			&& session_count_online_users(followers, count, false) == 0)) {
+		free(followers);
+		return NULL;
+	}
+
+	msg_session_info_t *s = msg_session_info_load(0);
+	if (!s) {
+		free(followers);
+		return NULL;
+	}
+
+	db_res_t *res = NULL;
+	if (count < 0) {
+		res = db_query("SELECT follower FROM follows"
+				" WHERE user_id = %"DBIdUID, session_get_user_id());
+	}
+
+	int n = 0;
+	for (int i = 0; i < s->count; ++i) {
+		user_id_t uid = s->sessions[i].user_id;
+		bool found = count < 0 ? friend_uid_list_contains(res, uid)
+				: bsearch(&uid, followers, count, sizeof(*followers), uid_cmp)
+						!= NULL;
+		if (found)
+			s->sessions[n++] = s->sessions[i];
+	}
+	s->count = n;
+
+	db_clear(res);
+	free(followers);
+	return s;
 }
 
 int logout_msg(const char *msg)
@@ -344,6 +659,17 @@ enum {
 static int get_msg3(const char *user, int *num, char *head, size_t hsize,
 		char *buf, size_t size)
 {
+	if (*num < 1)
+		*num = 1;
+	if (my_ring && *num <= msg_history_count && *num <= MSG_HISTORY_SIZE) {
+		const msg_history_t *h = msg_history
+				+ (msg_history_count - *num) % MSG_HISTORY_SIZE;
+		strlcpy(head, h->head, hsize);
+		strlcpy(buf, h->buf, size);
+		char *ptr = strrchr(head, '[');
+		return ptr ? strtol(ptr + 1, NULL, 10) : 0;
+	}
+
 	char file[HOMELEN];
 	sethomefile(file, currentuser.userid, "msgfile");
 	int all = get_num_msgs(file);
@@ -690,6 +1016,14 @@ void msg_reply(int ch)
 
 void msg_handler(int signum)
 {
-	if (msg_num++ == 0)
+	int count = msg_ring_drain(false);
+	if (count < 0)
+		count = 1; // 没有讯息环, 讯息已由发送方写入文件
+	if (!count)
+		return;
+
+	int pending = msg_num;
+	msg_num += count;
+	if (!pending)
 		msg_reply(0);
 }
@@ -6,18 +6,7 @@ static ac_list *user_build_ac_list(void)
 {
 	if (!uidshm)
 		return NULL;
-
-	ac_list *acl = ac_list_new();
-	if (!acl)
-		return NULL;
-
-	int size = uidshm->number;
-	for (int i = 0; i < size; ++i) {
-		const char *user_name = uidshm->userid[i];
-		if (*user_name)
-			ac_list_add(acl, user_name);
-	}
-	return acl;
+	return ac_list_new_lookup(ucache_prefix_search);
 }
 
 void user_complete(int row, const char *prompt, char *name, size_t size)
@@ -213,6 +213,7 @@ static int setvoteflag(const char *bname, int flag)
 	db_res_t *res = db_cmd("UPDATE boards SET flag = %d WHERE id = %d",
 			board.flag, board.id);
 	db_clear(res);
+	board_cache_invalidate();
 	if (!res)
 		prints("Error updating BOARDS file...\n");
 	return 0;
@@ -301,6 +302,7 @@ int b_notes_edit()
 		db_res_t *res = db_cmd("UPDATE boards SET flag = %d WHERE id = %d",
 				flag, currbp->id);
 		db_clear(res);
+		board_cache_invalidate();
 		return FULLUPDATE;
 	}
 	//% sprintf(buf2, "(E)编辑 (D)删除 %4s? [E]: ",
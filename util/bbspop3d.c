@@ -32,7 +32,7 @@
 /*  You needn't modify any lines below unless you know what you're doing */
 
 struct fileheader currentmail;
-struct userec currentuser;
+FB_THREAD_LOCAL struct userec currentuser;
 
 char LowUserid[20];
 char genbuf[BUFSIZE];
@@ -0,0 +1,45 @@
+#include "bbs.h"
+#include "fbbs/brc.h"
+#include "fbbs/helper.h"
+#include "fbbs/string.h"
+
+int main(int argc, char **argv)
+{
+	if (chdir(BBSHOME) < 0)
+		return EXIT_FAILURE;
+
+	initialize_environment(INIT_DB);
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			int count = brc_convert(argv[i]);
+			if (count < 0)
+				fprintf(stderr, "%s: failed\n", argv[i]);
+			else
+				printf("%s: %d boards\n", argv[i], count);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	int users = 0, boards = 0, failed = 0;
+	struct userec user;
+	for (int i = 0; i < MAXUSERS; ++i) {
+		if (getuserbyuid(&user, i + 1) < 0)
+			return EXIT_FAILURE;
+		if (!user.userid[0])
+			continue;
+		user.userid[sizeof(user.userid) - 1] = '\0';
+
+		int count = brc_convert(user.userid);
+		if (count < 0) {
+			fprintf(stderr, "%s: failed\n", user.userid);
+			++failed;
+		} else if (count > 0) {
+			++users;
+			boards += count;
+		}
+	}
+	printf("converted %d boards of %d users, %d failed\n",
+			boards, users, failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -174,5 +174,7 @@ int main(int argc, char **argv)
 
 	free(sessions);
 	db_clear(res);
+
+	session_table_sync();
 	return EXIT_SUCCESS;
 }
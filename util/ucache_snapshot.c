@@ -0,0 +1,45 @@
+#include "bbs.h"
+#include "fbbs/string.h"
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s create | verify [file]\n", prog);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		return usage(argv[0]);
+
+	if (chdir(BBSHOME) < 0)
+		return EXIT_FAILURE;
+
+	const char *file = argc > 2 ? argv[2] : UCACHE_SNAPSHOT;
+
+	if (streq(argv[1], "create")) {
+		if (resolve_ucache() == -1) {
+			fprintf(stderr, "ucache not loaded\n");
+			return EXIT_FAILURE;
+		}
+		if (ucache_snapshot_save(file) < 0) {
+			fprintf(stderr, "failed to save %s\n", file);
+			return EXIT_FAILURE;
+		}
+		printf("%s saved\n", file);
+	} else if (streq(argv[1], "verify")) {
+		fb_time_t stamp;
+		if (ucache_snapshot_verify(file, &stamp) < 0) {
+			printf("%s is invalid\n", file);
+			return EXIT_FAILURE;
+		}
+		struct stat st;
+		bool stale = stat(PASSFILE, &st) == 0 && st.st_mtime > stamp;
+		printf("%s is valid, taken with %s of %s%s\n", file, PASSFILE,
+				format_time(stamp, TIME_FORMAT_ZH),
+				stale ? " (stale)" : "");
+	} else {
+		return usage(argv[0]);
+	}
+	return EXIT_SUCCESS;
+}